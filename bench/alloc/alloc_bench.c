@@ -0,0 +1,202 @@
+
+/*
+ * Pool allocations and bytes per GET: the request context is set up
+ * the way the handler does it, then file_info and get_paths responses
+ * with 1 to 20 paths are parsed. The module is included as source, so
+ * that its static functions can be called, and the pool functions
+ * below count what it asks for. Build with -DALLOC_INLINE_ARRAYS=0
+ * against module sources, which have no ngx_http_mogilefs_init_ctx_arrays()
+ */
+
+
+#ifndef MODULE_SRC
+#define MODULE_SRC  "ngx_http_mogilefs_module.c"
+#endif
+
+#ifndef ALLOC_INLINE_ARRAYS
+#define ALLOC_INLINE_ARRAYS  1
+#endif
+
+#include MODULE_SRC
+
+
+#define ALLOC_POOL_SIZE  65536
+
+
+static ngx_uint_t  allocs;
+
+
+/*
+ * One block big enough for a request: bytes are what the pool hands out,
+ * including alignment, and ngx_array_push() extends an array in place
+ * when it is the last allocation like it does in nginx
+ */
+
+void *
+ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+    u_char  *m;
+
+    m = ngx_align_ptr(pool->d.last, NGX_ALIGNMENT);
+
+    if ((size_t) (pool->d.end - m) < size) {
+        return NULL;
+    }
+
+    allocs++;
+    pool->d.last = m + size;
+
+    return m;
+}
+
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    u_char  *m;
+
+    m = pool->d.last;
+
+    if ((size_t) (pool->d.end - m) < size) {
+        return NULL;
+    }
+
+    allocs++;
+    pool->d.last = m + size;
+
+    return m;
+}
+
+
+void *
+ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    p = ngx_palloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+static size_t
+make_args(u_char *buf, ngx_uint_t npaths)
+{
+    u_char      *p;
+    ngx_uint_t   i;
+
+    p = ngx_sprintf(buf, "paths=%ui", npaths);
+
+    for (i = 1; i <= npaths; i++) {
+        p = ngx_sprintf(p, "&path%ui=http%%3A%%2F%%2F10.0.%ui.%ui%%3A7500"
+                        "%%2Fdev%ui%%2F0%%2F000%%2F123%%2F0000123456.fid",
+                        i, i / 256, i % 256, i);
+    }
+
+    return p - buf;
+}
+
+
+static void
+bench_get(ngx_uint_t npaths)
+{
+    size_t                     used;
+    ngx_str_t                  args;
+    ngx_pool_t                 pool;
+    ngx_log_t                  log;
+    ngx_connection_t           c;
+    ngx_http_request_t         r;
+    ngx_http_mogilefs_ctx_t   *ctx;
+    void                      *rctx[1];
+    static u_char              block[ALLOC_POOL_SIZE];
+    static u_char              info[] = "fid=123456&devcount=2&length=1048576"
+                                        "&class=default&domain=testdomain"
+                                        "&key=dir%2Fkey";
+    u_char                     buf[8192], ibuf[sizeof(info)];
+
+    ngx_memzero(&pool, sizeof(ngx_pool_t));
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+    ngx_memzero(&r, sizeof(ngx_http_request_t));
+
+    pool.d.last = block;
+    pool.d.end = block + sizeof(block);
+
+    c.log = &log;
+
+    r.pool = &pool;
+    r.connection = &c;
+    r.ctx = rctx;
+
+    allocs = 0;
+
+    ctx = ngx_pcalloc(r.pool, sizeof(ngx_http_mogilefs_ctx_t));
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    ctx->cmd = &ngx_http_mogilefs_cmds[0];
+    ctx->num_paths_returned = -1;
+
+#if (ALLOC_INLINE_ARRAYS)
+    ngx_http_mogilefs_init_ctx_arrays(ctx, r.pool);
+#else
+    if (ngx_array_init(&ctx->sources, r.pool, 1, sizeof(ngx_http_mogilefs_src_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+#endif
+
+    rctx[ngx_http_mogilefs_module.ctx_index] = ctx;
+
+    /* values are unescaped in place */
+
+    args.data = ngx_cpymem(ibuf, info, sizeof(info) - 1) - (sizeof(info) - 1);
+    args.len = sizeof(info) - 1;
+
+    if (ngx_http_mogilefs_parse_params(&r, &args) != NGX_OK) {
+        goto failed;
+    }
+
+    args.data = buf;
+    args.len = make_args(buf, npaths);
+
+    if (ngx_http_mogilefs_parse_params(&r, &args) != NGX_OK
+        || ctx->sources.nelts != npaths)
+    {
+        goto failed;
+    }
+
+    used = pool.d.last - block;
+
+    printf("get_paths %2lu paths + file_info: %2lu allocations, %5lu bytes\n",
+           (unsigned long) npaths, (unsigned long) allocs, (unsigned long) used);
+
+    return;
+
+failed:
+
+    fprintf(stderr, "get_paths %lu paths failed\n", (unsigned long) npaths);
+    exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    ngx_uint_t  npaths[] = { 1, 2, 3, 5, 10, 20 };
+    ngx_uint_t  i;
+
+    /* set by nginx when it starts, unset since 1.9.11 */
+    ngx_http_mogilefs_module.ctx_index = 0;
+
+    for (i = 0; i < sizeof(npaths) / sizeof(npaths[0]); i++) {
+        bench_get(npaths[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Builds nginx with the module into bench/_build.
+# Usage: NGINX_SRC=/path/to/nginx-x.y.z bench/build.sh [configure options]
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+MODULE=$(dirname "$BENCH")
+PREFIX=${PREFIX:-$BENCH/_build}
+
+if [ -z "$NGINX_SRC" ] || [ ! -x "$NGINX_SRC/configure" ]; then
+    echo "NGINX_SRC must point to nginx sources" >&2
+    exit 1
+fi
+
+cd "$NGINX_SRC"
+
+./configure --prefix="$PREFIX" \
+    --with-threads \
+    --without-http_rewrite_module \
+    --without-http_gzip_module \
+    --add-module="$MODULE" \
+    "$@"
+
+make -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)"
+make install
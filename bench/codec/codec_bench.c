@@ -0,0 +1,142 @@
+
+/*
+ * Microbenchmark of the tracker protocol codec: ns per response
+ * for get_paths responses with 1 to 20 paths and for escaping
+ * of long keys
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <time.h>
+
+#include "ngx_http_mogilefs_codec.h"
+
+
+#define BENCH_LOOPS  200000
+
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static size_t
+make_response(u_char *buf, ngx_uint_t npaths)
+{
+    u_char      *p;
+    ngx_uint_t   i;
+
+    p = ngx_sprintf(buf, "OK paths=%ui", npaths);
+
+    for (i = 1; i <= npaths; i++) {
+        p = ngx_sprintf(p, "&path%ui=http%%3A%%2F%%2F10.0.%ui.%ui%%3A7500"
+                        "%%2Fdev%ui%%2F0%%2F000%%2F123%%2F0000123456.fid",
+                        i, i / 256, i % 256, i);
+    }
+
+    p = ngx_sprintf(p, "\r\n");
+
+    return p - buf;
+}
+
+
+static void
+bench_parse(ngx_uint_t npaths)
+{
+    size_t                         len;
+    uint64_t                       start, elapsed;
+    ngx_uint_t                     n, params;
+    ngx_str_t                      args, name, value;
+    ngx_http_mogilefs_response_t   resp;
+    u_char                         tmpl[8192], buf[8192];
+
+    len = make_response(tmpl, npaths);
+
+    params = 0;
+
+    start = now_ns();
+
+    for (n = 0; n < BENCH_LOOPS; n++) {
+
+        /* values are unescaped in place */
+        ngx_memcpy(buf, tmpl, len);
+
+        if (ngx_http_mogilefs_parse_response(buf, buf + len, &resp) != NGX_OK) {
+            fprintf(stderr, "parse failed\n");
+            exit(1);
+        }
+
+        args = resp.args;
+
+        while (ngx_http_mogilefs_next_param(&args, &name, &value) == NGX_OK) {
+            params++;
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    printf("get_paths %2lu paths, %4lu bytes: %8.1f ns/op (%lu params)\n",
+           (unsigned long) npaths, (unsigned long) len,
+           (double) elapsed / BENCH_LOOPS, (unsigned long) (params / BENCH_LOOPS));
+}
+
+
+static void
+bench_escape(size_t len, ngx_uint_t dirty)
+{
+    size_t       i;
+    uint64_t     start, elapsed;
+    ngx_uint_t   n;
+    u_char       key[1024], dst[3 * 1024], *p;
+
+    for (i = 0; i < len; i++) {
+        key[i] = (u_char) ('a' + i % 26);
+
+        if (dirty && i % 16 == 15) {
+            key[i] = ' ';
+        }
+    }
+
+    p = dst;
+
+    start = now_ns();
+
+    for (n = 0; n < BENCH_LOOPS; n++) {
+        p = ngx_http_mogilefs_escape_memcached(dst, key, len);
+        __asm__ __volatile__("" : : "r" (p) : "memory");
+    }
+
+    elapsed = now_ns() - start;
+
+    printf("escape %4lu byte key, %s: %8.1f ns/op (%lu bytes out)\n",
+           (unsigned long) len, dirty ? "space every 16" : "clean",
+           (double) elapsed / BENCH_LOOPS, (unsigned long) (p - dst));
+}
+
+
+int
+main(int argc, char **argv)
+{
+    ngx_uint_t  npaths[] = { 1, 2, 3, 5, 10, 20 };
+    size_t      keys[] = { 16, 64, 255, 1024 };
+    ngx_uint_t  i;
+
+    for (i = 0; i < sizeof(npaths) / sizeof(npaths[0]); i++) {
+        bench_parse(npaths[i]);
+    }
+
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        bench_escape(keys[i], 0);
+        bench_escape(keys[i], 1);
+    }
+
+    return 0;
+}
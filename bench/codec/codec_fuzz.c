@@ -0,0 +1,91 @@
+
+/*
+ * libFuzzer target: feeds arbitrary tracker output through
+ * parse_response and next_param the way the module does, and
+ * checks that escaping round-trips the input
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_mogilefs_codec.h"
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    u_char                        *buf, *esc, *p, *pos, *last;
+    ngx_int_t                      rc;
+    ngx_str_t                      args, name, value;
+    ngx_http_mogilefs_response_t   resp;
+
+    buf = malloc(size + 1);
+    esc = malloc(3 * size + 1);
+
+    if (buf == NULL || esc == NULL) {
+        free(buf);
+        free(esc);
+        return 0;
+    }
+
+    ngx_memcpy(buf, data, size);
+
+    pos = buf;
+    last = buf + size;
+
+    for ( ;; ) {
+        rc = ngx_http_mogilefs_parse_response(pos, last, &resp);
+
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        if (resp.next <= pos || resp.next > last) {
+            abort();
+        }
+
+        args = resp.args;
+
+        while (ngx_http_mogilefs_next_param(&args, &name, &value) == NGX_OK) {
+            if (value.data + value.len > last || name.data < buf) {
+                abort();
+            }
+        }
+
+        pos = resp.next;
+    }
+
+    /* next_param has unescaped buf in place */
+
+    ngx_memcpy(buf, data, size);
+
+    p = ngx_http_mogilefs_escape_arg(esc, buf, size);
+
+    p = ngx_http_mogilefs_unescape_arg(esc, esc, p - esc);
+
+    if ((size_t) (p - esc) != size || ngx_memcmp(esc, data, size) != 0) {
+        abort();
+    }
+
+    /* NGX_UNESCAPE_URI stops at '?', trackers always escape it */
+
+    if (memchr(data, '?', size) != NULL) {
+        goto done;
+    }
+
+    p = ngx_http_mogilefs_escape_memcached(esc, buf, size);
+
+    p = ngx_http_mogilefs_unescape(esc, esc, p - esc);
+
+    if ((size_t) (p - esc) != size || ngx_memcmp(esc, data, size) != 0) {
+        abort();
+    }
+
+done:
+
+    free(buf);
+    free(esc);
+
+    return 0;
+}
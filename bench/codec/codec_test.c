@@ -0,0 +1,243 @@
+
+/*
+ * Tests of the tracker protocol codec
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_mogilefs_codec.h"
+
+
+static ngx_uint_t  failed, passed;
+
+
+#define check(expr)                                                           \
+    if (expr) {                                                               \
+        passed++;                                                             \
+    } else {                                                                  \
+        failed++;                                                             \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+                #expr);                                                       \
+    }
+
+#define str_eq(s, lit)                                                        \
+    ((s)->len == sizeof(lit) - 1 && ngx_strncmp((s)->data, lit, (s)->len) == 0)
+
+
+static void
+test_parse_response(void)
+{
+    ngx_int_t                      rc;
+    ngx_http_mogilefs_response_t   resp;
+    u_char                         buf[256];
+
+    ngx_memcpy(buf, "OK paths=1", 10);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 10, &resp);
+    check(rc == NGX_AGAIN);
+
+    rc = ngx_http_mogilefs_parse_response(buf, buf, &resp);
+    check(rc == NGX_AGAIN);
+
+    ngx_memcpy(buf, "OK paths=1&path1=x\r\nnext", 24);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 24, &resp);
+    check(rc == NGX_OK);
+    check(resp.ok);
+    check(str_eq(&resp.line, "OK paths=1&path1=x"));
+    check(str_eq(&resp.args, "paths=1&path1=x"));
+    check(resp.next == buf + 20);
+
+    ngx_memcpy(buf, "OK \n", 4);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 4, &resp);
+    check(rc == NGX_OK);
+    check(resp.ok);
+    check(resp.args.len == 0);
+    check(resp.next == buf + 4);
+
+    ngx_memcpy(buf, "ERR unknown_key unknown_key\r\n", 29);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 29, &resp);
+    check(rc == NGX_OK);
+    check(!resp.ok);
+    check(str_eq(&resp.args, "unknown_key unknown_key"));
+
+    ngx_memcpy(buf, "OK\r\n", 4);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 4, &resp);
+    check(rc == NGX_ERROR);
+
+    ngx_memcpy(buf, "HTTP/1.0 200 OK\r\n", 17);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 17, &resp);
+    check(rc == NGX_ERROR);
+
+    ngx_memcpy(buf, "\r\n", 2);
+    rc = ngx_http_mogilefs_parse_response(buf, buf + 2, &resp);
+    check(rc == NGX_ERROR);
+}
+
+
+static void
+test_next_param(void)
+{
+    ngx_int_t   rc;
+    ngx_str_t   args, name, value;
+    u_char      buf[256];
+
+    args.len = ngx_cpymem(buf, "paths=2&&path1=http%3A%2F%2Fa%2Fb&path2=c%20d&",
+                          46) - buf;
+    args.data = buf;
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_OK);
+    check(str_eq(&name, "paths"));
+    check(str_eq(&value, "2"));
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_OK);
+    check(str_eq(&name, "path1"));
+    check(str_eq(&value, "http://a/b"));
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_OK);
+    check(str_eq(&name, "path2"));
+    check(str_eq(&value, "c d"));
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_DONE);
+
+    args.len = ngx_cpymem(buf, "novalue&a=1", 11) - buf;
+    args.data = buf;
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_ERROR);
+
+    args.len = ngx_cpymem(buf, "a=", 2) - buf;
+    args.data = buf;
+
+    rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+    check(rc == NGX_OK);
+    check(str_eq(&name, "a"));
+    check(value.len == 0);
+}
+
+
+static void
+test_escape(void)
+{
+    size_t      i, n, len;
+    u_char      src[256], dst[3 * 256], back[256], *p;
+
+    p = ngx_http_mogilefs_escape_memcached(dst, (u_char *) "a b%c\n", 6);
+    check((size_t) (p - dst) == 12);
+    check(ngx_strncmp(dst, "a%20b%25c%0A", 12) == 0);
+
+    /* runs longer than a vector with the byte to escape at every position */
+
+    for (len = 0; len < 100; len++) {
+        for (i = 0; i <= len; i++) {
+            ngx_memset(src, 'k', len);
+
+            if (i < len) {
+                src[i] = ' ';
+            }
+
+            n = ngx_http_mogilefs_escape_span(src, len);
+            check(n == i);
+
+            p = ngx_http_mogilefs_escape_memcached(dst, src, len);
+            check((size_t) (p - dst) == len + (i < len ? 2 : 0));
+
+            p = ngx_http_mogilefs_unescape(back, dst, p - dst);
+            check((size_t) (p - back) == len);
+            check(ngx_memcmp(back, src, len) == 0);
+        }
+    }
+
+    /* NGX_UNESCAPE_URI stops at '?', trackers always escape it */
+
+    for (i = 0, len = 0; i < 256; i++) {
+        if (i != '?') {
+            src[len++] = (u_char) i;
+        }
+    }
+
+    p = ngx_http_mogilefs_escape_memcached(dst, src, len);
+    p = ngx_http_mogilefs_unescape(dst, dst, p - dst);
+    check((size_t) (p - dst) == len);
+    check(ngx_memcmp(dst, src, len) == 0);
+}
+
+
+static void
+test_escape_arg(void)
+{
+    size_t      i, len;
+    u_char      src[256], dst[3 * 256], *p;
+
+    /* a list_keys prefix must not add or override arguments */
+
+    p = ngx_http_mogilefs_escape_arg(dst, (u_char *) "x&domain=other+1", 16);
+    check((size_t) (p - dst) == 22);
+    check(ngx_strncmp(dst, "x%26domain%3Dother%2B1", 22) == 0);
+    check(memchr(dst, '&', p - dst) == NULL);
+    check(memchr(dst, '=', p - dst) == NULL);
+    check(memchr(dst, '+', p - dst) == NULL);
+
+    p = ngx_http_mogilefs_escape_arg(dst, (u_char *) "dir/a-b_c.d,e:f", 15);
+    check((size_t) (p - dst) == 15);
+    check(ngx_strncmp(dst, "dir/a-b_c.d,e:f", 15) == 0);
+
+    /* trackers encode spaces as "+" */
+
+    len = ngx_cpymem(src, "a+b%26c%3d%zz%2", 15) - src;
+    p = ngx_http_mogilefs_unescape_arg(dst, src, len);
+    check((size_t) (p - dst) == 11);
+    check(ngx_strncmp(dst, "a b&c=%zz%2", 11) == 0);
+
+    for (i = 0; i < 256; i++) {
+        src[i] = (u_char) i;
+    }
+
+    p = ngx_http_mogilefs_escape_arg(dst, src, 256);
+    p = ngx_http_mogilefs_unescape_arg(dst, dst, p - dst);
+    check((size_t) (p - dst) == 256);
+    check(ngx_memcmp(dst, src, 256) == 0);
+}
+
+
+static void
+test_find(void)
+{
+    size_t      i, len;
+    u_char      buf[128], *p;
+
+    for (len = 0; len < sizeof(buf); len++) {
+        ngx_memset(buf, 'x', len);
+
+        p = ngx_http_mogilefs_find(buf, buf + len, '&', '=');
+        check(p == buf + len);
+
+        for (i = 0; i < len; i++) {
+            ngx_memset(buf, 'x', len);
+            buf[i] = (i & 1) ? '&' : '=';
+
+            p = ngx_http_mogilefs_find(buf, buf + len, '&', '=');
+            check(p == buf + i);
+        }
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    test_parse_response();
+    test_next_param();
+    test_escape();
+    test_escape_arg();
+    test_find();
+
+    printf("%lu passed, %lu failed\n", (unsigned long) passed,
+           (unsigned long) failed);
+
+    return failed ? 1 : 0;
+}
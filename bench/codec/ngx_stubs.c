@@ -0,0 +1,34 @@
+
+/*
+ * Definitions src/core/ngx_string.c refers to, so that the codec
+ * links without the rest of nginx. None of them is on a path
+ * the codec takes.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+volatile ngx_cycle_t  *ngx_cycle;
+
+
+void *
+ngx_alloc(size_t size, ngx_log_t *log)
+{
+    return malloc(size);
+}
+
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return malloc(size);
+}
+
+
+u_char *
+ngx_strerror(ngx_err_t err, u_char *errstr, size_t size)
+{
+    return ngx_cpystrn(errstr, (u_char *) strerror(err), size);
+}
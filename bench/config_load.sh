@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# Config-load benchmark: generates a configuration with LOCATIONS
+# mogilefs_pass locations and reports time of "nginx -t", start and
+# reload, and RSS of master and worker after start.
+# Usage: bench/config_load.sh [LOCATIONS]
+#
+# Environment: PREFIX, NGINX, PORT, TRACKER_PORT (see run.sh)
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+PREFIX=${PREFIX:-$BENCH/_build}
+NGINX=${NGINX:-$PREFIX/sbin/nginx}
+
+LOCATIONS=${1:-10000}
+PORT=${PORT:-8080}
+TRACKER_PORT=${TRACKER_PORT:-7001}
+
+CONF=$PREFIX/conf/locations.conf
+
+if [ ! -x "$NGINX" ]; then
+    echo "$NGINX not found, run build.sh first" >&2
+    exit 1
+fi
+
+mkdir -p "$PREFIX/logs" "$PREFIX/conf"
+
+awk -v n="$LOCATIONS" -v prefix="$PREFIX" -v port="$PORT" \
+    -v tracker="127.0.0.1:$TRACKER_PORT" 'BEGIN {
+    print "worker_processes  1;"
+    print "error_log  " prefix "/logs/error.log warn;"
+    print "pid  " prefix "/logs/nginx.pid;"
+    print "events { worker_connections  1024; }"
+    print "http {"
+    print "    access_log  off;"
+    print "    client_body_temp_path  " prefix "/client_body_temp;"
+    print "    upstream trackers { server " tracker "; }"
+    print "    server {"
+    print "        listen  127.0.0.1:" port ";"
+
+    for (i = 0; i < n; i++) {
+        print "        location /t" i "/ {"
+        print "            mogilefs_tracker trackers;"
+        print "            mogilefs_domain tenant" i ";"
+        print "            mogilefs_methods GET PUT DELETE;"
+        print "            mogilefs_pass {"
+        print "                proxy_pass $mogilefs_path;"
+        print "            }"
+        print "        }"
+    }
+
+    print "    }"
+    print "}"
+}' > "$CONF"
+
+now() {
+    date +%s%N
+}
+
+ms() {
+    echo $((($2 - $1) / 1000000))
+}
+
+rss() {
+    awk '/^VmRSS/ { print $2 " kB" }' "/proc/$1/status" 2>/dev/null || echo "n/a"
+}
+
+workers() {
+    pgrep -P "$1" | sort | tr '\n' ' '
+}
+
+NG="$NGINX -p $PREFIX -c $CONF"
+
+cleanup() {
+    $NG -s stop 2>/dev/null || true
+}
+
+trap cleanup EXIT INT TERM
+
+echo "$LOCATIONS locations, $(wc -c < "$CONF") bytes of configuration"
+
+start=$(now)
+$NG -t -q
+echo "nginx -t: $(ms $start $(now)) ms"
+
+start=$(now)
+$NG
+
+while [ ! -s "$PREFIX/logs/nginx.pid" ]; do
+    sleep 0.01
+done
+
+master=$(cat "$PREFIX/logs/nginx.pid")
+
+while [ -z "$(workers $master)" ]; do
+    sleep 0.01
+done
+
+echo "start: $(ms $start $(now)) ms"
+
+before=$(workers $master)
+
+for pid in $before; do
+    echo "rss: master $(rss $master), worker $(rss $pid)"
+done
+
+start=$(now)
+kill -HUP "$master"
+
+while :; do
+    after=$(workers $master)
+
+    if [ -n "$after" ] && [ "$after" != "$before" ]; then
+        break
+    fi
+
+    sleep 0.01
+done
+
+echo "reload: $(ms $start $(now)) ms"
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Load generator for the module: keeps --concurrency connections busy
+# with a mix of GET, HEAD, PUT and DELETE for --duration seconds and
+# reports throughput and p50/p99/p999 latencies per method.
+#
+
+import argparse
+import asyncio
+import random
+import time
+import urllib.parse
+
+
+def parse_args():
+    ap = argparse.ArgumentParser(description="mogilefs module load generator")
+    ap.add_argument("--url", default="http://127.0.0.1:8080/k/",
+                    help="location prefix, the key is appended")
+    ap.add_argument("--concurrency", type=int, default=32)
+    ap.add_argument("--duration", type=float, default=30.0)
+    ap.add_argument("--mix", default="get=90,head=5,put=4,delete=1",
+                    help="relative weights of methods")
+    ap.add_argument("--keys", type=int, default=10000)
+    ap.add_argument("--key-length", type=int, default=32,
+                    help="keys are padded to this length")
+    ap.add_argument("--put-size", type=int, default=16384)
+    return ap.parse_args()
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    i = min(len(sorted_values) - 1, int(p * len(sorted_values)))
+    return sorted_values[i]
+
+
+class Stats:
+
+    def __init__(self):
+        self.latency = {}
+        self.status = {}
+        self.errors = 0
+
+    def add(self, method, status, seconds):
+        self.latency.setdefault(method, []).append(seconds)
+        key = (method, status)
+        self.status[key] = self.status.get(key, 0) + 1
+
+    def report(self, elapsed):
+        total = sum(len(v) for v in self.latency.values())
+
+        print("%d requests in %.1fs, %.0f req/s, %d connection errors"
+              % (total, elapsed, total / elapsed, self.errors))
+        print("%-8s %9s %9s %9s %9s %9s" % ("method", "count", "req/s",
+                                             "p50 ms", "p99 ms", "p999 ms"))
+
+        everything = []
+
+        for method in sorted(self.latency):
+            values = sorted(self.latency[method])
+            everything.extend(values)
+
+            print("%-8s %9d %9.0f %9.2f %9.2f %9.2f"
+                  % (method, len(values), len(values) / elapsed,
+                     percentile(values, 0.50) * 1000,
+                     percentile(values, 0.99) * 1000,
+                     percentile(values, 0.999) * 1000))
+
+        everything.sort()
+
+        print("%-8s %9d %9.0f %9.2f %9.2f %9.2f"
+              % ("all", len(everything), len(everything) / elapsed,
+                 percentile(everything, 0.50) * 1000,
+                 percentile(everything, 0.99) * 1000,
+                 percentile(everything, 0.999) * 1000))
+
+        print("status:", ", ".join("%s %s: %d" % (m, s, n)
+                                   for (m, s), n in sorted(self.status.items())))
+
+
+async def read_response(reader, method):
+    head = await reader.readuntil(b"\r\n\r\n")
+    lines = head.decode("latin-1").split("\r\n")
+    status = int(lines[0].split(" ", 2)[1])
+
+    length = None
+    chunked = False
+    close = False
+
+    for line in lines[1:]:
+        name, _, value = line.partition(":")
+        name = name.strip().lower()
+        value = value.strip()
+
+        if name == "content-length":
+            length = int(value)
+        elif name == "transfer-encoding" and value.lower() == "chunked":
+            chunked = True
+        elif name == "connection" and value.lower() == "close":
+            close = True
+
+    if method == "HEAD" or status in (204, 304):
+        return status, close
+
+    if chunked:
+        while True:
+            size = int((await reader.readline()).split(b";")[0], 16)
+            await reader.readexactly(size + 2)
+            if size == 0:
+                break
+    elif length is not None:
+        await reader.readexactly(length)
+    else:
+        await reader.read()
+        close = True
+
+    return status, close
+
+
+async def worker(args, stats, deadline, methods, weights, body):
+    url = urllib.parse.urlsplit(args.url)
+    host = url.hostname
+    port = url.port or 80
+
+    reader = writer = None
+
+    while time.monotonic() < deadline:
+        if writer is None:
+            try:
+                reader, writer = await asyncio.open_connection(host, port)
+            except OSError:
+                stats.errors += 1
+                await asyncio.sleep(0.1)
+                continue
+
+        method = random.choices(methods, weights)[0]
+        key = ("%d" % random.randrange(args.keys)).zfill(args.key_length)
+
+        request = ("%s %s%s HTTP/1.1\r\nHost: %s\r\n"
+                   % (method, url.path, key, url.netloc))
+
+        if method == "PUT":
+            request += "Content-Length: %d\r\n\r\n" % len(body)
+            data = request.encode("latin-1") + body
+        else:
+            data = (request + "\r\n").encode("latin-1")
+
+        start = time.monotonic()
+
+        try:
+            writer.write(data)
+            await writer.drain()
+            status, close = await read_response(reader, method)
+        except (OSError, asyncio.IncompleteReadError, ValueError):
+            stats.errors += 1
+            writer.close()
+            reader = writer = None
+            continue
+
+        stats.add(method, status, time.monotonic() - start)
+
+        if close:
+            writer.close()
+            reader = writer = None
+
+    if writer is not None:
+        writer.close()
+
+
+async def main():
+    args = parse_args()
+
+    mix = dict(item.split("=") for item in args.mix.split(","))
+    methods = [m.upper() for m in mix]
+    weights = [float(w) for w in mix.values()]
+
+    body = b"x" * args.put_size
+    stats = Stats()
+
+    start = time.monotonic()
+    deadline = start + args.duration
+
+    await asyncio.gather(*(worker(args, stats, deadline, methods, weights, body)
+                           for _ in range(args.concurrency)))
+
+    stats.report(time.monotonic() - start)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
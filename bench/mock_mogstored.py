@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# Mock mogstored for benchmarks. Answers GET and HEAD of any path with
+# a body of --size bytes, takes PUT bodies and drops them, keeps
+# connections alive.
+#
+
+import argparse
+import asyncio
+import random
+
+
+def parse_args():
+    ap = argparse.ArgumentParser(description="mock mogstored")
+    ap.add_argument("--listen", default="127.0.0.1:7500")
+    ap.add_argument("--size", type=int, default=16384,
+                    help="length of files served")
+    ap.add_argument("--latency", type=float, default=0.0,
+                    help="delay before each response, ms")
+    ap.add_argument("--error-rate", type=float, default=0.0,
+                    help="fraction of requests answered with 500")
+    return ap.parse_args()
+
+
+class Store:
+
+    def __init__(self, args):
+        self.args = args
+        self.body = b"x" * args.size
+
+    def response(self, status, length, keepalive):
+        return ("HTTP/1.1 %s\r\n"
+                "Content-Length: %d\r\n"
+                "Content-Type: application/octet-stream\r\n"
+                "Connection: %s\r\n\r\n"
+                % (status, length, "keep-alive" if keepalive else "close")
+                ).encode("latin-1")
+
+    async def serve(self, reader, writer):
+        try:
+            while True:
+                request = await reader.readuntil(b"\r\n\r\n")
+
+                lines = request.decode("latin-1").split("\r\n")
+                method, _, rest = lines[0].partition(" ")
+                version = rest.rpartition(" ")[2]
+
+                headers = {}
+                for line in lines[1:]:
+                    name, _, value = line.partition(":")
+                    headers[name.strip().lower()] = value.strip()
+
+                length = int(headers.get("content-length", "0") or 0)
+                if length:
+                    await reader.readexactly(length)
+
+                keepalive = (version == "HTTP/1.1"
+                             and headers.get("connection", "").lower() != "close")
+
+                if self.args.latency:
+                    await asyncio.sleep(self.args.latency / 1000)
+
+                if random.random() < self.args.error_rate:
+                    writer.write(self.response("500 Internal Server Error", 0,
+                                               keepalive))
+                elif method == "GET":
+                    writer.write(self.response("200 OK", len(self.body), keepalive))
+                    writer.write(self.body)
+                elif method == "HEAD":
+                    writer.write(self.response("200 OK", len(self.body), keepalive))
+                elif method == "PUT":
+                    writer.write(self.response("201 Created", 0, keepalive))
+                elif method == "DELETE":
+                    writer.write(self.response("204 No Content", 0, keepalive))
+                else:
+                    writer.write(self.response("405 Not Allowed", 0, keepalive))
+
+                await writer.drain()
+
+                if not keepalive:
+                    break
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+
+async def main():
+    args = parse_args()
+    host, port = args.listen.rsplit(":", 1)
+
+    store = Store(args)
+    server = await asyncio.start_server(store.serve, host, int(port))
+
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
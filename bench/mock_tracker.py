@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+#
+# Mock MogileFS tracker for benchmarks. Speaks the line protocol
+# the module uses: get_paths, file_info, create_open, create_close,
+# delete, list_keys and noop. Paths point to mock_mogstored.py.
+#
+
+import argparse
+import asyncio
+import random
+import urllib.parse
+
+
+def parse_args():
+    ap = argparse.ArgumentParser(description="mock MogileFS tracker")
+    ap.add_argument("--listen", default="127.0.0.1:7001")
+    ap.add_argument("--store", default="127.0.0.1:7500",
+                    help="address of mock mogstored put into paths")
+    ap.add_argument("--paths", type=int, default=2,
+                    help="paths returned by get_paths and create_open")
+    ap.add_argument("--size", type=int, default=16384,
+                    help="length reported by file_info")
+    ap.add_argument("--latency", type=float, default=0.0,
+                    help="delay before each response, ms")
+    ap.add_argument("--jitter", type=float, default=0.0,
+                    help="random extra delay up to this, ms")
+    ap.add_argument("--error-rate", type=float, default=0.0,
+                    help="fraction of commands answered with ERR no_devices")
+    ap.add_argument("--unknown-rate", type=float, default=0.0,
+                    help="fraction of get_paths answered with ERR unknown_key")
+    ap.add_argument("--keys", type=int, default=1000,
+                    help="keys reported by list_keys")
+    return ap.parse_args()
+
+
+class Tracker:
+
+    def __init__(self, args):
+        self.args = args
+        self.fid = 0
+        self.commands = {
+            "get_paths": self.get_paths,
+            "file_info": self.file_info,
+            "create_open": self.create_open,
+            "create_close": self.ok,
+            "delete": self.ok,
+            "list_keys": self.list_keys,
+            "noop": self.ok,
+        }
+
+    def path(self, key, dev):
+        return "http://%s/dev%d/0/000/000/%010d.fid" % (self.args.store, dev,
+                                                       abs(hash(key)) % 10 ** 10)
+
+    @staticmethod
+    def encode(params):
+        return "&".join("%s=%s" % (k, urllib.parse.quote(str(v), safe="/:."))
+                        for k, v in params)
+
+    def ok(self, args):
+        return "OK "
+
+    def get_paths(self, args):
+        if random.random() < self.args.unknown_rate:
+            return "ERR unknown_key unknown_key"
+
+        key = args.get("key", "")
+        params = [("paths", self.args.paths)]
+        params += [("path%d" % (i + 1), self.path(key, i + 1))
+                   for i in range(self.args.paths)]
+        return "OK " + self.encode(params)
+
+    def file_info(self, args):
+        return "OK " + self.encode([
+            ("fid", abs(hash(args.get("key", "")))),
+            ("domain", args.get("domain", "")),
+            ("key", args.get("key", "")),
+            ("class", "default"),
+            ("devcount", self.args.paths),
+            ("length", self.args.size),
+        ])
+
+    def create_open(self, args):
+        self.fid += 1
+        key = args.get("key", "")
+        params = [("fid", self.fid), ("dev_count", self.args.paths)]
+        for i in range(self.args.paths):
+            params.append(("devid_%d" % (i + 1), i + 1))
+            params.append(("path_%d" % (i + 1), self.path(key, i + 1)))
+        return "OK " + self.encode(params)
+
+    def list_keys(self, args):
+        after = args.get("after", "")
+        limit = int(args.get("limit", "1000") or 1000)
+        prefix = args.get("prefix", "")
+
+        keys = ["%skey%08d" % (prefix, i) for i in range(self.args.keys)]
+        keys = [k for k in keys if k > after][:limit]
+
+        if not keys:
+            return "ERR none_match none_match"
+
+        params = [("key_count", len(keys)), ("next_after", keys[-1])]
+        params += [("key_%d" % (i + 1), k) for i, k in enumerate(keys)]
+        return "OK " + self.encode(params)
+
+    def respond(self, line):
+        cmd, _, rest = line.partition(" ")
+        args = dict(urllib.parse.parse_qsl(rest, keep_blank_values=True))
+
+        handler = self.commands.get(cmd)
+
+        if handler is None:
+            return "ERR unknown_command unknown_command"
+
+        if cmd != "noop" and random.random() < self.args.error_rate:
+            return "ERR no_devices No+devices"
+
+        return handler(args)
+
+    async def serve(self, reader, writer):
+        try:
+            while True:
+                line = await reader.readline()
+                if not line:
+                    break
+
+                delay = self.args.latency + random.random() * self.args.jitter
+                if delay:
+                    await asyncio.sleep(delay / 1000)
+
+                response = self.respond(line.decode("latin-1").strip())
+                writer.write((response + "\r\n").encode("latin-1"))
+                await writer.drain()
+        except ConnectionError:
+            pass
+        finally:
+            writer.close()
+
+
+async def main():
+    args = parse_args()
+    host, port = args.listen.rsplit(":", 1)
+
+    tracker = Tracker(args)
+    server = await asyncio.start_server(tracker.serve, host, int(port))
+
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
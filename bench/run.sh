@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Starts mock tracker, mock mogstored and nginx built by build.sh,
+# runs load.py against them and stops everything.
+# Usage: bench/run.sh [load.py options]
+#
+# Environment: WORKERS, PORT, TRACKER_PORT, STORE_PORT, PATHS, SIZE,
+# TRACKER_LATENCY, TRACKER_ERRORS, STORE_LATENCY (ms, fractions)
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+PREFIX=${PREFIX:-$BENCH/_build}
+NGINX=${NGINX:-$PREFIX/sbin/nginx}
+
+WORKERS=${WORKERS:-1}
+PORT=${PORT:-8080}
+TRACKER_PORT=${TRACKER_PORT:-7001}
+STORE_PORT=${STORE_PORT:-7500}
+PATHS=${PATHS:-2}
+SIZE=${SIZE:-16384}
+
+if [ ! -x "$NGINX" ]; then
+    echo "$NGINX not found, run build.sh first" >&2
+    exit 1
+fi
+
+mkdir -p "$PREFIX/logs" "$PREFIX/conf"
+
+sed -e "s|@PREFIX@|$PREFIX|g" \
+    -e "s|@PORT@|$PORT|g" \
+    -e "s|@TRACKER@|127.0.0.1:$TRACKER_PORT|g" \
+    -e "s|@WORKERS@|$WORKERS|g" \
+    "$BENCH/nginx.conf.in" > "$PREFIX/conf/bench.conf"
+
+python3 "$BENCH/mock_mogstored.py" --listen 127.0.0.1:$STORE_PORT \
+    --size $SIZE --latency ${STORE_LATENCY:-0} &
+STORE_PID=$!
+
+python3 "$BENCH/mock_tracker.py" --listen 127.0.0.1:$TRACKER_PORT \
+    --store 127.0.0.1:$STORE_PORT --paths $PATHS --size $SIZE \
+    --latency ${TRACKER_LATENCY:-0} --error-rate ${TRACKER_ERRORS:-0} &
+TRACKER_PID=$!
+
+cleanup() {
+    "$NGINX" -p "$PREFIX" -c "$PREFIX/conf/bench.conf" -s stop 2>/dev/null || true
+    kill $TRACKER_PID $STORE_PID 2>/dev/null || true
+}
+
+trap cleanup EXIT INT TERM
+
+sleep 1
+
+"$NGINX" -p "$PREFIX" -c "$PREFIX/conf/bench.conf"
+
+sleep 1
+
+python3 "$BENCH/load.py" --url http://127.0.0.1:$PORT/k/ --put-size $SIZE "$@"
@@ -0,0 +1,393 @@
+
+/*
+ * Copyright (C) 2009 Valery Kholodkov
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_mogilefs_codec.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+/*
+ * Returns the number of leading bytes, which need no escaping
+ * in terms of NGX_ESCAPE_MEMCACHED, i.e. are not
+ * control characters, space or "%"
+ */
+size_t
+ngx_http_mogilefs_escape_span(u_char *p, size_t size)
+{
+    size_t                          n;
+#if defined(__AVX2__)
+    __m256i                         v32, space32, percent32;
+    unsigned int                    mask32;
+#endif
+#if defined(__SSE2__)
+    __m128i                         v, space, percent;
+    unsigned int                    mask;
+#endif
+
+    n = 0;
+
+#if defined(__AVX2__)
+    space32 = _mm256_set1_epi8(' ');
+    percent32 = _mm256_set1_epi8('%');
+
+    for ( /* void */ ; n + 32 <= size; n += 32) {
+        v32 = _mm256_loadu_si256((const __m256i *) (p + n));
+
+        /* unsigned v <= ' ' is min(v, ' ') == v */
+        mask32 = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+                     _mm256_cmpeq_epi8(_mm256_min_epu8(v32, space32), v32),
+                     _mm256_cmpeq_epi8(v32, percent32)));
+
+        if (mask32) {
+            return n + __builtin_ctz(mask32);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    space = _mm_set1_epi8(' ');
+    percent = _mm_set1_epi8('%');
+
+    for ( /* void */ ; n + 16 <= size; n += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + n));
+
+        mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+                   _mm_cmpeq_epi8(_mm_min_epu8(v, space), v),
+                   _mm_cmpeq_epi8(v, percent)));
+
+        if (mask) {
+            return n + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for ( /* void */ ; n < size; n++) {
+        if (p[n] <= ' ' || p[n] == '%') {
+            break;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Same as ngx_escape_uri(dst, src, size, NGX_ESCAPE_MEMCACHED),
+ * but copies runs of clean bytes at once. Destination must
+ * have room for 3 * size bytes
+ */
+u_char *
+ngx_http_mogilefs_escape_memcached(u_char *dst, u_char *src, size_t size)
+{
+    size_t                          n;
+    static u_char                   hex[] = "0123456789ABCDEF";
+
+    while (size) {
+        n = ngx_http_mogilefs_escape_span(src, size);
+
+        dst = ngx_cpymem(dst, src, n);
+
+        src += n;
+        size -= n;
+
+        if (size == 0) {
+            break;
+        }
+
+        *dst++ = '%';
+        *dst++ = hex[*src >> 4];
+        *dst++ = hex[*src & 0xf];
+
+        src++;
+        size--;
+    }
+
+    return dst;
+}
+
+/*
+ * Returns pointer to the first occurence of c1 or c2
+ * in [p, last) or last if there is none
+ */
+u_char *
+ngx_http_mogilefs_find(u_char *p, u_char *last, u_char c1, u_char c2)
+{
+#if defined(__AVX2__)
+    __m256i                         v32, a32, b32;
+    unsigned int                    mask32;
+#endif
+#if defined(__SSE2__)
+    __m128i                         v, a, b;
+    unsigned int                    mask;
+#endif
+
+#if defined(__AVX2__)
+    a32 = _mm256_set1_epi8((char) c1);
+    b32 = _mm256_set1_epi8((char) c2);
+
+    for ( /* void */ ; last - p >= 32; p += 32) {
+        v32 = _mm256_loadu_si256((const __m256i *) p);
+
+        mask32 = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+                     _mm256_cmpeq_epi8(v32, a32), _mm256_cmpeq_epi8(v32, b32)));
+
+        if (mask32) {
+            return p + __builtin_ctz(mask32);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    a = _mm_set1_epi8((char) c1);
+    b = _mm_set1_epi8((char) c2);
+
+    for ( /* void */ ; last - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+                   _mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for ( /* void */ ; p < last; p++) {
+        if (*p == c1 || *p == c2) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+/*
+ * Copies src to dst decoding %XX sequences, dst may be equal to src
+ */
+u_char *
+ngx_http_mogilefs_unescape(u_char *dst, u_char *src, size_t size)
+{
+    u_char                         *p, *last;
+
+    last = src + size;
+
+    p = ngx_http_mogilefs_find(src, last, '%', '%');
+
+    if (dst == src) {
+        dst = p;
+
+    } else {
+        dst = ngx_cpymem(dst, src, p - src);
+    }
+
+    if (p != last) {
+        ngx_unescape_uri(&dst, &p, last - p, NGX_UNESCAPE_URI);
+    }
+
+    return dst;
+}
+
+/*
+ * Escapes a request argument the way MogileFS clients do: everything
+ * but [A-Za-z0-9_.,/:-] is escaped, so that "&", "=" and "+" in user
+ * supplied values cannot inject arguments. Destination must have room
+ * for 3 * size bytes
+ */
+u_char *
+ngx_http_mogilefs_escape_arg(u_char *dst, u_char *src, size_t size)
+{
+    static u_char                   hex[] = "0123456789ABCDEF";
+
+                    /* all but [A-Za-z0-9_.,/:-] */
+
+    static uint32_t                 arg[] = {
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+
+                    /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
+        0xf8000fff, /* 1111 1000 0000 0000  0000 1111 1111 1111 */
+
+                    /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
+        0x78000001, /* 0111 1000 0000 0000  0000 0000 0000 0001 */
+
+                    /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
+        0xf8000001, /* 1111 1000 0000 0000  0000 0000 0000 0001 */
+
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff  /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+    };
+
+    while (size) {
+        if (arg[*src >> 5] & (1U << (*src & 0x1f))) {
+            *dst++ = '%';
+            *dst++ = hex[*src >> 4];
+            *dst++ = hex[*src & 0xf];
+            src++;
+
+        } else {
+            *dst++ = *src++;
+        }
+
+        size--;
+    }
+
+    return dst;
+}
+
+/*
+ * Copies src to dst decoding "+" and %XX sequences the way trackers
+ * encode arguments, dst may be equal to src
+ */
+u_char *
+ngx_http_mogilefs_unescape_arg(u_char *dst, u_char *src, size_t size)
+{
+    ngx_int_t                       c;
+    u_char                         *last;
+
+    last = src + size;
+
+    while (src < last) {
+        if (*src == '+') {
+            *dst++ = ' ';
+            src++;
+            continue;
+        }
+
+        if (*src == '%' && last - src >= 3) {
+            c = ngx_hextoi(src + 1, 2);
+
+            if (c != NGX_ERROR) {
+                *dst++ = (u_char) c;
+                src += 3;
+                continue;
+            }
+        }
+
+        *dst++ = *src++;
+    }
+
+    return dst;
+}
+
+/*
+ * Looks for a complete response line in [pos, last). Returns NGX_AGAIN
+ * if there is none yet, NGX_ERROR if the line is neither OK nor ERR
+ */
+ngx_int_t
+ngx_http_mogilefs_parse_response(u_char *pos, u_char *last,
+    ngx_http_mogilefs_response_t *resp)
+{
+    u_char                         *p;
+
+    p = ngx_http_mogilefs_find(pos, last, LF, LF);
+
+    if (p == last) {
+        return NGX_AGAIN;
+    }
+
+    resp->next = p + 1;
+
+    resp->line.data = pos;
+    resp->line.len = p - pos;
+
+    if (resp->line.len && pos[resp->line.len - 1] == CR) {
+        resp->line.len--;
+    }
+
+    if (resp->line.len >= sizeof("OK ") - 1
+        && ngx_strncmp(pos, "OK ", sizeof("OK ") - 1) == 0)
+    {
+        resp->ok = 1;
+
+        resp->args.data = pos + sizeof("OK ") - 1;
+        resp->args.len = resp->line.len - (sizeof("OK ") - 1);
+
+        return NGX_OK;
+    }
+
+    if (resp->line.len >= sizeof("ERR ") - 1
+        && ngx_strncmp(pos, "ERR ", sizeof("ERR ") - 1) == 0)
+    {
+        resp->ok = 0;
+
+        resp->args.data = pos + sizeof("ERR ") - 1;
+        resp->args.len = resp->line.len - (sizeof("ERR ") - 1);
+
+        return NGX_OK;
+    }
+
+    return NGX_ERROR;
+}
+
+/*
+ * Takes the next non-empty parameter off args and unescapes its value
+ * in place. Returns NGX_DONE when there are no more parameters
+ */
+ngx_int_t
+ngx_http_mogilefs_next_param(ngx_str_t *args, ngx_str_t *name, ngx_str_t *value)
+{
+    u_char                         *p, *last;
+    ngx_str_t                       param;
+
+    last = args->data + args->len;
+
+    do {
+        if (args->data == last) {
+            return NGX_DONE;
+        }
+
+        p = ngx_http_mogilefs_find(args->data, last, '&', '&');
+
+        param.data = args->data;
+        param.len = p - args->data;
+
+        args->data = (p == last) ? last : p + 1;
+        args->len = last - args->data;
+
+    } while (param.len == 0);
+
+    if (ngx_http_mogilefs_split_param(&param, name, value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    value->len = ngx_http_mogilefs_unescape(value->data, value->data, value->len)
+        - value->data;
+
+    return NGX_OK;
+}
+
+/*
+ * Splits name=value, the value is left escaped
+ */
+ngx_int_t
+ngx_http_mogilefs_split_param(ngx_str_t *param, ngx_str_t *name, ngx_str_t *value)
+{
+    u_char                         *p, *last;
+
+    last = param->data + param->len;
+
+    p = ngx_http_mogilefs_find(param->data, last, '=', '=');
+
+    if (p == last) {
+        return NGX_ERROR;
+    }
+
+    name->data = param->data;
+    name->len = p - param->data;
+
+    value->data = p + 1;
+    value->len = last - value->data;
+
+    return NGX_OK;
+}
@@ -0,0 +1,41 @@
+
+/*
+ * Copyright (C) 2009 Valery Kholodkov
+ */
+
+
+#ifndef _NGX_HTTP_MOGILEFS_CODEC_H_INCLUDED_
+#define _NGX_HTTP_MOGILEFS_CODEC_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * Tracker protocol codec. It knows nothing about requests
+ * and upstreams and operates on plain buffers only.
+ */
+
+typedef struct {
+    ngx_str_t                 line;     /* without CRLF */
+    ngx_str_t                 args;     /* after "OK " or "ERR " */
+    u_char                   *next;     /* first byte after LF */
+    unsigned                  ok:1;
+} ngx_http_mogilefs_response_t;
+
+size_t ngx_http_mogilefs_escape_span(u_char *p, size_t size);
+u_char *ngx_http_mogilefs_escape_memcached(u_char *dst, u_char *src, size_t size);
+u_char *ngx_http_mogilefs_unescape(u_char *dst, u_char *src, size_t size);
+u_char *ngx_http_mogilefs_escape_arg(u_char *dst, u_char *src, size_t size);
+u_char *ngx_http_mogilefs_unescape_arg(u_char *dst, u_char *src, size_t size);
+u_char *ngx_http_mogilefs_find(u_char *p, u_char *last, u_char c1, u_char c2);
+
+ngx_int_t ngx_http_mogilefs_parse_response(u_char *pos, u_char *last,
+    ngx_http_mogilefs_response_t *resp);
+ngx_int_t ngx_http_mogilefs_next_param(ngx_str_t *args, ngx_str_t *name,
+    ngx_str_t *value);
+ngx_int_t ngx_http_mogilefs_split_param(ngx_str_t *param, ngx_str_t *name,
+    ngx_str_t *value);
+
+
+#endif /* _NGX_HTTP_MOGILEFS_CODEC_H_INCLUDED_ */
@@ -9,17 +9,131 @@
 #include <ngx_http.h>
 #include <nginx.h>
 
+#include <ngx_md5.h>
+
+#include "ngx_http_mogilefs_codec.h"
+
 /*
  * NOTE: Once you change the value of this macro to >10,
  * you need to do adapt the code accordingly
  */
 #define NGX_MOGILEFS_MAX_PATHS  10
 
+/*
+ * Keys are stored in VARCHAR(255) column by MogileFS
+ */
+#define NGX_MOGILEFS_MAX_KEY_LEN    255
+
+/*
+ * Trackers refuse to list more than 1000 keys at once
+ */
+#define NGX_MOGILEFS_LIST_PAGE_SIZE 1000
+
+/*
+ * Number of tracker latency histogram buckets,
+ * see ngx_http_mogilefs_latency_bounds
+ */
+#define NGX_MOGILEFS_LATENCY_BUCKETS 12
+
+/*
+ * Trackers beyond that are not accounted individually
+ * in the status zone
+ */
+#define NGX_MOGILEFS_STATUS_TRACKERS 32
+
+/*
+ * mogilefs_adaptive_timeout takes latency of a tracker over the current
+ * and the previous window of that many seconds. Trackers with fewer
+ * successful samples than that get the maximum timeout
+ */
+#define NGX_MOGILEFS_LATENCY_WINDOW   10
+#define NGX_MOGILEFS_ADAPTIVE_SAMPLES 50
+
+/*
+ * Number of key generation slots in the cache zone,
+ * keys hashed into the same slot share a generation
+ */
+#define NGX_MOGILEFS_CACHE_GENERATIONS 1024
+
+/*
+ * Upper bound of keys looked ahead by mogilefs_prefetch,
+ * each one costs a tracker connection
+ */
+#define NGX_MOGILEFS_MAX_PREFETCH 16
+
+/*
+ * Cache snapshot file signature, bump the version
+ * once layout of the entries changes
+ */
+#define NGX_MOGILEFS_SNAPSHOT_MAGIC    0x53474f4d   /* "MOGS" */
+#define NGX_MOGILEFS_SNAPSHOT_VERSION  1
+
+/*
+ * Cache entries copied under the zone lock at once while
+ * writing the snapshot, and the initial size of the copy
+ */
+#define NGX_MOGILEFS_SNAPSHOT_BATCH    256
+#define NGX_MOGILEFS_SNAPSHOT_BUFFER   65536
+
+/*
+ * States of pre-connected tracker connections
+ */
+#define NGX_MOGILEFS_KEEPALIVE_CONNECT  0
+#define NGX_MOGILEFS_KEEPALIVE_IDLE     1
+#define NGX_MOGILEFS_KEEPALIVE_NOOP     2
+
+/*
+ * Room for the response to noop
+ */
+#define NGX_MOGILEFS_KEEPALIVE_BUFFER   64
+
+/*
+ * Thread pools appeared in 1.7.11, NGX_THREADS
+ * of earlier versions means something else
+ */
+#if (NGX_THREADS) && defined nginx_version && nginx_version >= 1007011
+#define NGX_MOGILEFS_THREADS 1
+#else
+#define NGX_MOGILEFS_THREADS 0
+#endif
+
+/*
+ * Round robin peers are an array before 1.9.0, since then they are
+ * a list that lives in shared memory if the upstream has a zone
+ */
+#if defined nginx_version && nginx_version >= 1009000
+#define ngx_http_mogilefs_peer_first(peers)       (peers)->peer
+#define ngx_http_mogilefs_peer_next(peers, p)     (p)->next
+#else
+#define ngx_http_mogilefs_peer_first(peers)       &(peers)->peer[0]
+#define ngx_http_mogilefs_peer_next(peers, p)                                 \
+    ((p) + 1 < &(peers)->peer[(peers)->number] ? (p) + 1 : NULL)
+#define ngx_http_upstream_rr_peers_rlock(peers)
+#define ngx_http_upstream_rr_peers_unlock(peers)
+#define ngx_http_upstream_rr_peer_lock(peers, peer)
+#define ngx_http_upstream_rr_peer_unlock(peers, peer)
+#endif
+
+/*
+ * Chunk of request body temp file read at once by checksum
+ */
+#define NGX_MOGILEFS_CHECKSUM_BUFFER 32768
+
+#define NGX_MOGILEFS_STATUS_TEXT    0
+#define NGX_MOGILEFS_STATUS_JSON    1
+
+/*
+ * Prefix of the internal location shared by all mogilefs_pass
+ * locations of a server, followed by 'f', 'l' or 'r' and the index
+ * of mogilefs_pass location
+ */
+#define NGX_MOGILEFS_DISPATCH_PREFIX "/mogstored_spare/"
+
 typedef enum {
     NGX_MOGILEFS_MAIN,
-    NGX_MOGILEFS_CREATE_OPEN,
-    NGX_MOGILEFS_CREATE_CLOSE,
     NGX_MOGILEFS_FETCH,
+    NGX_MOGILEFS_LIST_KEYS,
+    NGX_MOGILEFS_DISPATCH,
 } ngx_http_mogilefs_location_type_t;
 
 typedef struct {
@@ -28,6 +142,138 @@ typedef struct {
     ngx_flag_t               delete_ok;
 } ngx_http_mogilefs_error_t;
 
+typedef enum {
+    NGX_MOGILEFS_STAT_GET_PATHS,
+    NGX_MOGILEFS_STAT_FILE_INFO,
+    NGX_MOGILEFS_STAT_CREATE_OPEN,
+    NGX_MOGILEFS_STAT_CREATE_CLOSE,
+    NGX_MOGILEFS_STAT_DELETE,
+    NGX_MOGILEFS_STAT_LIST_KEYS,
+    NGX_MOGILEFS_STAT_CMDS
+} ngx_http_mogilefs_stat_cmd_t;
+
+typedef enum {
+    NGX_MOGILEFS_VAR_TRACKER_ADDR,
+    NGX_MOGILEFS_VAR_TRACKER_TIME,
+    NGX_MOGILEFS_VAR_COMMAND,
+    NGX_MOGILEFS_VAR_PATHS_RETURNED,
+    NGX_MOGILEFS_VAR_ERROR,
+    NGX_MOGILEFS_VAR_PUT_BODY_TIME,
+    NGX_MOGILEFS_VAR_PUT_CREATE_OPEN_TIME,
+    NGX_MOGILEFS_VAR_PUT_STORE_TIME,
+    NGX_MOGILEFS_VAR_PUT_CREATE_CLOSE_TIME,
+    NGX_MOGILEFS_VAR_CACHE_STATUS,
+    NGX_MOGILEFS_VAR_DOMAIN,
+    NGX_MOGILEFS_VAR_KEY,
+    NGX_MOGILEFS_VAR_LOCAL_PATH,
+    NGX_MOGILEFS_VARS
+} ngx_http_mogilefs_var_t;
+
+typedef struct {
+    ngx_atomic_t             requests;
+    ngx_atomic_t             errors;
+    ngx_atomic_t             latency[NGX_MOGILEFS_LATENCY_BUCKETS];
+} ngx_http_mogilefs_stat_t;
+
+typedef struct {
+    ngx_http_mogilefs_stat_t stat;
+    ngx_atomic_t             window;    /* number of the current window */
+    ngx_atomic_t             recent[2][NGX_MOGILEFS_LATENCY_BUCKETS];
+    size_t                   name_len;
+    u_char                   name[NGX_SOCKADDR_STRLEN];
+} ngx_http_mogilefs_tracker_stat_t;
+
+typedef struct ngx_http_mogilefs_status_s ngx_http_mogilefs_status_t;
+
+/*
+ * Result of get_paths in the cache zone, laid over
+ * ngx_rbtree_node_t starting from its color field.
+ * Data holds domain, key, length and paths one after another
+ */
+typedef struct {
+    u_char                   color;
+    u_char                   npaths;
+    u_short                  domain_len;
+    u_short                  key_len;
+    u_short                  length_len;
+    ngx_queue_t              queue;
+    time_t                   expire;
+    time_t                   drop;      /* served stale till then */
+    time_t                   update;    /* refreshed till then */
+    unsigned                 failed:1;
+    unsigned                 saved:1;   /* differs from epoch till saved */
+    u_short                  path_len[NGX_MOGILEFS_MAX_PATHS];
+    u_char                   data[1];
+} ngx_http_mogilefs_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_queue_t              queue;
+    ngx_atomic_t             generation[NGX_MOGILEFS_CACHE_GENERATIONS];
+    time_t                   snapshot;  /* last written */
+    ngx_queue_t              marker;    /* in queue while writing */
+    unsigned                 saving:1;
+    unsigned                 epoch:1;
+} ngx_http_mogilefs_cache_sh_t;
+
+/*
+ * Cache snapshot file is a header followed by entries,
+ * each padded to NGX_ALIGNMENT, so that it can be read in place.
+ * Entries go from the least recently used one
+ */
+typedef struct {
+    uint32_t                 magic;
+    uint32_t                 version;
+    uint32_t                 max_paths;
+    uint32_t                 nentries;
+    time_t                   time;
+} ngx_http_mogilefs_snapshot_header_t;
+
+typedef struct {
+    time_t                   expire;
+    time_t                   drop;
+    u_short                  domain_len;
+    u_short                  key_len;
+    u_short                  length_len;
+    u_short                  npaths;
+    u_short                  path_len[NGX_MOGILEFS_MAX_PATHS];
+} ngx_http_mogilefs_snapshot_entry_t;
+
+/*
+ * Configuration a request is dispatched to once paths are known
+ */
+typedef struct {
+    void                        **loc_conf;
+    void                        **fetch_loc_conf;
+} ngx_http_mogilefs_dispatch_t;
+
+typedef struct {
+    ngx_shm_zone_t               *status_zone;
+    ngx_slab_pool_t              *status_shpool;
+    ngx_http_mogilefs_status_t   *status;
+    ngx_flag_t                    status_used;
+    ngx_flag_t                    adaptive_used;
+    ngx_shm_zone_t               *cache_zone;
+    ngx_slab_pool_t              *cache_shpool;
+    ngx_http_mogilefs_cache_sh_t *cache;
+    ngx_flag_t                    cache_used;
+    ngx_str_t                     cache_snapshot;
+    ngx_str_t                     cache_snapshot_temp;
+    time_t                        cache_snapshot_interval;
+    time_t                        cache_snapshot_valid;
+    ngx_event_t                   cache_snapshot_event;
+    ngx_array_t                   upstreams;
+    ngx_uint_t                    keepalive_max;
+    ngx_msec_t                    keepalive_noop;
+    ngx_uint_t                    max_conns;
+    ngx_uint_t                    max_queue;
+    ngx_msec_t                    queue_timeout;
+    ngx_array_t                   dispatch;
+    ngx_http_core_srv_conf_t     *dispatch_srv;
+    ngx_int_t                     var_index[NGX_MOGILEFS_VARS];
+} ngx_http_mogilefs_main_conf_t;
+
 typedef struct {
     ngx_uint_t               method; 
     ngx_str_t                name;
@@ -41,68 +287,370 @@ typedef struct {
     ngx_array_t                *values;
 } ngx_http_mogilefs_class_template_t;
 
+/*
+ * Static parts of tracker commands rendered at configuration time
+ */
+typedef struct {
+    ngx_str_t                   domain;
+    ngx_str_t                   args;
+    unsigned                    static_class:1;
+} ngx_http_mogilefs_cmd_template_t;
+
+/*
+ * Storage node URL prefix served from local disk
+ */
+typedef struct {
+    ngx_str_t                   prefix;
+    ngx_str_t                   root;
+} ngx_http_mogilefs_local_root_t;
+
+typedef struct {
+#if (NGX_PCRE)
+    ngx_regex_t                *regex;
+#endif
+    ngx_uint_t                  count;
+} ngx_http_mogilefs_prefetch_t;
+
 typedef struct ngx_http_mogilefs_loc_conf_s {
-    struct ngx_http_mogilefs_loc_conf_s *parent;
     ngx_uint_t                 methods;
     ngx_str_t                  key;
     ngx_array_t                *key_lengths;
     ngx_array_t                *key_values;
     ngx_int_t                  index[NGX_MOGILEFS_MAX_PATHS];
+    ngx_int_t                  length_index;
     ngx_http_upstream_conf_t   upstream;
     ngx_array_t                *tracker_lengths;
     ngx_array_t                *tracker_values;
     ngx_http_complex_value_t   *domain_complex;
     ngx_array_t                *class_templates;
     ngx_str_t                  fetch_location;
+    ngx_str_t                  local_location;
+    ngx_str_t                  redirect_location;
+    ngx_flag_t                 redirect;
+    off_t                      redirect_min_size;
+    ngx_str_t                  redirect_secret;
+    time_t                     redirect_expires;
+    ngx_md5_t                  redirect_ipad;
+    ngx_md5_t                  redirect_opad;
+    ngx_array_t                *local_roots;
     ngx_flag_t                 noverify;
+    ngx_flag_t                 checksum;
+#if (NGX_MOGILEFS_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+#endif
+    ngx_flag_t                 file_info;
+    ngx_http_mogilefs_cmd_template_t cmd_template;
     ngx_http_mogilefs_location_type_t location_type;
-    ngx_str_t                  create_open_spare_location;
-    ngx_str_t                  create_close_spare_location;
+    ngx_uint_t                 list_page_size;
+    ngx_uint_t                 status_format;
+    ngx_msec_t                 slow_put_threshold;
+    size_t                     put_memory_threshold;
+    void                       **put_memory_loc_conf;
+    ngx_uint_t                 adaptive_factor;
+    ngx_msec_t                 adaptive_min;
+    ngx_msec_t                 adaptive_max;
+    time_t                     cache_valid;
+    time_t                     cache_stale;
+    time_t                     cache_stale_if_error;
+    ngx_http_mogilefs_prefetch_t *prefetch;
 } ngx_http_mogilefs_loc_conf_t;
 
 typedef struct {
-    ngx_str_t                 name, value;
-} ngx_http_mogilefs_aux_param_t;
+    ssize_t                   priority;
+    ngx_str_t                 path;
+} ngx_http_mogilefs_src_t;
 
+typedef struct ngx_http_mogilefs_upstream_s ngx_http_mogilefs_upstream_t;
+typedef struct ngx_http_mogilefs_tracker_s ngx_http_mogilefs_tracker_t;
+
+/*
+ * Sources are kept in the ctx itself,
+ * the array moves to the pool only once it overflows
+ */
 typedef struct {
     ngx_http_mogilefs_cmd_t  *cmd;
-    ngx_array_t               sources; 
+    ngx_array_t               sources;
     ssize_t                   num_paths_returned;
-    ngx_array_t              *aux_params;
     ngx_str_t                 key;
+    ngx_str_t                 domain;
     ngx_int_t                 status;
 
-    struct sockaddr          *peer_addr;
-    socklen_t                 peer_addr_len;
+    ngx_str_t                 length;
+    ngx_str_t                 class_name;
+
+    ngx_msec_t                start;
+
+    ngx_atomic_uint_t         cache_generation;
+
+    ngx_http_mogilefs_upstream_t *slot;
+
+    unsigned                  file_info:1;
+    unsigned                  cache_refresh:1;
+
+    ngx_http_mogilefs_src_t   source_buf[NGX_MOGILEFS_MAX_PATHS];
 } ngx_http_mogilefs_ctx_t;
 
 typedef enum {
     START,
+    CHECKSUM,
     CREATE_OPEN,
-    FETCH,
+    STORE,
     CREATE_CLOSE,
 } ngx_http_mogilefs_put_state_t;
 
+/*
+ * Device and path returned by create_open
+ */
+typedef struct {
+    ngx_str_t                        devid;
+    ngx_str_t                        path;
+} ngx_http_mogilefs_dest_t;
+
+/*
+ * Upload goes through create_open, PUT to one of the
+ * returned paths and create_close. The tracker connection is
+ * kept between the commands, the storage node is connected
+ * directly
+ */
 typedef struct {
-    ngx_http_post_subrequest_t      *psr;
     ngx_http_mogilefs_put_state_t    state;
-    ngx_int_t                        status;
-    ngx_http_mogilefs_ctx_t         *create_open_ctx;
     ngx_str_t                        key;
-
-    ngx_uint_t                       num_successful_stores;
+    ngx_str_t                        domain;
+    ngx_str_t                        args;      /* key, domain and class */
+
+    ngx_http_mogilefs_tracker_t     *tracker;
+    ngx_http_upstream_srv_conf_t    *tracker_upstream;  /* resolved */
+    ngx_http_mogilefs_upstream_t    *slot;
+    ngx_http_mogilefs_response_t     resp;
+
+    ngx_str_t                        fid;
+    ngx_uint_t                       ndests;
+    ngx_uint_t                       dest;      /* being stored to */
+    ngx_http_mogilefs_dest_t         dests[NGX_MOGILEFS_MAX_PATHS];
+
+    off_t                            size;
+
+    ngx_peer_connection_t            store;
+    u_char                           store_sockaddr[NGX_SOCKADDRLEN];
+    socklen_t                        store_socklen;
+    in_port_t                        store_port;
+    ngx_str_t                        store_name;
+    ngx_resolver_ctx_t              *store_resolve;
+    ngx_output_chain_ctx_t           output;
+    ngx_chain_writer_ctx_t           writer;
+    ngx_chain_t                     *store_out;
+    ngx_buf_t                        store_buffer;
+
+    ngx_str_t                        checksum;
+
+    ngx_msec_t                       start;
+    ngx_msec_t                       phase_start;
+    ngx_msec_t                       body_time;
+    ngx_msec_t                       create_open_time;
+    ngx_msec_t                       store_time;
+    ngx_msec_t                       create_close_time;
 } ngx_http_mogilefs_put_ctx_t;
 
+/*
+ * Idle connections to the trackers of an upstream and requests
+ * waiting for a free slot, per worker. Idle connections are opened
+ * at worker start and kept alive with noop
+ */
+struct ngx_http_mogilefs_upstream_s {
+    ngx_http_upstream_srv_conf_t          *upstream;
+    ngx_http_upstream_init_peer_pt         original_init_peer;
+    ngx_queue_t                            cache;
+    ngx_queue_t                            free;
+    ngx_event_t                            event;
+    ngx_uint_t                             active;
+    ngx_uint_t                             queued;
+    ngx_queue_t                            waiting;
+};
+
+typedef void (*ngx_http_mogilefs_resume_pt)(ngx_http_request_t *r);
+
+/*
+ * Request waiting for mogilefs_tracker_max_conns slot,
+ * it is resumed once the slot is stored in *slot
+ */
 typedef struct {
-    ssize_t                   priority;
-    ngx_str_t                 path;
-} ngx_http_mogilefs_src_t;
+    ngx_queue_t                            queue;
+    ngx_http_request_t                    *request;
+    ngx_http_mogilefs_upstream_t         **slot;
+    ngx_http_mogilefs_resume_pt            resume;
+    ngx_http_mogilefs_upstream_t          *upstream;
+    ngx_event_t                            event;
+    unsigned                               queued:1;
+    unsigned                               started:1;
+} ngx_http_mogilefs_waiter_t;
+
+typedef struct {
+    ngx_queue_t                            queue;
+    ngx_http_mogilefs_upstream_t          *keepalive;
+    ngx_connection_t                      *connection;
+    struct sockaddr                       *sockaddr;
+    socklen_t                              socklen;
+    ngx_uint_t                             state;
+    size_t                                 sent;      /* of noop */
+    size_t                                 received;
+    u_char                                 buffer[NGX_MOGILEFS_KEEPALIVE_BUFFER];
+} ngx_http_mogilefs_keepalive_conn_t;
+
+/*
+ * Wraps balancer of the upstream for requests passed to the tracker,
+ * once a tracker is chosen its idle connection is taken and
+ * read timeout is adapted to its latency
+ */
+typedef struct {
+    ngx_http_request_t                    *request;
+    ngx_http_mogilefs_upstream_t          *keepalive;
+    void                                  *data;
+    ngx_event_get_peer_pt                  original_get_peer;
+    ngx_event_free_peer_pt                 original_free_peer;
+    unsigned                               done:1;
+} ngx_http_mogilefs_peer_t;
+
+typedef ngx_int_t (*ngx_http_mogilefs_tracker_process_pt)(ngx_http_mogilefs_tracker_t *t);
+typedef void (*ngx_http_mogilefs_tracker_resolved_pt)(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf);
+typedef void (*ngx_http_mogilefs_tracker_handler_pt)(ngx_http_mogilefs_tracker_t *t,
+    ngx_int_t rc);
+
+/*
+ * Tracker connection, which is not bound to ngx_http_upstream_t.
+ * It is used where a single request needs to talk to the tracker
+ * more than once.
+ */
+struct ngx_http_mogilefs_tracker_s {
+    ngx_peer_connection_t                  peer;
+    ngx_http_upstream_srv_conf_t          *upstream;
+    ngx_http_upstream_conf_t              *conf;
+    ngx_http_mogilefs_loc_conf_t          *loc_conf;
+    ngx_http_mogilefs_upstream_t          *keepalive;
+    ngx_http_upstream_rr_peer_t           *rr_peer;
+    ngx_msec_t                             read_timeout;
+
+    ngx_buf_t                              request;
+    ngx_buf_t                              buffer;
+    ngx_str_t                              line;
+
+    ngx_http_mogilefs_tracker_process_pt   process;
+    ngx_http_mogilefs_tracker_handler_pt   handler;
+    void                                  *data;
+
+    ngx_log_t                             *log;
+
+    ngx_uint_t                             stat;
+    ngx_msec_t                             start;
+
+    unsigned                               received:1;
+    unsigned                               paused:1;
+    unsigned                               done:1;
+};
+
+typedef struct {
+    ngx_http_mogilefs_tracker_t *tracker;
+    ngx_http_mogilefs_cmd_t     *cmd;
+
+    ngx_str_t                    domain;
+    ngx_str_t                    prefix;
+    ngx_str_t                    after;
+
+    ngx_uint_t                   limit;
+    ngx_uint_t                   total;
+    ngx_uint_t                   page_size;
+    ngx_uint_t                   page_limit;
+    ngx_uint_t                   page_keys;
+
+    ngx_chain_t                 *free;
+    ngx_chain_t                 *busy;
+
+    unsigned                     status:1;
+    unsigned                     header:1;
+    unsigned                     done:1;
+} ngx_http_mogilefs_list_ctx_t;
+
+/*
+ * Background get_paths for a stale cache entry,
+ * lives in its own pool, so that it outlives the request
+ */
+typedef struct {
+    ngx_pool_t                   *pool;
+    ngx_http_mogilefs_ctx_t       ctx;
+    ngx_http_mogilefs_response_t  resp;
+    time_t                        valid;
+    time_t                        stale;
+} ngx_http_mogilefs_refresh_t;
 
 static ngx_int_t ngx_http_mogilefs_put_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mogilefs_finish_phase_handler(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static ngx_int_t ngx_http_mogilefs_dispatch_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mogilefs_local_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mogilefs_redirect_handler(ngx_http_request_t *r);
+static ngx_str_t *ngx_http_mogilefs_redirect_location(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx);
+static ngx_str_t *ngx_http_mogilefs_remote_location(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_sign_url(ngx_http_request_t *r,
+    ngx_http_mogilefs_loc_conf_t *mgcf, ngx_str_t *path, time_t expires,
+    ngx_str_t *url);
+static void ngx_http_mogilefs_put_next(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_put_phase_end(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_put_finalize(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_mogilefs_put_cleanup(void *data);
+static ngx_int_t ngx_http_mogilefs_create_open(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_put_tracker_resolved(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_mogilefs_create_close(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_put_send(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_put_slot_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mogilefs_put_tracker_process(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_put_tracker_handler(ngx_http_mogilefs_tracker_t *t,
+    ngx_int_t rc);
+static ngx_int_t ngx_http_mogilefs_create_open_response(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_dest_index(ngx_str_t *name, size_t len);
+static ngx_int_t ngx_http_mogilefs_store(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_store_resolve(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx, ngx_str_t *host);
+static void ngx_http_mogilefs_store_resolve_handler(ngx_resolver_ctx_t *rctx);
+static ngx_int_t ngx_http_mogilefs_store_connect(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_store_send(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_store_read(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_store_next(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_mogilefs_store_close(ngx_http_mogilefs_put_ctx_t *ctx);
+static void ngx_http_mogilefs_store_write_handler(ngx_event_t *wev);
+static void ngx_http_mogilefs_store_read_handler(ngx_event_t *rev);
+static void ngx_http_mogilefs_store_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_mogilefs_store_output_filter(void *data, ngx_chain_t *in);
+#if (NGX_MOGILEFS_THREADS)
+static ngx_int_t ngx_http_mogilefs_store_thread_handler(ngx_thread_task_t *task,
+    ngx_file_t *file);
+static void ngx_http_mogilefs_store_thread_event_handler(ngx_event_t *ev);
+#endif
 
 static ngx_int_t ngx_http_mogilefs_eval_tracker(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf);
-static ngx_int_t ngx_http_mogilefs_eval_class(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf);
+static ngx_int_t ngx_http_mogilefs_tracker_upstream(ngx_http_request_t *r,
+    ngx_http_mogilefs_loc_conf_t *mgcf, ngx_http_mogilefs_tracker_resolved_pt handler,
+    ngx_http_upstream_srv_conf_t **uscfp);
+static ngx_http_upstream_srv_conf_t *ngx_http_mogilefs_tracker_implicit(ngx_pool_t *pool,
+    ngx_str_t *name, struct sockaddr *sockaddr, socklen_t socklen);
+static void ngx_http_mogilefs_tracker_resolve_handler(ngx_resolver_ctx_t *rctx);
+static void ngx_http_mogilefs_tracker_resolve_cleanup(void *data);
+static ngx_int_t ngx_http_mogilefs_inet_addr(ngx_str_t *host, in_port_t port,
+    u_char *sockaddr, socklen_t *socklen);
+static ngx_int_t ngx_http_mogilefs_eval_class(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *class);
 static ngx_int_t ngx_http_mogilefs_eval_key(ngx_http_request_t *r, ngx_str_t *key);
 static ngx_int_t ngx_http_mogilefs_set_cmd(ngx_http_request_t *r, ngx_http_mogilefs_ctx_t *ctx);
 
@@ -115,14 +663,176 @@ static void ngx_http_mogilefs_finalize_request(ngx_http_request_t *r, ngx_int_t
 static ngx_int_t ngx_http_mogilefs_filter_init(void *data);
 static ngx_int_t ngx_http_mogilefs_filter(void *data, ssize_t bytes);
 
-static ngx_int_t ngx_http_mogilefs_parse_param(ngx_http_request_t *r, ngx_str_t *param);
-static ngx_int_t ngx_http_mogilefs_add_aux_param(ngx_http_request_t *r, ngx_str_t *name,
+static ngx_http_mogilefs_error_t *ngx_http_mogilefs_find_error(ngx_str_t *line);
+static ngx_int_t ngx_http_mogilefs_parse_params(ngx_http_request_t *r, ngx_str_t *args);
+static ngx_int_t ngx_http_mogilefs_parse_param(ngx_http_request_t *r, ngx_str_t *name,
     ngx_str_t *value);
+static void ngx_http_mogilefs_set_path_variables(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_process_file_info(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *line);
+static void ngx_http_mogilefs_init_ctx_arrays(ngx_http_mogilefs_ctx_t *ctx,
+    ngx_pool_t *pool);
 
 static ngx_int_t ngx_http_mogilefs_path_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 
+static ngx_int_t ngx_http_mogilefs_escape(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst);
+
+static ngx_int_t ngx_http_mogilefs_list_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mogilefs_list_arg(ngx_http_request_t *r, ngx_str_t *arg,
+    ngx_str_t *value);
+static ngx_int_t ngx_http_mogilefs_list_start(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx, ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_mogilefs_list_tracker_resolved(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_mogilefs_list_send_request(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_list_send_header(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_list_process(ngx_http_mogilefs_tracker_t *t);
+static ngx_int_t ngx_http_mogilefs_list_output(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx, ngx_chain_t *out);
+static void ngx_http_mogilefs_list_tracker_handler(ngx_http_mogilefs_tracker_t *t,
+    ngx_int_t rc);
+static void ngx_http_mogilefs_list_write_handler(ngx_http_request_t *r);
+static void ngx_http_mogilefs_list_finalize(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_mogilefs_list_cleanup(void *data);
+
+static ngx_http_mogilefs_tracker_t *ngx_http_mogilefs_tracker_create(ngx_pool_t *pool,
+    ngx_log_t *log, ngx_http_mogilefs_loc_conf_t *mgcf, ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_mogilefs_tracker_send(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_tracker_read(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_tracker_close(ngx_http_mogilefs_tracker_t *t);
+static ngx_int_t ngx_http_mogilefs_tracker_get_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_http_mogilefs_tracker_free_peer(ngx_http_mogilefs_tracker_t *t,
+    ngx_uint_t failed);
+static ngx_uint_t ngx_http_mogilefs_peer_failed(ngx_http_upstream_rr_peer_t *peer,
+    time_t now);
+static void ngx_http_mogilefs_tracker_connect(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_tracker_write(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_tracker_next(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc);
+static void ngx_http_mogilefs_tracker_finish(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc);
+static void ngx_http_mogilefs_tracker_write_handler(ngx_event_t *wev);
+static void ngx_http_mogilefs_tracker_read_handler(ngx_event_t *rev);
+static void ngx_http_mogilefs_tracker_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_mogilefs_tracker_process_line(ngx_http_mogilefs_tracker_t *t);
+
+static ngx_http_mogilefs_upstream_t *ngx_http_mogilefs_keepalive_find(
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_connection_t *ngx_http_mogilefs_keepalive_get(
+    ngx_http_mogilefs_upstream_t *ka, ngx_peer_connection_t *pc);
+static ngx_int_t ngx_http_mogilefs_keepalive_put(ngx_http_mogilefs_upstream_t *ka,
+    ngx_peer_connection_t *pc);
+static void ngx_http_mogilefs_keepalive_fill(ngx_http_mogilefs_upstream_t *ka);
+static void ngx_http_mogilefs_keepalive_connect(ngx_http_mogilefs_upstream_t *ka,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_mogilefs_keepalive_close(ngx_http_mogilefs_keepalive_conn_t *kc);
+static void ngx_http_mogilefs_keepalive_close_connection(ngx_connection_t *c);
+static void ngx_http_mogilefs_keepalive_connect_handler(ngx_event_t *wev);
+static void ngx_http_mogilefs_keepalive_close_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_mogilefs_keepalive_send_noop(
+    ngx_http_mogilefs_keepalive_conn_t *kc);
+static void ngx_http_mogilefs_keepalive_write_handler(ngx_event_t *wev);
+static void ngx_http_mogilefs_keepalive_noop_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_mogilefs_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_mogilefs_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_mogilefs_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void ngx_http_mogilefs_keepalive_done(ngx_http_request_t *r);
+
+static ngx_http_mogilefs_upstream_t *ngx_http_mogilefs_upstream_find(
+    ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_mogilefs_slot_get(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_mogilefs_upstream_t **slot);
+static void ngx_http_mogilefs_slot_free(ngx_http_mogilefs_upstream_t *us);
+static void ngx_http_mogilefs_slot_cleanup(void *data);
+static ngx_int_t ngx_http_mogilefs_slot_wait(ngx_http_request_t *r,
+    ngx_http_mogilefs_upstream_t **slot, ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_mogilefs_resume_pt resume);
+static void ngx_http_mogilefs_slot_handler(ngx_event_t *ev);
+static void ngx_http_mogilefs_slot_wait_cleanup(void *data);
+
+static ngx_int_t ngx_http_mogilefs_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_mogilefs_status_stat(u_char *p, ngx_str_t *name,
+    ngx_http_mogilefs_stat_t *st, ngx_uint_t format);
+static void ngx_http_mogilefs_status_update(ngx_uint_t cmd, ngx_str_t *tracker,
+    ngx_msec_int_t elapsed, ngx_uint_t failed);
+static void ngx_http_mogilefs_status_error(ngx_http_mogilefs_error_t *e);
+static void ngx_http_mogilefs_status_paths(ssize_t n);
+static ngx_http_mogilefs_tracker_stat_t *ngx_http_mogilefs_status_tracker(
+    ngx_http_mogilefs_main_conf_t *mmcf, ngx_str_t *name);
+static void ngx_http_mogilefs_status_recent(ngx_http_mogilefs_tracker_stat_t *ts,
+    ngx_uint_t bucket);
+static ngx_msec_t ngx_http_mogilefs_adaptive_timeout(ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *tracker);
+static ngx_int_t ngx_http_mogilefs_init_status_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static ngx_int_t ngx_http_mogilefs_cache_get(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx);
+static void ngx_http_mogilefs_cache_put(ngx_log_t *log,
+    ngx_http_mogilefs_ctx_t *ctx, time_t valid, time_t stale);
+static void ngx_http_mogilefs_cache_delete(ngx_str_t *domain, ngx_str_t *key);
+static void ngx_http_mogilefs_cache_fail(ngx_str_t *domain, ngx_str_t *key);
+static void ngx_http_mogilefs_cache_refresh(ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *domain, ngx_str_t *key, ngx_atomic_uint_t generation);
+static ngx_int_t ngx_http_mogilefs_cache_reserve(ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *domain, ngx_str_t *key, ngx_atomic_uint_t *generation);
+static time_t ngx_http_mogilefs_cache_timeout(ngx_http_mogilefs_loc_conf_t *mgcf);
+static void ngx_http_mogilefs_prefetch(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_cache_refresh_process(ngx_http_mogilefs_tracker_t *t);
+static void ngx_http_mogilefs_cache_refresh_handler(ngx_http_mogilefs_tracker_t *t,
+    ngx_int_t rc);
+static ngx_int_t ngx_http_mogilefs_purge_handler(ngx_http_request_t *r);
+static uint32_t ngx_http_mogilefs_cache_hash(ngx_str_t *domain, ngx_str_t *key);
+static ngx_int_t ngx_http_mogilefs_cache_cmp(ngx_http_mogilefs_cache_node_t *cn,
+    ngx_str_t *domain, ngx_str_t *key);
+static ngx_http_mogilefs_cache_node_t *ngx_http_mogilefs_cache_lookup(
+    ngx_http_mogilefs_main_conf_t *mmcf, ngx_str_t *domain, ngx_str_t *key,
+    uint32_t hash);
+static void ngx_http_mogilefs_cache_expire(ngx_http_mogilefs_main_conf_t *mmcf,
+    ngx_uint_t force);
+static void ngx_http_mogilefs_cache_free(ngx_http_mogilefs_main_conf_t *mmcf,
+    ngx_http_mogilefs_cache_node_t *cn);
+static void ngx_http_mogilefs_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_mogilefs_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_mogilefs_cache_load(ngx_cycle_t *cycle,
+    ngx_http_mogilefs_main_conf_t *mmcf);
+static void ngx_http_mogilefs_cache_save(ngx_log_t *log,
+    ngx_http_mogilefs_main_conf_t *mmcf, ngx_uint_t force);
+static void ngx_http_mogilefs_cache_snapshot_handler(ngx_event_t *ev);
+
+static ngx_int_t ngx_http_mogilefs_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_mogilefs_init_process(ngx_cycle_t *cycle);
+static void ngx_http_mogilefs_exit_process(ngx_cycle_t *cycle);
+
+static void ngx_http_mogilefs_set_variable(ngx_http_request_t *r, ngx_uint_t var,
+    u_char *data, size_t len);
+static void ngx_http_mogilefs_set_tracker_variables(ngx_http_request_t *r,
+    ngx_uint_t cmd, ngx_str_t *tracker, ngx_msec_int_t elapsed);
+static void ngx_http_mogilefs_set_time_variable(ngx_http_request_t *r, ngx_uint_t var,
+    ngx_msec_int_t elapsed);
+static void ngx_http_mogilefs_put_done(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx, ngx_int_t status);
+static ngx_int_t ngx_http_mogilefs_checksum(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx);
+static ngx_int_t ngx_http_mogilefs_checksum_body(ngx_chain_t *in, u_char *md5,
+    ngx_log_t *log);
+#if (NGX_MOGILEFS_THREADS)
+static void ngx_http_mogilefs_checksum_thread(void *data, ngx_log_t *log);
+static void ngx_http_mogilefs_checksum_event_handler(ngx_event_t *ev);
+#endif
+
+static void *ngx_http_mogilefs_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_mogilefs_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_mogilefs_compile_cmd_template(ngx_conf_t *cf,
+    ngx_http_mogilefs_loc_conf_t *mgcf);
+static void ngx_http_mogilefs_hmac_init(ngx_http_mogilefs_loc_conf_t *mgcf);
 static char *ngx_http_mogilefs_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static ngx_int_t ngx_http_mogilefs_add_variables(ngx_conf_t *cf);
@@ -135,6 +845,32 @@ static char *
 ngx_http_mogilefs_class_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *
 ngx_http_mogilefs_pass_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_list_keys_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_status_zone_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_status_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_cache_zone_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_cache_snapshot_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_prefetch_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_tracker_keepalive_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_tracker_max_conns_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_thread_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_adaptive_timeout_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_local_root_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_http_mogilefs_purge_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static ngx_int_t ngx_http_mogilefs_init(ngx_conf_t *cf);
 
@@ -148,11 +884,42 @@ static ngx_http_mogilefs_error_t ngx_http_mogilefs_errors[] = {
     {NGX_HTTP_INTERNAL_SERVER_ERROR,    ngx_null_string, 0},
 };
 
+#define NGX_MOGILEFS_ERRORS                                                   \
+    (sizeof(ngx_http_mogilefs_errors) / sizeof(ngx_http_mogilefs_error_t))
+
+/*
+ * Counters in the status zone, the last error counter
+ * accounts errors not listed in ngx_http_mogilefs_errors
+ */
+struct ngx_http_mogilefs_status_s {
+    ngx_http_mogilefs_stat_t           cmds[NGX_MOGILEFS_STAT_CMDS];
+    ngx_atomic_t                       errors[NGX_MOGILEFS_ERRORS];
+    ngx_atomic_t                       paths_returned[NGX_MOGILEFS_MAX_PATHS + 1];
+    ngx_atomic_t                       ntrackers;
+    ngx_http_mogilefs_tracker_stat_t   trackers[NGX_MOGILEFS_STATUS_TRACKERS];
+};
+
+static ngx_str_t ngx_http_mogilefs_stat_cmds[] = {
+    ngx_string("get_paths"),
+    ngx_string("file_info"),
+    ngx_string("create_open"),
+    ngx_string("create_close"),
+    ngx_string("delete"),
+    ngx_string("list_keys"),
+};
+
+/*
+ * Upper bounds of latency histogram buckets in milliseconds
+ */
+static ngx_msec_t ngx_http_mogilefs_latency_bounds[NGX_MOGILEFS_LATENCY_BUCKETS - 1] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500
+};
+
 static ngx_http_mogilefs_cmd_t ngx_http_mogilefs_cmds[] = {
     {NGX_HTTP_GET,                      ngx_string("get_paths"),            ngx_string("path"),         ngx_string("paths") },
-    {NGX_HTTP_HEAD,                     ngx_string("get_paths"),            ngx_string("path"),         ngx_string("paths") },
-    {NGX_HTTP_PUT,                      ngx_string("create_open"),          ngx_string("path_"),        ngx_string("dev_count") },
+    {NGX_HTTP_HEAD,                     ngx_string("file_info"),            ngx_null_string,            ngx_null_string },
     {NGX_HTTP_DELETE,                   ngx_string("delete"),               ngx_null_string,            ngx_null_string },
+    {0,                                 ngx_string("list_keys"),            ngx_string("key_"),         ngx_string("key_count") },
 
     {0,                                 ngx_null_string,                    ngx_null_string,            ngx_null_string },
 };
@@ -164,8 +931,6 @@ static ngx_conf_bitmask_t  ngx_http_mogilefs_methods_mask[] = {
     { ngx_null_string, 0 }
 };
 
-static ngx_str_t  ngx_http_mogilefs_put_method = { 3, (u_char *) "PUT " };
-
 static ngx_command_t  ngx_http_mogilefs_commands[] = {
 
     { ngx_string("mogilefs_pass"),
@@ -210,6 +975,27 @@ static ngx_command_t  ngx_http_mogilefs_commands[] = {
       offsetof(ngx_http_mogilefs_loc_conf_t, upstream.read_timeout),
       NULL },
 
+    { ngx_string("mogilefs_adaptive_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_mogilefs_adaptive_timeout_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_checksum"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, checksum),
+      NULL },
+
+    { ngx_string("mogilefs_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_mogilefs_thread_pool_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("mogilefs_noverify"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -217,6 +1003,27 @@ static ngx_command_t  ngx_http_mogilefs_commands[] = {
       offsetof(ngx_http_mogilefs_loc_conf_t, noverify),
       NULL },
 
+    { ngx_string("mogilefs_file_info"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, file_info),
+      NULL },
+
+    { ngx_string("mogilefs_slow_put_threshold"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, slow_put_threshold),
+      NULL },
+
+    { ngx_string("mogilefs_put_memory_threshold"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, put_memory_threshold),
+      NULL },
+
     { ngx_string("mogilefs_methods"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -231,6 +1038,125 @@ static ngx_command_t  ngx_http_mogilefs_commands[] = {
       offsetof(ngx_http_mogilefs_loc_conf_t, class_templates),
       NULL },
 
+    { ngx_string("mogilefs_local_root"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_mogilefs_local_root_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, local_roots),
+      NULL },
+
+    { ngx_string("mogilefs_redirect"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, redirect),
+      NULL },
+
+    { ngx_string("mogilefs_redirect_min_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, redirect_min_size),
+      NULL },
+
+    { ngx_string("mogilefs_redirect_secret"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, redirect_secret),
+      NULL },
+
+    { ngx_string("mogilefs_redirect_expires"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, redirect_expires),
+      NULL },
+
+    { ngx_string("mogilefs_list_keys"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_mogilefs_list_keys_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_status_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_mogilefs_status_zone_command,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_mogilefs_status_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_tracker_keepalive"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_mogilefs_tracker_keepalive_command,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_tracker_max_conns"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_mogilefs_tracker_max_conns_command,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_mogilefs_cache_zone_command,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_cache_snapshot"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_mogilefs_cache_snapshot_command,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_mogilefs_cache_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("mogilefs_cache_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, cache_stale),
+      NULL },
+
+    { ngx_string("mogilefs_cache_stale_if_error"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mogilefs_loc_conf_t, cache_stale_if_error),
+      NULL },
+
+    { ngx_string("mogilefs_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_mogilefs_prefetch_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mogilefs_purge"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_mogilefs_purge_command,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -238,7 +1164,7 @@ static ngx_http_module_t  ngx_http_mogilefs_module_ctx = {
     ngx_http_mogilefs_add_variables,       /* preconfiguration */
     ngx_http_mogilefs_init,                /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_mogilefs_create_main_conf,    /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -254,11 +1180,11 @@ ngx_module_t  ngx_http_mogilefs_module = {
     ngx_http_mogilefs_commands,            /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_mogilefs_init_module,         /* init module */
+    ngx_http_mogilefs_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_mogilefs_exit_process,        /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -271,8 +1197,84 @@ static ngx_http_variable_t  ngx_http_mogilefs_path_variable_template = { /* {{{
       (uintptr_t) offsetof(ngx_http_mogilefs_ctx_t, sources),
       NGX_HTTP_VAR_CHANGEABLE, 0
 }; /* }}} */
-static ngx_str_t  ngx_http_mogilefs_class = ngx_string("class");
+
+static ngx_http_variable_t  ngx_http_mogilefs_variables[] = { /* {{{ */
+    { ngx_string("mogilefs_length"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_tracker_addr"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_tracker_time"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_command"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_paths_returned"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_error"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_put_body_time"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_put_create_open_time"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_put_store_time"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_put_create_close_time"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_cache_status"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_domain"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_key"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("mogilefs_local_path"), NULL, ngx_http_mogilefs_path_variable,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+}; /* }}} */
+
+static ngx_str_t  ngx_http_mogilefs_length_variable_name = ngx_string("mogilefs_length");
+
+/*
+ * Indexed as ngx_http_mogilefs_var_t
+ */
+static ngx_str_t  ngx_http_mogilefs_variable_names[] = {
+    ngx_string("mogilefs_tracker_addr"),
+    ngx_string("mogilefs_tracker_time"),
+    ngx_string("mogilefs_command"),
+    ngx_string("mogilefs_paths_returned"),
+    ngx_string("mogilefs_error"),
+    ngx_string("mogilefs_put_body_time"),
+    ngx_string("mogilefs_put_create_open_time"),
+    ngx_string("mogilefs_put_store_time"),
+    ngx_string("mogilefs_put_create_close_time"),
+    ngx_string("mogilefs_cache_status"),
+    ngx_string("mogilefs_domain"),
+    ngx_string("mogilefs_key"),
+    ngx_string("mogilefs_local_path"),
+};
+static ngx_str_t  ngx_http_mogilefs_class_header = ngx_string("X-MogileFS-Class");
+
+static ngx_str_t  ngx_http_mogilefs_class = ngx_string("class");
+static ngx_str_t  ngx_http_mogilefs_length = ngx_string("length");
 static ngx_str_t  ngx_http_mogilefs_size = ngx_string("size");
+static ngx_str_t  ngx_http_mogilefs_checksum_param = ngx_string("checksum");
+static ngx_str_t  ngx_http_mogilefs_list_keys = ngx_string("list_keys");
+static ngx_str_t  ngx_http_mogilefs_next_after = ngx_string("next_after");
+static ngx_str_t  ngx_http_mogilefs_none_match = ngx_string("none_match");
+
+static ngx_uint_t ngx_http_mogilefs_tracker_rr;
 
 static ngx_int_t
 ngx_http_mogilefs_handler(ngx_http_request_t *r)
@@ -290,11 +1292,12 @@ ngx_http_mogilefs_handler(ngx_http_request_t *r)
         }
 
         if(r->method & NGX_HTTP_PUT) {
-            return NGX_DECLINED;
+            return ngx_http_mogilefs_put_handler(r);
         }
     }
 
     switch(r->method) {
+        case NGX_HTTP_HEAD:
         case NGX_HTTP_GET:
             if (ngx_http_set_content_type(r) != NGX_OK) {
                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -311,6 +1314,89 @@ ngx_http_mogilefs_handler(ngx_http_request_t *r)
             break;
     }
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+    
+    if(ctx == NULL) {
+        ctx = ngx_palloc(r->pool, sizeof(ngx_http_mogilefs_ctx_t));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->num_paths_returned = -1;
+        ctx->status = 0;
+
+        ctx->length.len = 0;
+        ctx->length.data = NULL;
+        ctx->class_name.len = 0;
+        ctx->class_name.data = NULL;
+
+        ctx->cache_generation = 0;
+        ctx->cache_refresh = 0;
+
+        ctx->slot = NULL;
+
+        /*
+         * Ask for file_info along with get_paths in the same round-trip
+         */
+        ctx->file_info = (r->method & NGX_HTTP_GET && mgcf->file_info) ? 1 : 0;
+
+        ngx_http_mogilefs_init_ctx_arrays(ctx, r->pool);
+
+        if(ngx_http_mogilefs_eval_key(r, &ctx->key) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if(ngx_http_complex_value(r, mgcf->domain_complex, &ctx->domain) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_DOMAIN,
+            ctx->domain.data, ctx->domain.len);
+        ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_KEY,
+            ctx->key.data, ctx->key.len);
+
+        ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
+    }
+
+    /*
+     * Paths found in the cache zone are passed to fetch location
+     * straight away, tracker is not contacted
+     */
+    if(mgcf->cache_valid && mgcf->location_type == NGX_MOGILEFS_MAIN
+        && r->method & NGX_HTTP_GET)
+    {
+        rc = ngx_http_mogilefs_cache_get(r, ctx);
+
+        if(mgcf->prefetch != NULL) {
+            ngx_http_mogilefs_prefetch(r, ctx);
+        }
+
+        if(rc == NGX_OK || rc == NGX_AGAIN) {
+            if(rc == NGX_OK) {
+                ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_CACHE_STATUS,
+                    (u_char *) "HIT", sizeof("HIT") - 1);
+            }
+            else {
+                ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_CACHE_STATUS,
+                    (u_char *) "STALE", sizeof("STALE") - 1);
+            }
+
+            if(ctx->cache_refresh) {
+                ngx_http_mogilefs_cache_refresh(mgcf, &ctx->domain, &ctx->key,
+                                                ctx->cache_generation);
+            }
+
+            ngx_http_mogilefs_set_path_variables(r, ctx);
+
+            return ngx_http_internal_redirect(r,
+                       ngx_http_mogilefs_redirect_location(r, ctx), NULL);
+        }
+
+        ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_CACHE_STATUS,
+            (u_char *) "MISS", sizeof("MISS") - 1);
+    }
+
+
     u = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_t));
     if (u == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -334,30 +1420,6 @@ ngx_http_mogilefs_handler(ngx_http_request_t *r)
 
     r->upstream = u;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
-    
-    if(ctx == NULL) {
-        ctx = ngx_palloc(r->pool, sizeof(ngx_http_mogilefs_ctx_t));
-        if (ctx == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        ctx->peer_addr = NULL;
-        ctx->peer_addr_len = 0;
-
-        ctx->num_paths_returned = -1;
-        ctx->aux_params = NULL;
-        ctx->status = 0;
-
-        ngx_array_init(&ctx->sources, r->pool, 1, sizeof(ngx_http_mogilefs_src_t));
-
-        if(ngx_http_mogilefs_eval_key(r, &ctx->key) != NGX_OK) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
-    }
-
     u->input_filter_init = ngx_http_mogilefs_filter_init;
     u->input_filter = ngx_http_mogilefs_filter;
     u->input_filter_ctx = ctx;
@@ -372,6 +1434,25 @@ ngx_http_mogilefs_handler(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    /*
+     * No more than mogilefs_tracker_max_conns requests talk
+     * to the trackers, the rest wait in the queue
+     */
+    if(ngx_http_mogilefs_slot_get(mgcf->upstream.upstream, &ctx->slot) == NGX_BUSY) {
+        rc = ngx_http_mogilefs_slot_wait(r, &ctx->slot, mgcf->upstream.upstream,
+                                         ngx_http_upstream_init);
+
+        if(rc != NGX_DONE) {
+            return rc;
+        }
+
+#if defined nginx_version && nginx_version >= 8011
+        r->main->count++;
+#endif
+
+        return NGX_DONE;
+    }
+
 #if defined nginx_version && nginx_version >= 8011
     r->main->count++;
 #endif
@@ -384,1406 +1465,8644 @@ ngx_http_mogilefs_handler(ngx_http_request_t *r)
 static void
 ngx_http_mogilefs_body_handler(ngx_http_request_t *r)
 {
-    ngx_int_t                           rc;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "mogilefs body handler");
 
-    rc = ngx_http_mogilefs_put_handler(r);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
 
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        ngx_http_finalize_request(r, rc);
-    }
+    ctx->body_time = ngx_current_msec - ctx->phase_start;
+
+    ngx_http_mogilefs_set_time_variable(r, NGX_MOGILEFS_VAR_PUT_BODY_TIME,
+        (ngx_msec_int_t) ctx->body_time);
+
+    ngx_http_mogilefs_put_next(r, ctx);
 }
 
-static ngx_int_t
-ngx_http_mogilefs_put_handler(ngx_http_request_t *r)
+/*
+ * Chooses where to redirect GET once paths are known: to local
+ * location if one of the paths is on local disk, otherwise
+ * to fetch location or to storage node itself
+ */
+static ngx_str_t *
+ngx_http_mogilefs_redirect_location(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx)
 {
-    ngx_http_mogilefs_put_ctx_t        *ctx;
-    ngx_str_t                           args; 
-    ngx_uint_t                          flags;
-    ngx_http_request_t                 *sr; 
-    ngx_str_t                           spare_location = ngx_null_string, uri, value;
-    ngx_int_t                           rc;
-    u_char                             *p;
-    ngx_http_core_loc_conf_t           *clcf;
-    ngx_http_mogilefs_loc_conf_t       *mgcf;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs put handler");
+    u_char                          *p;
+    size_t                           len;
+    ngx_uint_t                       i, j;
+    ngx_http_mogilefs_src_t         *source;
+    ngx_http_mogilefs_local_root_t  *lr;
+    ngx_http_mogilefs_loc_conf_t    *mgcf;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
 
-    if (clcf->handler != ngx_http_mogilefs_handler ||
-        (mgcf->location_type == NGX_MOGILEFS_MAIN && !(r->method & mgcf->methods)))
-    {
-        return NGX_DECLINED;
+    if(mgcf->local_roots == NULL || !(r->method & NGX_HTTP_GET)) {
+        return ngx_http_mogilefs_remote_location(r, ctx);
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+    source = ctx->sources.elts;
+    lr = mgcf->local_roots->elts;
 
-    if(ctx == NULL) {
-        ctx = ngx_palloc(r->pool, sizeof(ngx_http_mogilefs_put_ctx_t));
-        if (ctx == NULL) {
-            return NGX_ERROR;
-        }
+    for(i = 0;i < ctx->sources.nelts;i++) {
+        for(j = 0;j < mgcf->local_roots->nelts;j++) {
+            if(source[i].path.len <= lr[j].prefix.len
+                || ngx_strncmp(source[i].path.data, lr[j].prefix.data, lr[j].prefix.len) != 0)
+            {
+                continue;
+            }
 
-        ctx->psr = NULL;
-        ctx->state = START;
-        ctx->status = 0;
-        ctx->create_open_ctx = NULL;
+            len = lr[j].root.len + source[i].path.len - lr[j].prefix.len;
 
-        if(ngx_http_mogilefs_eval_key(r, &ctx->key) != NGX_OK) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            p = ngx_pnalloc(r->pool, len + 1);
+            if(p == NULL) {
+                return &mgcf->fetch_location;
+            }
+
+            ngx_memcpy(ngx_cpymem(p, lr[j].root.data, lr[j].root.len),
+                       source[i].path.data + lr[j].prefix.len,
+                       source[i].path.len - lr[j].prefix.len);
+
+            p[len] = '\0';
+
+            ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_LOCAL_PATH, p, len);
+
+            return &mgcf->local_location;
         }
+    }
 
-        ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
+    return ngx_http_mogilefs_remote_location(r, ctx);
+}
+
+/*
+ * Client is redirected to storage node if mogilefs_redirect is on
+ * and the file is not smaller than mogilefs_redirect_min_size,
+ * otherwise the file is proxied by fetch location
+ */
+static ngx_str_t *
+ngx_http_mogilefs_remote_location(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx)
+{
+    ngx_http_mogilefs_loc_conf_t    *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(!mgcf->redirect || !(r->method & NGX_HTTP_GET)) {
+        return &mgcf->fetch_location;
     }
 
-    if(ctx->psr == NULL) {
-        ctx->psr = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
-        if (ctx->psr == NULL) {
-            return NGX_ERROR;
-        }
+    if(mgcf->redirect_min_size > 0 && (ctx->length.len == 0
+        || ngx_atoof(ctx->length.data, ctx->length.len) < mgcf->redirect_min_size))
+    {
+        return &mgcf->fetch_location;
     }
 
-    if(r->request_body == NULL) {
-        rc = ngx_http_read_client_request_body(r, ngx_http_mogilefs_body_handler);
+    return &mgcf->redirect_location;
+}
 
-        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-            return rc;
-        }
+/*
+ * Content handler of the location shared by mogilefs_pass
+ * locations of a server. Switches the request to configuration
+ * of the fetch block, serves the replica from local disk or
+ * redirects the client to storage node
+ */
+static ngx_int_t
+ngx_http_mogilefs_dispatch_handler(ngx_http_request_t *r)
+{
+    u_char                         *p, *last;
+    ngx_int_t                       n;
+    ngx_http_mogilefs_dispatch_t   *d;
+    ngx_http_core_main_conf_t      *cmcf;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
 
-        return NGX_DONE;
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+
+    p = r->uri.data + sizeof(NGX_MOGILEFS_DISPATCH_PREFIX) - 1;
+    last = r->uri.data + r->uri.len;
+
+    if(p + 1 >= last || (*p != 'f' && *p != 'l' && *p != 'r')) {
+        return NGX_HTTP_NOT_FOUND;
     }
 
-    // Still receiving body?
-    if(r->request_body->rest) {
-        return NGX_DONE;
+    n = ngx_atoi(p + 1, last - p - 1);
+
+    if(n == NGX_ERROR || (ngx_uint_t) n >= mmcf->dispatch.nelts) {
+        return NGX_HTTP_NOT_FOUND;
     }
 
+    d = (ngx_http_mogilefs_dispatch_t *) mmcf->dispatch.elts + n;
+
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs put handler state: %ui, status: %i", ctx->state, ctx->status);
+                   "mogilefs dispatch: %c, %i", *p, n);
 
-    if(ctx->state == CREATE_OPEN || ctx->state == FETCH || ctx->state == CREATE_CLOSE) {
-        if(ctx->status != NGX_OK && ctx->status != NGX_HTTP_CREATED && ctx->status != NGX_HTTP_NO_CONTENT) {
-            return (ctx->status >= NGX_HTTP_SPECIAL_RESPONSE) ?
-                ctx->status : NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-    }
+    r->content_handler = NULL;
 
-    switch(ctx->state) {
-        case START:
-            spare_location = mgcf->create_open_spare_location;
-            ctx->state = CREATE_OPEN;
-            break;
-        case CREATE_OPEN:
-            spare_location = mgcf->fetch_location;
-            ctx->state = FETCH;
-            break;
-        case FETCH:
-            spare_location = mgcf->create_close_spare_location;
-            ctx->state = CREATE_CLOSE;
-#if defined nginx_version && nginx_version >= 8011
-            r->main->count++;
-#endif
-            break;
-        case CREATE_CLOSE:
-            r->headers_out.content_length_n = 0;
-            r->headers_out.status = NGX_HTTP_CREATED;
+    if(*p == 'l' || *p == 'r') {
+        /*
+         * Sendfile, aio, open_file_cache and redirect settings
+         * are taken from the location the file was requested from
+         */
+        r->loc_conf = d->loc_conf;
 
-            r->header_only = 1;
+        ngx_http_update_location_config(r);
 
-            return ngx_http_send_header(r);
+        return *p == 'l' ? ngx_http_mogilefs_local_handler(r)
+                         : ngx_http_mogilefs_redirect_handler(r);
     }
 
-    uri.len = spare_location.len + ctx->key.len;
+    /*
+     * The same as a named location: the fetch block runs
+     * its own rewrite and access phases and content handler
+     */
+    r->loc_conf = d->fetch_loc_conf;
 
-    uri.data = ngx_palloc(r->pool, uri.len);
+    ngx_http_update_location_config(r);
 
-    p = ngx_cpymem(uri.data, spare_location.data, spare_location.len);
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
 
-    p = ngx_cpymem(p, ctx->key.data, ctx->key.len);
+    r->phase_handler = cmcf->phase_engine.location_rewrite_index;
 
-    args.len = 0;
-    args.data = NULL;
-    flags = 0;
+#if defined nginx_version && nginx_version >= 8011
+    r->main->count++;
+#endif
 
-    if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    ngx_http_core_run_phases(r);
 
-    ctx->psr->handler = ngx_http_mogilefs_finish_phase_handler;
-    ctx->psr->data = ctx;
+    return NGX_DONE;
+}
 
-    flags |= NGX_HTTP_SUBREQUEST_WAITED;
+/*
+ * Redirects the client to the top path, all paths are
+ * listed in X-MogileFS-Replicas for client-side failover
+ */
+static ngx_int_t
+ngx_http_mogilefs_redirect_handler(ngx_http_request_t *r)
+{
+    u_char                         *p;
+    size_t                          len;
+    time_t                          expires;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, n;
+    ngx_str_t                       path, url[NGX_MOGILEFS_MAX_PATHS];
+    ngx_table_elt_t                *h;
+    ngx_http_variable_value_t      *v;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
 
-    if(ctx->state == FETCH) {
-        flags |= NGX_HTTP_SUBREQUEST_IN_MEMORY;
-    }
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
 
-    rc = ngx_http_subrequest(r, &uri, &args, &sr, ctx->psr, flags);
+    rc = ngx_http_discard_request_body(r);
 
-    if (rc == NGX_ERROR) {
+    if (rc != NGX_OK) {
         return rc;
-    } 
+    }
 
-    if(ctx->state == CREATE_CLOSE) {
-        ngx_http_set_ctx(sr, ctx->create_open_ctx, ngx_http_mogilefs_module);
+    expires = mgcf->redirect_expires ? ngx_time() + mgcf->redirect_expires : 0;
 
-        value.data = ngx_palloc(r->pool, NGX_OFF_T_LEN);
+    len = 0;
 
-        if(value.data == NULL) {
-            return NGX_ERROR;
+    for(n = 0;n < NGX_MOGILEFS_MAX_PATHS;n++) {
+        v = r->variables + mgcf->index[n];
+
+        if(!v->valid || v->not_found || v->len == 0) {
+            break;
         }
 
-        value.len = ngx_sprintf(value.data, "%O", r->headers_in.content_length_n)
-            - value.data;
+        path.data = v->data;
+        path.len = v->len;
 
-        if(ngx_http_mogilefs_add_aux_param(sr, &ngx_http_mogilefs_size, &value) != NGX_OK) {
-            return NGX_ERROR;
+        if(ngx_http_mogilefs_sign_url(r, mgcf, &path, expires, &url[n]) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
+
+        len += url[n].len + sizeof(", ") - 1;
     }
 
-    /*
-     * Nginx closes temporary file with buffered body
-     * whenever it starts sending reponse from upstream
-     * and it is not doing subrequest in memory.
-     *
-     * Since the request body in create_open subrequest is
-     * inherited from main request, it is necessary to prevent
-     * nginx from closing the temporary file with request body,
-     * before it could be passed to the storage node on fetch/store
-     * stage.
-     *
-     * We do it by "hiding" the request body from nginx internals.
-     */
-    if(ctx->state == CREATE_OPEN) {
-        sr->request_body = NULL;
+    if(n == 0) {
+        return NGX_HTTP_NOT_FOUND;
     }
 
-    sr->method = NGX_HTTP_PUT;
-    sr->method_name = ngx_http_mogilefs_put_method;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs redirect to \"%V\", paths: %ui", &url[0], n);
 
-    /*
-     * Wait for subrequest to complete
-     */
-    return NGX_DONE;
-}
+    h = ngx_list_push(&r->headers_out.headers);
+    if(h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-static ngx_int_t
-ngx_http_mogilefs_finish_phase_handler(ngx_http_request_t *r, void *data, ngx_int_t rc)
-{
-    ngx_http_mogilefs_put_ctx_t *ctx = data;
-    ngx_http_mogilefs_ctx_t     *subrequest_ctx;
+    p = ngx_pnalloc(r->pool, len);
+    if(p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    subrequest_ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);   
+    h->hash = 1;
+    h->key.len = sizeof("X-MogileFS-Replicas") - 1;
+    h->key.data = (u_char *) "X-MogileFS-Replicas";
+    h->value.data = p;
 
-    if(ctx->state == CREATE_OPEN) {
-        ctx->create_open_ctx = subrequest_ctx;
+    for(i = 0;i < n;i++) {
+        if(i > 0) {
+            p = ngx_cpymem(p, ", ", sizeof(", ") - 1);
+        }
+
+        p = ngx_cpymem(p, url[i].data, url[i].len);
     }
 
-    ctx->status = (subrequest_ctx != NULL && subrequest_ctx->status >= NGX_HTTP_SPECIAL_RESPONSE)
-        ? subrequest_ctx->status : rc;
+    h->value.len = p - h->value.data;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs finish phase handler: state=%ui, status=%i", ctx->state, ctx->status);
+    h = ngx_list_push(&r->headers_out.headers);
+    if(h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    return NGX_OK;
+    h->hash = 1;
+    h->key.len = sizeof("Location") - 1;
+    h->key.data = (u_char *) "Location";
+    h->value = url[0];
+
+    r->headers_out.location = h;
+
+    return NGX_HTTP_MOVED_TEMPORARILY;
 }
 
+/*
+ * Appends expiry time and HMAC-MD5 of the URL to a path if
+ * mogilefs_redirect_secret is set. The signature covers
+ * everything in front of "&signature=" or "?signature="
+ */
 static ngx_int_t
-ngx_http_mogilefs_eval_tracker(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf)
+ngx_http_mogilefs_sign_url(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *path, time_t expires, ngx_str_t *url)
 {
-    ngx_str_t             tracker;
-    ngx_http_upstream_t  *u;
-    ngx_http_mogilefs_ctx_t *ctx;
+    u_char                          *p;
+    u_char                           hash[16];
+    ngx_md5_t                        md5;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+    if(mgcf->redirect_secret.len == 0) {
+        *url = *path;
+        return NGX_OK;
+    }
 
-    if (ngx_http_script_run(r, &tracker, mgcf->tracker_lengths->elts, 0,
-                            mgcf->tracker_values->elts)
-        == NULL)
-    {
+    p = ngx_pnalloc(r->pool, path->len + sizeof("?expires=") - 1 + NGX_TIME_T_LEN
+                    + sizeof("&signature=") - 1 + 32);
+    if(p == NULL) {
         return NGX_ERROR;
     }
 
-    u = r->upstream;
+    url->data = p;
 
-    u->resolved = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_resolved_t));
-    if (u->resolved == NULL) {
-        return NGX_ERROR;
-    }
+    p = ngx_cpymem(p, path->data, path->len);
 
-    if(ctx->peer_addr == NULL) {
-        u->resolved->host = tracker;
-        u->resolved->no_port = 1;
-    }
-    else {
-        u->resolved->sockaddr = ctx->peer_addr;
-        u->resolved->socklen = ctx->peer_addr_len;
-        u->resolved->naddrs = 1;
-        u->resolved->host = tracker;
+    if(expires) {
+        p = ngx_sprintf(p, "?expires=%T", expires);
     }
 
+    md5 = mgcf->redirect_ipad;
+    ngx_md5_update(&md5, url->data, p - url->data);
+    ngx_md5_final(hash, &md5);
+
+    md5 = mgcf->redirect_opad;
+    ngx_md5_update(&md5, hash, 16);
+    ngx_md5_final(hash, &md5);
+
+    p = expires ? ngx_cpymem(p, "&signature=", sizeof("&signature=") - 1)
+                : ngx_cpymem(p, "?signature=", sizeof("?signature=") - 1);
+
+    p = ngx_hex_dump(p, hash, 16);
+
+    url->len = p - url->data;
+
     return NGX_OK;
 }
 
+/*
+ * Serves a replica from local disk, falls back to fetch
+ * location if the file cannot be opened
+ */
 static ngx_int_t
-ngx_http_mogilefs_eval_class(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf)
+ngx_http_mogilefs_local_handler(ngx_http_request_t *r)
 {
-    ngx_uint_t                           i;
-    ngx_http_mogilefs_class_template_t  *t;
-    ngx_str_t                            class;
+    ngx_int_t                       rc;
+    ngx_str_t                       path;
+    ngx_buf_t                      *b;
+    ngx_chain_t                     out;
+    ngx_open_file_info_t            of;
+    ngx_http_variable_value_t      *v;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
 
-    if(mgcf->class_templates == NULL) {
-        return NGX_DECLINED;
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+
+    v = r->variables + mmcf->var_index[NGX_MOGILEFS_VAR_LOCAL_PATH];
+
+    if(!v->valid || v->not_found || v->len == 0) {
+        return NGX_HTTP_NOT_FOUND;
     }
 
-    t = mgcf->class_templates->elts;
+    path.data = v->data;
+    path.len = v->len;
 
-    for(i = 0;i < mgcf->class_templates->nelts;i++) {
-        if(t->lengths != NULL && t->values != NULL) {
-            if(ngx_http_script_run(r, &class, t->lengths->elts, 0,
-                                    t->values->elts)
-                == NULL)
-            {
-                return NGX_ERROR;
-            }
-        }
-        else {
-            if(ngx_http_mogilefs_add_aux_param(r, &ngx_http_mogilefs_class, &t->source) != NGX_OK) {
-                return NGX_ERROR;
-            }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs local path: \"%V\"", &path);
 
-            return NGX_OK;
-        }
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-        if(class.len) {
-            if(ngx_http_mogilefs_add_aux_param(r, &ngx_http_mogilefs_class, &class) != NGX_OK) {
-                return NGX_ERROR;
-            }
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
 
-            return NGX_OK;
-        }
+#if defined nginx_version && nginx_version >= 8018
+    of.read_ahead = clcf->read_ahead;
+#endif
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if(ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK
+        || !of.is_file)
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, of.err,
+                      "mogilefs local file \"%V\" is not available, "
+                      "fetching from storage node", &path);
 
-        t++;
+        return ngx_http_internal_redirect(r, &mgcf->fetch_location, NULL);
     }
 
-    return NGX_DECLINED;
-}
-static ngx_int_t
-ngx_http_mogilefs_eval_key(ngx_http_request_t *r, ngx_str_t *key)
-{
-    size_t                          loc_len;
-    ngx_http_mogilefs_loc_conf_t   *mgcf;
-    ngx_http_core_loc_conf_t       *clcf;
-
-    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
-    /*
-     * If key is empty take the remaining part of request URI,
-     * otherwise run script to obtain key
-     */
-    if(mgcf->key.len == 0) {
-        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = of.size;
+    r->headers_out.last_modified_time = of.mtime;
 
-        loc_len = r->valid_location ? clcf->name.len : 0;
+    r->allow_ranges = 1;
 
-        key->data = r->uri.data + loc_len;
-        key->len = r->uri.len - loc_len;
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
-    else {
-        if(mgcf->key_lengths != NULL) {
-            if (ngx_http_script_run(r, key, mgcf->key_lengths->elts, 0,
-                                    mgcf->key_values->elts)
-                == NULL)
-            {
-                return NGX_ERROR;
-            }
-        }
-        else {
-            *key = mgcf->key;
-        }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if(b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    return NGX_OK;
-}
+    rc = ngx_http_send_header(r);
 
-static ngx_int_t
-ngx_http_mogilefs_set_cmd(ngx_http_request_t *r, ngx_http_mogilefs_ctx_t *ctx)
-{
-    ngx_http_mogilefs_cmd_t *c;
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
-    c = ngx_http_mogilefs_cmds;
+    b->file_pos = 0;
+    b->file_last = of.size;
 
-    while(c->name.data != NULL) {
-        if(c->method & r->method)
-            break;
+    b->in_file = b->file_last ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
-        c++;
-    }
+    b->file->fd = of.fd;
+    b->file->name = path;
+    b->file->log = r->connection->log;
+    b->file->directio = of.is_directio;
 
-    if(c->name.data != NULL) {
-        ctx->cmd = c;
-        return NGX_OK;
-    }
+    out.buf = b;
+    out.next = NULL;
 
-    return NGX_ERROR;
+    return ngx_http_output_filter(r, &out);
 }
 
 static ngx_int_t
-ngx_http_mogilefs_create_request(ngx_http_request_t *r)
+ngx_http_mogilefs_put_handler(ngx_http_request_t *r)
 {
-    size_t                          len;
-    uintptr_t                       escape_domain, escape_key;
-    ngx_str_t                       cmd;
-    ngx_buf_t                      *b;
-    ngx_chain_t                    *cl;
-    ngx_http_mogilefs_loc_conf_t   *mgcf;
-    ngx_str_t                       request, domain;
-    ngx_http_mogilefs_ctx_t        *ctx;
-    ngx_http_mogilefs_aux_param_t  *a;
-    ngx_uint_t                      i;
-    ngx_int_t                       rc;
+    void                              **loc_conf;
+    ngx_int_t                           rc;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs put handler");
 
     mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_mogilefs_put_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
     /*
-     * Save peer address, so that we contact the same host while doing create_close 
+     * set by ngx_pcalloc():
+     *
+     *     ctx->tracker = NULL;
+     *     ctx->slot = NULL;
+     *     ctx->ndests = 0;
+     *     ctx->store.connection = NULL;
+     *     ctx->checksum = { 0, NULL };
+     *     ctx->body_time = 0;
+     *     ctx->create_open_time = 0;
+     *     ctx->store_time = 0;
+     *     ctx->create_close_time = 0;
      */
-    if(mgcf->location_type == NGX_MOGILEFS_CREATE_OPEN && ctx->cmd->method & NGX_HTTP_PUT) {
-        if(r->upstream->peer.sockaddr != NULL) {
-            ctx->peer_addr = ngx_palloc(r->main->pool, r->upstream->peer.socklen);
-
-            if(ctx->peer_addr == NULL) {
-                return NGX_ERROR;
-            }
 
-            ngx_memcpy(ctx->peer_addr, r->upstream->peer.sockaddr, r->upstream->peer.socklen);
-
-            ctx->peer_addr_len = r->upstream->peer.socklen;
-        }
-    }
+    ctx->state = START;
 
-    cmd = ctx->cmd->name;
+    ctx->start = ngx_current_msec;
+    ctx->phase_start = ctx->start;
 
-    if(mgcf->location_type == NGX_MOGILEFS_CREATE_CLOSE && ctx->cmd->method & NGX_HTTP_PUT) {
-        cmd.data = (u_char*)"create_close";
-        cmd.len = sizeof("create_close") - 1;
+    if(ngx_http_mogilefs_eval_key(r, &ctx->key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
     if(ctx->key.len == 0) {
         return NGX_HTTP_BAD_REQUEST;
     }
 
-    rc = ngx_http_complex_value(r, mgcf->parent != NULL ? mgcf->parent->domain_complex : mgcf->domain_complex, &domain);
-
-    if(rc == NGX_ERROR) {
-        return rc;
+    if(ngx_http_complex_value(r, mgcf->domain_complex, &ctx->domain) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    rc = ngx_http_mogilefs_eval_class(r, mgcf->parent != NULL ? mgcf->parent : mgcf);
+    ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_DOMAIN,
+        ctx->domain.data, ctx->domain.len);
+    ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_KEY,
+        ctx->key.data, ctx->key.len);
 
-    if(rc == NGX_ERROR) {
-        return rc;
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    escape_domain = 2 * ngx_escape_uri(NULL, domain.data, domain.len, NGX_ESCAPE_MEMCACHED);
-    escape_key = 2 * ngx_escape_uri(NULL, ctx->key.data, ctx->key.len, NGX_ESCAPE_MEMCACHED);
+    cln->handler = ngx_http_mogilefs_put_cleanup;
+    cln->data = ctx;
 
-    len = cmd.len + 1 + sizeof("key=") - 1 + ctx->key.len + escape_key + 1 +
-        sizeof("domain=") - 1 + domain.len + escape_domain + sizeof(CRLF) - 1 +
-        (mgcf->noverify ? 1 + sizeof("noverify=1") - 1 : 0);
+    ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
 
-    if(ctx->aux_params != NULL && ctx->aux_params->nelts) {
-        a = ctx->aux_params->elts;
-        for (i = 0; i < ctx->aux_params->nelts; i++) {
-            len += a[i].name.len + 1 + 1 + a[i].value.len;
-        }
-    }
+    /*
+     * Body below mogilefs_put_memory_threshold is read into a buffer
+     * of its size and never reaches a temp file
+     */
+    loc_conf = r->loc_conf;
 
-    b = ngx_create_temp_buf(r->pool, len);
-    if (b == NULL) {
-        return NGX_ERROR;
+    if(mgcf->put_memory_loc_conf != NULL && r->headers_in.content_length_n >= 0
+        && r->headers_in.content_length_n <= (off_t) mgcf->put_memory_threshold)
+    {
+        r->loc_conf = mgcf->put_memory_loc_conf;
     }
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
-        return NGX_ERROR;
+    rc = ngx_http_read_client_request_body(r, ngx_http_mogilefs_body_handler);
+
+    r->loc_conf = loc_conf;
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
     }
 
-    cl->buf = b;
-    cl->next = NULL;
+    return NGX_DONE;
+}
 
-    r->upstream->request_bufs = cl;
+/*
+ * Moves the upload to the next phase once the current one
+ * is complete. Phases waiting for the thread pool, the tracker
+ * or the storage node call it again from their event handlers
+ */
+static void
+ngx_http_mogilefs_put_next(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_int_t                           rc;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
 
-    b->last = ngx_copy(b->last, cmd.data, cmd.len);
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
 
-    *b->last++ = ' ';
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs put next, state: %ui", ctx->state);
 
-    b->last = ngx_copy(b->last, "key=", sizeof("key=") - 1);
+    ngx_http_mogilefs_put_phase_end(r, ctx);
 
-    if (escape_key == 0) {
-        b->last = ngx_copy(b->last, ctx->key.data, ctx->key.len);
+    ctx->phase_start = ngx_current_msec;
 
-    } else {
-        b->last = (u_char *) ngx_escape_uri(b->last, ctx->key.data, ctx->key.len,
-                                            NGX_ESCAPE_MEMCACHED);
-    }
+    switch(ctx->state) {
+        case START:
+            if(mgcf->checksum) {
+                ctx->state = CHECKSUM;
 
-    *b->last++ = '&';
+                rc = ngx_http_mogilefs_checksum(r, ctx);
 
-    b->last = ngx_copy(b->last, "domain=", sizeof("domain=") - 1);
+                if(rc == NGX_AGAIN) {
+                    return;
+                }
+
+                if(rc != NGX_OK) {
+                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    break;
+                }
+            }
 
-    if (escape_domain == 0) {
-        b->last = ngx_copy(b->last, domain.data, domain.len);
+            /* fall through */
+        case CHECKSUM:
+            if(mgcf->checksum && ctx->checksum.len == 0) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                break;
+            }
 
-    } else {
-        b->last = (u_char *) ngx_escape_uri(b->last, domain.data, domain.len,
-                                            NGX_ESCAPE_MEMCACHED);
+            ctx->state = CREATE_OPEN;
+            rc = ngx_http_mogilefs_create_open(r, ctx);
+            break;
+        case CREATE_OPEN:
+            ctx->state = STORE;
+            rc = ngx_http_mogilefs_store(r, ctx);
+            break;
+        case STORE:
+            ctx->state = CREATE_CLOSE;
+            rc = ngx_http_mogilefs_create_close(r, ctx);
+            break;
+        default: /* CREATE_CLOSE */
+            rc = NGX_HTTP_CREATED;
+            break;
     }
 
-    if(mgcf->noverify) {
-        *b->last++ = '&';
-
-        b->last = ngx_copy(b->last, "noverify=1", sizeof("noverify=1") - 1);
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_put_finalize(r, ctx, rc);
     }
+}
+
+/*
+ * Accounts time of the phase being left
+ */
+static void
+ngx_http_mogilefs_put_phase_end(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_uint_t                          var;
+    ngx_msec_t                          elapsed;
 
-    if(ctx->aux_params != NULL && ctx->aux_params->nelts) {
-        a = ctx->aux_params->elts;
-        for (i = 0; i < ctx->aux_params->nelts; i++) {
-            *b->last++ = '&';
+    elapsed = ngx_current_msec - ctx->phase_start;
 
-            b->last = ngx_copy(b->last, a[i].name.data, a[i].name.len);
+    switch(ctx->state) {
+        case CREATE_OPEN:
+            ctx->create_open_time = elapsed;
+            var = NGX_MOGILEFS_VAR_PUT_CREATE_OPEN_TIME;
+            break;
+        case STORE:
+            ctx->store_time = elapsed;
+            var = NGX_MOGILEFS_VAR_PUT_STORE_TIME;
+            break;
+        case CREATE_CLOSE:
+            ctx->create_close_time = elapsed;
+            var = NGX_MOGILEFS_VAR_PUT_CREATE_CLOSE_TIME;
+            break;
+        default:
+            return;
+    }
 
-            *b->last++ = '=';
+    ngx_http_mogilefs_set_time_variable(r, var, (ngx_msec_int_t) elapsed);
+}
 
-            b->last = ngx_copy(b->last, a[i].value.data, a[i].value.len);
-        }
+/*
+ * Ends the upload with NGX_HTTP_CREATED or an error
+ */
+static void
+ngx_http_mogilefs_put_finalize(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "finalize mogilefs put: state=%ui, rc=%i", ctx->state, rc);
+
+    if(rc != NGX_HTTP_CREATED) {
+        ngx_http_mogilefs_put_phase_end(r, ctx);
     }
 
-    request.data = b->pos;
-    request.len = b->last - b->pos;
+    ngx_http_mogilefs_put_done(r, ctx, rc);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs request: \"%V\"", &request);
+    ngx_http_mogilefs_put_cleanup(ctx);
 
-    *b->last++ = CR; *b->last++ = LF;
+    if(rc == NGX_HTTP_CREATED) {
+        r->headers_out.content_length_n = 0;
+        r->headers_out.status = NGX_HTTP_CREATED;
 
-    return NGX_OK;
-}
+        r->header_only = 1;
 
-static ngx_int_t
-ngx_http_mogilefs_reinit_request(ngx_http_request_t *r)
-{
-    return NGX_OK;
+        rc = ngx_http_send_header(r);
+    }
+
+    ngx_http_finalize_request(r, rc);
 }
 
-static int ngx_libc_cdecl ngx_http_mogilefs_cmp_sources(const void *one,
-    const void *two)
+static void
+ngx_http_mogilefs_put_cleanup(void *data)
 {
-    ngx_http_mogilefs_src_t *first, *second;
+    ngx_http_mogilefs_put_ctx_t        *ctx = data;
 
-    first = (ngx_http_mogilefs_src_t *) one;
-    second = (ngx_http_mogilefs_src_t *) two;
+    if(ctx->tracker != NULL) {
+        ngx_http_mogilefs_tracker_close(ctx->tracker);
+    }
 
-    return first->priority - second->priority;
+    ngx_http_mogilefs_store_close(ctx);
+
+    if(ctx->slot != NULL) {
+        ngx_http_mogilefs_slot_free(ctx->slot);
+        ctx->slot = NULL;
+    }
 }
 
+/*
+ * Computes MD5 of the request body for create_close. Reading the body
+ * back from temp file is offloaded to mogilefs_thread_pool, if any,
+ * NGX_AGAIN is returned then and the upload goes on once it is done
+ */
 static ngx_int_t
-ngx_http_mogilefs_process_ok_response(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_str_t *line)
+ngx_http_mogilefs_checksum(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
 {
-    u_char                          *p;
-    ngx_str_t                        param;
-    ngx_int_t                        rc;
+    u_char                                md5[16];
+#if (NGX_MOGILEFS_THREADS)
+    ngx_thread_task_t                    *task;
+    ngx_http_mogilefs_loc_conf_t         *mgcf;
 
-    ngx_table_elt_t                *h;
-    ngx_http_upstream_header_t     *hh;
-    ngx_http_upstream_main_conf_t  *umcf;
-    ngx_http_mogilefs_loc_conf_t   *mgcf;
-    ngx_http_variable_value_t      *v;
-    ngx_http_mogilefs_ctx_t        *ctx;
-    ngx_http_mogilefs_src_t        *source;
-    ngx_uint_t                     i;
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+#endif
 
-    line->data += sizeof("OK ") - 1;
-    line->len -= sizeof("OK ") - 1;
+    ctx->checksum.data = ngx_pnalloc(r->pool, sizeof("MD5:") - 1 + 2 * 16);
+    if(ctx->checksum.data == NULL) {
+        return NGX_ERROR;
+    }
 
-    p = line->data;
+    ngx_memcpy(ctx->checksum.data, "MD5:", sizeof("MD5:") - 1);
 
-    param.data = p;
-    param.len = 0;
+#if (NGX_MOGILEFS_THREADS)
+    if(mgcf->thread_pool != NULL && r->request_body->temp_file != NULL) {
+        task = ngx_thread_task_alloc(r->pool, 0);
+        if(task == NULL) {
+            return NGX_ERROR;
+        }
 
-    while (*p != LF) {
-        if (*p == '&' || *p == CR) {
-            if(param.len != 0) {
-                rc = ngx_http_mogilefs_parse_param(r, &param);
+        task->ctx = r;
+        task->handler = ngx_http_mogilefs_checksum_thread;
+        task->event.data = r;
+        task->event.handler = ngx_http_mogilefs_checksum_event_handler;
 
-                if(rc != NGX_OK) {
-                    return rc;
-                }
-
-                p++;
-
-                param.data = p;
-                param.len = 0;
-            }
-
-            if(*p == CR) {
-                break;
-            }
-            else {
-                continue;
-            }
+        if(ngx_thread_task_post(mgcf->thread_pool, task) != NGX_OK) {
+            return NGX_ERROR;
         }
 
-        param.len++;
-        p++;
-    }
+        r->main->blocked++;
+        r->main->count++;
+        r->aio = 1;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+        return NGX_AGAIN;
+    }
+#endif
 
-    /*
-     * Convert ok response to delete into No content
-     */
-    if(ctx->cmd->method & NGX_HTTP_DELETE) {
-        r->headers_out.content_length_n = 0;
-        u->headers_in.status_n = NGX_HTTP_NO_CONTENT;
-        u->state->status = NGX_HTTP_NO_CONTENT;
+    if(ngx_http_mogilefs_checksum_body(r->request_body->bufs, md5,
+                                       r->connection->log) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-        // Return no content
-        u->buffer.pos = u->buffer.pos;
+    ngx_hex_dump(ctx->checksum.data + sizeof("MD5:") - 1, md5, 16);
 
-        return NGX_OK;
-    }
+    ctx->checksum.len = sizeof("MD5:") - 1 + 2 * 16;
 
-    /*
-     * If no paths retuned, but response was ok, tell the client it's unavailable
-     */
-    if((ctx->num_paths_returned <= 0 && (!(ctx->cmd->method & NGX_HTTP_PUT))) || ctx->sources.nelts == 0)
-    {
-        r->headers_out.content_length_n = 0;
-        u->headers_in.status_n = NGX_HTTP_SERVICE_UNAVAILABLE;
-        u->state->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+    return NGX_OK;
+}
 
-        // Return no content
-        u->buffer.pos = u->buffer.pos;
+static ngx_int_t
+ngx_http_mogilefs_checksum_body(ngx_chain_t *in, u_char *md5, ngx_log_t *log)
+{
+    u_char                                buf[NGX_MOGILEFS_CHECKSUM_BUFFER];
+    off_t                                 offset;
+    ssize_t                               n;
+    ngx_buf_t                            *b;
+    ngx_md5_t                             ctx;
 
-        return NGX_OK;
-    }
+    ngx_md5_init(&ctx);
 
-    /*
-     * Sort sources and choose top source
-     */
-    if(ctx->sources.nelts > 1) {
-        ngx_qsort(ctx->sources.elts, ctx->sources.nelts, sizeof(ngx_http_mogilefs_src_t),
-            ngx_http_mogilefs_cmp_sources);
-    }
+    for( ;in;in = in->next) {
+        b = in->buf;
 
-    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+        if(ngx_buf_in_memory(b)) {
+            ngx_md5_update(&ctx, b->pos, b->last - b->pos);
+            continue;
+        }
 
-    source = ctx->sources.elts;
+        if(!b->in_file) {
+            continue;
+        }
 
-    /*
-     * Save peer address, so that we contact the same host while doing create_close 
-     */
-    if(mgcf->location_type == NGX_MOGILEFS_CREATE_OPEN && ctx->cmd->method & NGX_HTTP_PUT) {
-        if(r->upstream->peer.sockaddr != NULL) {
-            ctx->peer_addr = ngx_palloc(r->main->pool, r->upstream->peer.socklen);
+        for(offset = b->file_pos;offset < b->file_last;offset += n) {
+            n = ngx_read_file(b->file, buf,
+                    (size_t) ngx_min(b->file_last - offset, NGX_MOGILEFS_CHECKSUM_BUFFER),
+                    offset);
 
-            if(ctx->peer_addr == NULL) {
+            if(n == NGX_ERROR) {
                 return NGX_ERROR;
             }
 
-            ngx_memcpy(ctx->peer_addr, r->upstream->peer.sockaddr, r->upstream->peer.socklen);
+            if(n == 0) {
+                ngx_log_error(NGX_LOG_CRIT, log, 0,
+                              "mogilefs checksum: \"%V\" was truncated",
+                              &b->file->name);
+                return NGX_ERROR;
+            }
 
-            ctx->peer_addr_len = r->upstream->peer.socklen;
+            ngx_md5_update(&ctx, buf, n);
         }
     }
 
-    /*
-     * Set $mogilefs_path variables
-     */
-    for(i=0;i < ctx->sources.nelts;i++) {
-        v = r->variables + mgcf->index[i];
+    ngx_md5_final(md5, &ctx);
 
-        v->data = source[i].path.data;
-        v->len = source[i].path.len;
+    return NGX_OK;
+}
 
-        v->not_found = 0;
-        v->no_cacheable = 0;
-        v->valid = 1;
+#if (NGX_MOGILEFS_THREADS)
+
+static void
+ngx_http_mogilefs_checksum_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_request_t                   *r = data;
+    u_char                                md5[16];
+    ngx_http_mogilefs_put_ctx_t          *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(ngx_http_mogilefs_checksum_body(r->request_body->bufs, md5, log) != NGX_OK) {
+        return;
     }
 
-    /*
-     * Redirect to fetch location
-     */
-    if (ctx->cmd->method & (NGX_HTTP_GET|NGX_HTTP_HEAD) && r->upstream->headers_in.x_accel_redirect == NULL) {
+    ngx_hex_dump(ctx->checksum.data + sizeof("MD5:") - 1, md5, 16);
 
-        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    ctx->checksum.len = sizeof("MD5:") - 1 + 2 * 16;
+}
 
-        h = ngx_list_push(&r->upstream->headers_in.headers);
-        if (h == NULL) {
-            return NGX_ERROR;
-        }
+static void
+ngx_http_mogilefs_checksum_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t                   *r = ev->data;
+    ngx_connection_t                     *c;
+    ngx_http_mogilefs_put_ctx_t          *ctx;
 
-        h->hash = ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(
-                            ngx_hash('x', '-'), 'a'), 'c'), 'c'), 'e'), 'l'), '-'), 'r'), 'e'), 'd'), 'i'), 'r'), 'e'), 'c'), 't');
+    c = r->connection;
 
-        h->key.len = sizeof("X-Accel-Redirect") - 1;
-        h->key.data = (u_char *) "X-Accel-Redirect";
-        h->value = mgcf->fetch_location;
-        h->lowcase_key = (u_char *) "x-accel-redirect";
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "mogilefs checksum done");
 
-        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
-                           h->lowcase_key, h->key.len);
+    r->main->blocked--;
+    r->aio = 0;
 
-        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
-            return NGX_ERROR;
-        }
-    }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
 
-    r->headers_out.content_length_n = 0;
-    u->headers_in.status_n = 200;
-    u->state->status = 200;
+    ngx_http_mogilefs_put_next(r, ctx);
 
-    // Return no content
-    u->buffer.pos = u->buffer.pos;
+    ngx_http_finalize_request(r, NGX_DONE);
 
-    return NGX_OK;
+    ngx_http_run_posted_requests(c);
 }
 
+#endif
+
+/*
+ * Sends create_open, key, domain and class are kept
+ * for create_close
+ */
 static ngx_int_t
-ngx_http_mogilefs_process_error_response(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_str_t *line)
+ngx_http_mogilefs_create_open(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
 {
-    ngx_http_mogilefs_error_t *e;
-    ngx_http_mogilefs_ctx_t   *ctx;
+    size_t                              len;
+    ngx_int_t                           rc;
+    ngx_str_t                           class, request;
+    ngx_buf_t                          *b;
+    ngx_http_mogilefs_tracker_t        *t;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
 
-    line->data += sizeof("ERR ") - 1;
-    line->len -= sizeof("ERR ") - 1;
-	line->len -= 1; /* strip \r */
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "mogilefs error: \"%V\"", line);
+    uscf = ctx->tracker_upstream;
 
-    e = ngx_http_mogilefs_errors;
+    if(uscf == NULL) {
+        rc = ngx_http_mogilefs_tracker_upstream(r, mgcf,
+                                                ngx_http_mogilefs_put_tracker_resolved, &uscf);
 
-    while(e->name.data != NULL) {
-        if(line->len >= e->name.len &&
-            ngx_strncmp(line->data, e->name.data, e->name.len) == 0)
-        {
-            break;
+        if(rc == NGX_AGAIN) {
+            return NGX_OK;
         }
 
-        e++;
+        if(rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
-
-    /*
-     * Convert unknown_key response to delete into No content
-     */
-    if(ctx->cmd->method & NGX_HTTP_DELETE && e->delete_ok) {
-        r->headers_out.content_length_n = 0;
-        u->headers_in.status_n = NGX_HTTP_NO_CONTENT;
-        u->state->status = NGX_HTTP_NO_CONTENT;
-
-        // Return no content
-        u->buffer.pos = u->buffer.pos;
-
-        return NGX_OK;
+    t = ngx_http_mogilefs_tracker_create(r->pool, r->connection->log, mgcf, uscf);
+    if(t == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    r->headers_out.content_length_n = 0;
-    u->headers_in.status_n = e->status;
-    u->state->status = e->status;
-    ctx->status = e->status;
+    t->process = ngx_http_mogilefs_put_tracker_process;
+    t->handler = ngx_http_mogilefs_put_tracker_handler;
+    t->data = r;
+    t->stat = NGX_MOGILEFS_STAT_CREATE_OPEN;
 
-    // Return no content
-    u->buffer.pos = u->buffer.pos;
+    ctx->tracker = t;
 
-    return NGX_OK;
-}
+    class.len = 0;
 
-static ngx_int_t
-ngx_http_mogilefs_add_aux_param(ngx_http_request_t *r, ngx_str_t *name, ngx_str_t *value)
-{
-    ngx_http_mogilefs_ctx_t         *ctx;
-    ngx_http_mogilefs_aux_param_t   *p;
-    
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
-    if(ctx == NULL) {
-        return NGX_ERROR;
-    }
+    if(!mgcf->cmd_template.static_class) {
+        rc = ngx_http_mogilefs_eval_class(r, mgcf, &class);
 
-    if(ctx->aux_params == NULL) {
-        ctx->aux_params = ngx_array_create(r->pool, 3, sizeof(ngx_http_mogilefs_aux_param_t));
+        if(rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
 
-        if(ctx->aux_params == NULL) {
-            return NGX_ERROR;
+        if(rc == NGX_DECLINED) {
+            class.len = 0;
         }
     }
 
-    p = ngx_array_push(ctx->aux_params);
-    if (p == NULL) {
-        return NGX_ERROR;
-    }
+    /*
+     * Key, domain and class are escaped in one pass, so room
+     * is reserved for the case every character gets escaped
+     */
+    len = sizeof("create_open key=") - 1 + 3 * ctx->key.len
+        + (mgcf->cmd_template.domain.len != 0
+           ? mgcf->cmd_template.domain.len : sizeof("&domain=") - 1 + 3 * ctx->domain.len)
+        + mgcf->cmd_template.args.len
+        + (class.len ? 1 + ngx_http_mogilefs_class.len + 1 + 3 * class.len : 0)
+        + sizeof("&multi_dest=1") - 1 + sizeof(CRLF) - 1;
 
-    p->name = *name;
-    p->value = *value;
+    b = &t->request;
 
-    return NGX_OK;
-}
+    b->start = ngx_pnalloc(r->pool, len);
+    if(b->start == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-static ngx_int_t
-ngx_http_mogilefs_parse_param(ngx_http_request_t *r, ngx_str_t *param) {
-    u_char                    *p, *src, *dst;
+    b->end = b->start + len;
+    b->pos = b->start;
 
-    ngx_str_t                  name;
-    ngx_str_t                  value;
+    b->last = ngx_copy(b->start, "create_open ", sizeof("create_open ") - 1);
 
-    ngx_http_mogilefs_ctx_t   *ctx;
-    ngx_http_mogilefs_src_t   *source;
+    ctx->args.data = b->last;
 
-    p = (u_char *) ngx_strchr(param->data, '=');
+    b->last = ngx_copy(b->last, "key=", sizeof("key=") - 1);
+    b->last = ngx_http_mogilefs_escape_memcached(b->last, ctx->key.data, ctx->key.len);
 
-    if(p == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "mogilefs tracker has sent invalid param: \"%V\"", param);
-        return NGX_ERROR;
+    if(mgcf->cmd_template.domain.len != 0) {
+        b->last = ngx_copy(b->last, mgcf->cmd_template.domain.data,
+                           mgcf->cmd_template.domain.len);
+    }
+    else {
+        b->last = ngx_copy(b->last, "&domain=", sizeof("&domain=") - 1);
+        b->last = ngx_http_mogilefs_escape_memcached(b->last, ctx->domain.data,
+                                                     ctx->domain.len);
     }
 
-    name.data = param->data;
-    name.len = p - param->data;
+    b->last = ngx_copy(b->last, mgcf->cmd_template.args.data, mgcf->cmd_template.args.len);
 
-    value.data = p + 1;
-    value.len = param->len - (p - param->data) - 1;
+    if(class.len) {
+        b->last = ngx_sprintf(b->last, "&%V=", &ngx_http_mogilefs_class);
+        b->last = ngx_http_mogilefs_escape_memcached(b->last, class.data, class.len);
+    }
 
-    src = dst = value.data;
+    ctx->args.len = b->last - ctx->args.data;
 
-    ngx_unescape_uri(&dst, &src, value.len, NGX_UNESCAPE_URI);
+    /*
+     * Several destinations let the upload go on
+     * when a storage node fails
+     */
+    b->last = ngx_copy(b->last, "&multi_dest=1", sizeof("&multi_dest=1") - 1);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs param: \"%V\"=\"%V\"", &name, &value);
+    request.data = b->pos;
+    request.len = b->last - b->pos;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs request: \"%V\"", &request);
 
-    if(name.len == sizeof("path") - 1
-        && ngx_strncmp(name.data, "path", sizeof("path") - 1) == 0)
-    {
-        source = ngx_array_push(&ctx->sources);
+    *b->last++ = CR; *b->last++ = LF;
 
-        if(source == NULL) {
-            return NGX_ERROR;
-        }
+    return ngx_http_mogilefs_put_send(r, ctx);
+}
+
+/*
+ * Continues create_open once the tracker host name is resolved
+ */
+static void
+ngx_http_mogilefs_put_tracker_resolved(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                           rc;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
 
-        source->priority = 0;
-        source->path = value;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
 
-        if(ngx_http_mogilefs_add_aux_param(r, &name, &value) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    if(uscf == NULL) {
+        ngx_http_mogilefs_put_finalize(r, ctx, NGX_HTTP_BAD_GATEWAY);
+        return;
     }
-    else if(name.len >= ctx->cmd->output_param.len
-        && ngx_strncmp(name.data, ctx->cmd->output_param.data, ctx->cmd->output_param.len) == 0
-        && ngx_atoi(name.data + ctx->cmd->output_param.len, name.len - ctx->cmd->output_param.len) != NGX_ERROR)
-    {
-        source = ngx_array_push(&ctx->sources);
 
-        if(source == NULL) {
-            return NGX_ERROR;
-        }
+    ctx->tracker_upstream = uscf;
 
-        source->priority = ngx_atoi(name.data + ctx->cmd->output_param.len, name.len - ctx->cmd->output_param.len);
-        source->path = value;
-    }
-    else if(name.len == ctx->cmd->output_count_param.len &&
-        ngx_strncmp(name.data, ctx->cmd->output_count_param.data, ctx->cmd->output_count_param.len) == 0)
-    {
-        ctx->num_paths_returned = ngx_atoi(value.data, value.len);
-    }
-    else {
-        if(ngx_http_mogilefs_add_aux_param(r, &name, &value) != NGX_OK) {
-            return NGX_ERROR;
-        }
-    }
+    rc = ngx_http_mogilefs_create_open(r, ctx);
 
-    return NGX_OK;
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_put_finalize(r, ctx, rc);
+    }
 }
 
+/*
+ * Sends create_close over the connection of create_open,
+ * unless the tracker has closed it in the meantime
+ */
 static ngx_int_t
-ngx_http_mogilefs_process_header(ngx_http_request_t *r)
+ngx_http_mogilefs_create_close(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
 {
-    u_char                    *p;
-    ngx_str_t                  line;
-    ngx_http_upstream_t       *u;
+    size_t                              len;
+    ngx_str_t                           request;
+    ngx_buf_t                          *b;
+    ngx_http_mogilefs_dest_t           *dest;
 
-    u = r->upstream;
+    dest = &ctx->dests[ctx->dest];
 
-    for (p = u->buffer.pos; p < u->buffer.last; p++) {
-        if (*p == LF) {
-            goto found;
-        }
+    len = sizeof("create_close ") - 1 + ctx->args.len
+        + sizeof("&fid=") - 1 + ctx->fid.len
+        + sizeof("&devid=") - 1 + dest->devid.len
+        + sizeof("&path=") - 1 + 3 * dest->path.len
+        + 1 + ngx_http_mogilefs_size.len + 1 + NGX_OFF_T_LEN
+        + (ctx->checksum.len ? 1 + ngx_http_mogilefs_checksum_param.len + 1 + ctx->checksum.len : 0)
+        + sizeof(CRLF) - 1;
+
+    b = &ctx->tracker->request;
+
+    b->start = ngx_pnalloc(r->pool, len);
+    if(b->start == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    return NGX_AGAIN;
-found:
+    b->end = b->start + len;
+    b->pos = b->start;
 
-    line.len = p - u->buffer.pos;
-    line.data = u->buffer.pos;
+    b->last = ngx_copy(b->start, "create_close ", sizeof("create_close ") - 1);
+    b->last = ngx_copy(b->last, ctx->args.data, ctx->args.len);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "mogilefs: \"%V\"", &line);
+    b->last = ngx_sprintf(b->last, "&fid=%V&devid=%V&path=", &ctx->fid, &dest->devid);
+    b->last = ngx_http_mogilefs_escape_memcached(b->last, dest->path.data, dest->path.len);
 
-    if (line.len >= sizeof("ERR ") - 1 &&
-        ngx_strncmp(line.data, "ERR ", sizeof("ERR ") - 1) == 0)
-    {
-        return ngx_http_mogilefs_process_error_response(r, u, &line);
+    b->last = ngx_sprintf(b->last, "&%V=%O", &ngx_http_mogilefs_size, ctx->size);
+
+    if(ctx->checksum.len) {
+        b->last = ngx_sprintf(b->last, "&%V=%V", &ngx_http_mogilefs_checksum_param,
+                              &ctx->checksum);
     }
 
-    if (line.len >= sizeof("OK ") - 1 &&
-        ngx_strncmp(line.data, "OK ", sizeof("OK ") - 1) == 0)
-    {
-        return ngx_http_mogilefs_process_ok_response(r, u, &line);
+    request.data = b->pos;
+    request.len = b->last - b->pos;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs request: \"%V\"", &request);
+
+    *b->last++ = CR; *b->last++ = LF;
+
+    ctx->tracker->stat = NGX_MOGILEFS_STAT_CREATE_CLOSE;
+
+    return ngx_http_mogilefs_put_send(r, ctx);
+}
+
+/*
+ * Sends the command once mogilefs_tracker_max_conns lets it,
+ * the slot is released as soon as the response arrives
+ */
+static ngx_int_t
+ngx_http_mogilefs_put_send(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_int_t                           rc;
+
+    if(ngx_http_mogilefs_slot_get(ctx->tracker->upstream, &ctx->slot) == NGX_BUSY) {
+        rc = ngx_http_mogilefs_slot_wait(r, &ctx->slot, ctx->tracker->upstream,
+                                         ngx_http_mogilefs_put_slot_handler);
+
+        return (rc == NGX_DONE) ? NGX_OK : rc;
     }
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "mogilefs tracker has sent invalid response: \"%V\"", &line);
+    ngx_http_mogilefs_tracker_send(ctx->tracker);
 
-    return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    return NGX_OK;
 }
 
 static void
-ngx_http_mogilefs_abort_request(ngx_http_request_t *r)
+ngx_http_mogilefs_put_slot_handler(ngx_http_request_t *r)
 {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "abort mogilefs request");
-    return;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    ngx_http_mogilefs_tracker_send(ctx->tracker);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_put_tracker_process(ngx_http_mogilefs_tracker_t *t)
+{
+    ngx_int_t                           rc;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx((ngx_http_request_t *) t->data, ngx_http_mogilefs_module);
+
+    rc = ngx_http_mogilefs_parse_response(t->buffer.pos, t->buffer.last, &ctx->resp);
+
+    if(rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if(rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, t->log, 0,
+                      "mogilefs tracker has sent invalid response: \"%V\"", &ctx->resp.line);
+
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    t->buffer.pos = ctx->resp.next;
+
+    return NGX_OK;
 }
 
 static void
-ngx_http_mogilefs_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+ngx_http_mogilefs_put_tracker_handler(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc)
 {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "finalize mogilefs request");
-    return;
+    ngx_str_t                          *args;
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_mogilefs_error_t          *e;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    r = t->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "mogilefs put tracker done: state=%ui, rc=%i", ctx->state, rc);
+
+    if(ctx->slot != NULL) {
+        ngx_http_mogilefs_slot_free(ctx->slot);
+        ctx->slot = NULL;
+    }
+
+    ngx_http_mogilefs_set_tracker_variables(r, t->stat, t->peer.name,
+        (ngx_msec_int_t) (ngx_current_msec - t->start));
+
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_put_finalize(r, ctx, rc);
+        goto done;
+    }
+
+    if(!ctx->resp.ok) {
+        args = &ctx->resp.args;
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "mogilefs error: \"%V\"", args);
+
+        e = ngx_http_mogilefs_find_error(args);
+
+        ngx_http_mogilefs_status_error(e);
+
+        ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_ERROR, args->data,
+            ngx_http_mogilefs_find(args->data, args->data + args->len, ' ', ' ') - args->data);
+
+        ngx_http_mogilefs_put_finalize(r, ctx, e->status);
+        goto done;
+    }
+
+    if(ctx->state == CREATE_OPEN) {
+        rc = ngx_http_mogilefs_create_open_response(r, ctx);
+
+        if(rc != NGX_OK) {
+            ngx_http_mogilefs_put_finalize(r, ctx, rc);
+            goto done;
+        }
+    }
+    else {
+        /*
+         * Stored key gets new paths
+         */
+        ngx_http_mogilefs_cache_delete(&ctx->domain, &ctx->key);
+    }
+
+    ngx_http_mogilefs_put_next(r, ctx);
+
+done:
+
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+ * Collects fid and destinations of create_open, either devid
+ * and path or devid_N and path_N. The values are copied,
+ * since tracker buffer is reused by create_close
+ */
+static ngx_int_t
+ngx_http_mogilefs_create_open_response(ngx_http_request_t *r,
+    ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_int_t                           rc, n;
+    ngx_uint_t                          i;
+    ngx_str_t                           args, name, value, *dst;
+
+    args = ctx->resp.args;
+
+    for( ;; ) {
+        rc = ngx_http_mogilefs_next_param(&args, &name, &value);
+
+        if(rc == NGX_DONE) {
+            break;
+        }
+
+        if(rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "mogilefs tracker has sent invalid param: \"%V\"", &name);
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "mogilefs param: \"%V\"=\"%V\"", &name, &value);
+
+        dst = NULL;
+
+        if(name.len == sizeof("fid") - 1
+            && ngx_strncmp(name.data, "fid", sizeof("fid") - 1) == 0)
+        {
+            dst = &ctx->fid;
+        }
+        else if(name.len >= sizeof("devid") - 1
+            && ngx_strncmp(name.data, "devid", sizeof("devid") - 1) == 0)
+        {
+            n = ngx_http_mogilefs_dest_index(&name, sizeof("devid") - 1);
+
+            if(n != NGX_ERROR) {
+                dst = &ctx->dests[n].devid;
+            }
+        }
+        else if(name.len >= sizeof("path") - 1
+            && ngx_strncmp(name.data, "path", sizeof("path") - 1) == 0)
+        {
+            n = ngx_http_mogilefs_dest_index(&name, sizeof("path") - 1);
+
+            if(n != NGX_ERROR) {
+                dst = &ctx->dests[n].path;
+            }
+        }
+
+        if(dst == NULL) {
+            continue;
+        }
+
+        dst->data = ngx_pstrdup(r->pool, &value);
+        if(dst->data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        dst->len = value.len;
+    }
+
+    /*
+     * Destinations come in order of preference,
+     * incomplete ones are dropped
+     */
+    ctx->ndests = 0;
+
+    for(i = 0;i < NGX_MOGILEFS_MAX_PATHS;i++) {
+        if(ctx->dests[i].devid.len && ctx->dests[i].path.len) {
+            ctx->dests[ctx->ndests++] = ctx->dests[i];
+        }
+    }
+
+    if(ctx->fid.len == 0 || ctx->ndests == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "mogilefs tracker has sent no destination for \"%V\"", &ctx->key);
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    ctx->dest = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * Maps "devid" or "path" to 0 and "devid_N" or "path_N" to N - 1
+ */
+static ngx_int_t
+ngx_http_mogilefs_dest_index(ngx_str_t *name, size_t len)
+{
+    ngx_int_t                           n;
+
+    if(name->len == len) {
+        return 0;
+    }
+
+    if(name->data[len] != '_') {
+        return NGX_ERROR;
+    }
+
+    n = ngx_atoi(name->data + len + 1, name->len - len - 1);
+
+    if(n < 1 || n > NGX_MOGILEFS_MAX_PATHS) {
+        return NGX_ERROR;
+    }
+
+    return n - 1;
+}
+
+/*
+ * PUTs the body to the current destination. Storage nodes given
+ * by IPv4 or IPv6 address are connected to right away, host names
+ * go through the location's resolver. Copies of the body buffers
+ * are sent, so that the next destination starts over
+ */
+static ngx_int_t
+ngx_http_mogilefs_store(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_uint_t                          resolve;
+    ngx_url_t                           url;
+    ngx_buf_t                          *b;
+    ngx_chain_t                        *cl, *in, *body, **ll;
+    ngx_http_mogilefs_dest_t           *dest;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    dest = &ctx->dests[ctx->dest];
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs store: \"%V\"", &dest->path);
+
+    if(dest->path.len <= sizeof("http://") - 1
+        || ngx_strncasecmp(dest->path.data, (u_char *) "http://", sizeof("http://") - 1) != 0)
+    {
+        goto invalid;
+    }
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url.data = dest->path.data + sizeof("http://") - 1;
+    url.url.len = dest->path.len - (sizeof("http://") - 1);
+    url.default_port = 80;
+    url.uri_part = 1;
+    url.no_resolve = 1;
+
+    if(ngx_parse_url(r->pool, &url) != NGX_OK || url.uri.len == 0) {
+        goto invalid;
+    }
+
+    ctx->store_name.data = url.url.data;
+    ctx->store_name.len = url.uri.data - url.url.data;
+    ctx->store_port = (in_port_t) url.port;
+
+    resolve = (ngx_http_mogilefs_inet_addr(&url.host, ctx->store_port,
+                                           ctx->store_sockaddr, &ctx->store_socklen)
+               != NGX_OK);
+
+    body = NULL;
+    ll = &body;
+
+    ctx->size = 0;
+
+    for(in = r->request_body->bufs;in;in = in->next) {
+        b = ngx_alloc_buf(r->pool);
+        if(b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_memcpy(b, in->buf, sizeof(ngx_buf_t));
+
+        ctx->size += ngx_buf_size(b);
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if(cl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = NULL;
+
+    b = ngx_create_temp_buf(r->pool, sizeof("PUT ") - 1 + url.uri.len
+                            + sizeof(" HTTP/1.0" CRLF "Host: ") - 1 + ctx->store_name.len
+                            + sizeof(CRLF "Content-Length: ") - 1 + NGX_OFF_T_LEN
+                            + sizeof(CRLF CRLF) - 1);
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "PUT %V HTTP/1.0" CRLF "Host: %V" CRLF
+                          "Content-Length: %O" CRLF CRLF,
+                          &url.uri, &ctx->store_name, ctx->size);
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if(cl == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = body;
+
+    ctx->store_out = cl;
+
+    if(ctx->store_buffer.start == NULL) {
+        ctx->store_buffer.start = ngx_palloc(r->pool, mgcf->upstream.buffer_size);
+        if(ctx->store_buffer.start == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->store_buffer.end = ctx->store_buffer.start + mgcf->upstream.buffer_size;
+        ctx->store_buffer.temporary = 1;
+    }
+
+    ctx->store_buffer.pos = ctx->store_buffer.start;
+    ctx->store_buffer.last = ctx->store_buffer.start;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&ctx->output, sizeof(ngx_output_chain_ctx_t));
+    ngx_memzero(&ctx->writer, sizeof(ngx_chain_writer_ctx_t));
+
+    ctx->output.pool = r->pool;
+    ctx->output.bufs.num = 1;
+    ctx->output.bufs.size = clcf->client_body_buffer_size;
+    ctx->output.tag = (ngx_buf_tag_t) &ngx_http_mogilefs_module;
+    ctx->output.output_filter = ngx_http_mogilefs_store_output_filter;
+    ctx->output.filter_ctx = r;
+
+#if (NGX_MOGILEFS_THREADS)
+    /*
+     * Body in the temp file is read back in mogilefs_thread_pool,
+     * or in the location's one with "aio threads"
+     */
+    if(mgcf->thread_pool != NULL || clcf->aio == NGX_HTTP_AIO_THREADS) {
+        ctx->output.thread_handler = ngx_http_mogilefs_store_thread_handler;
+    }
+#endif
+
+    ctx->writer.last = &ctx->writer.out;
+    ctx->writer.pool = r->pool;
+
+    if(resolve) {
+        return ngx_http_mogilefs_store_resolve(r, ctx, &url.host);
+    }
+
+    return ngx_http_mogilefs_store_connect(r, ctx);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "mogilefs tracker has sent invalid path \"%V\"", &dest->path);
+
+    ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+
+    return NGX_OK;
+}
+
+/*
+ * Resolves storage node host name with the location's resolver,
+ * the handler may be called right away from ngx_resolve_name()
+ */
+static ngx_int_t
+ngx_http_mogilefs_store_resolve(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx,
+    ngx_str_t *host)
+{
+    ngx_resolver_ctx_t                 *rctx, temp;
+    ngx_http_core_loc_conf_t           *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs store resolve: \"%V\"", host);
+
+    temp.name = *host;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if(rctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(rctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "no resolver defined to resolve %V", host);
+
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+        return NGX_OK;
+    }
+
+    rctx->name = *host;
+#if !(defined nginx_version && nginx_version >= 1005008)
+    rctx->type = NGX_RESOLVE_A;
+#endif
+    rctx->handler = ngx_http_mogilefs_store_resolve_handler;
+    rctx->data = r;
+    rctx->timeout = clcf->resolver_timeout;
+
+    ctx->store_resolve = rctx;
+
+    if(ngx_resolve_name(rctx) != NGX_OK) {
+        ctx->store_resolve = NULL;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_store_resolve_handler(ngx_resolver_ctx_t *rctx)
+{
+    ngx_int_t                           rc;
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+#if !(defined nginx_version && nginx_version >= 1005008)
+    struct sockaddr_in                 *sin;
+#endif
+
+    r = rctx->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(rctx->state) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "mogilefs storage node \"%V\" could not be resolved (%i: %s)",
+                      &rctx->name, rctx->state, ngx_resolver_strerror(rctx->state));
+
+        ngx_resolve_name_done(rctx);
+        ctx->store_resolve = NULL;
+
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+#if defined nginx_version && nginx_version >= 1005008
+    ngx_memcpy(ctx->store_sockaddr, rctx->addrs[0].sockaddr, rctx->addrs[0].socklen);
+    ctx->store_socklen = rctx->addrs[0].socklen;
+
+    ngx_inet_set_port((struct sockaddr *) ctx->store_sockaddr, ctx->store_port);
+#else
+    sin = (struct sockaddr_in *) ctx->store_sockaddr;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(ctx->store_port);
+    sin->sin_addr.s_addr = rctx->addrs[0];
+
+    ctx->store_socklen = sizeof(struct sockaddr_in);
+#endif
+
+    ngx_resolve_name_done(rctx);
+    ctx->store_resolve = NULL;
+
+    rc = ngx_http_mogilefs_store_connect(r, ctx);
+
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_put_finalize(r, ctx, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_store_connect(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_int_t                           rc;
+    ngx_connection_t                   *c;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    ngx_memzero(&ctx->store, sizeof(ngx_peer_connection_t));
+
+    ctx->store.sockaddr = (struct sockaddr *) ctx->store_sockaddr;
+    ctx->store.socklen = ctx->store_socklen;
+    ctx->store.name = &ctx->store_name;
+    ctx->store.get = ngx_event_get_peer;
+    ctx->store.log = r->connection->log;
+    ctx->store.log_error = NGX_ERROR_ERR;
+    ctx->store.tries = 1;
+
+    rc = ngx_event_connect_peer(&ctx->store);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs store connect: %i", rc);
+
+    if(rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+        return NGX_OK;
+    }
+
+    c = ctx->store.connection;
+
+    c->data = r;
+    c->read->handler = ngx_http_mogilefs_store_dummy_handler;
+    c->write->handler = ngx_http_mogilefs_store_write_handler;
+
+    ctx->writer.connection = c;
+
+    /*
+     * Body in the temp file goes to storage node with sendfile,
+     * if it is enabled in the location, the same as upstream does
+     */
+    c->sendfile &= r->connection->sendfile;
+    ctx->output.sendfile = c->sendfile;
+
+    if(rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, mgcf->upstream.connect_timeout);
+        return NGX_OK;
+    }
+
+    ngx_http_mogilefs_store_send(r, ctx);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_store_send(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    ngx_int_t                           rc;
+    ngx_connection_t                   *c;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    c = ctx->store.connection;
+
+    rc = ngx_output_chain(&ctx->output, ctx->store_out);
+
+    ctx->store_out = NULL;
+
+    if(rc == NGX_ERROR) {
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    if(rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, mgcf->upstream.send_timeout);
+
+        if(ngx_handle_write_event(c->write, mgcf->upstream.send_lowat) != NGX_OK) {
+            ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    if(c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_http_mogilefs_store_dummy_handler;
+    c->read->handler = ngx_http_mogilefs_store_read_handler;
+
+    ngx_add_timer(c->read, mgcf->upstream.read_timeout);
+
+    ngx_http_mogilefs_store_read(r, ctx);
+}
+
+/*
+ * Only status line of the storage node response matters,
+ * the connection is closed right after it
+ */
+static void
+ngx_http_mogilefs_store_read(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    u_char                             *p;
+    ssize_t                             n;
+    ngx_int_t                           status;
+    ngx_buf_t                          *b;
+    ngx_connection_t                   *c;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    c = ctx->store.connection;
+    b = &ctx->store_buffer;
+
+    for( ;; ) {
+        p = ngx_http_mogilefs_find(b->pos, b->last, LF, LF);
+
+        if(p != b->last) {
+            break;
+        }
+
+        if(b->last == b->end) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "mogilefs storage node \"%V\" has sent too long status line",
+                          &ctx->store_name);
+
+            ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if(n == NGX_AGAIN) {
+            if(!c->read->timer_set) {
+                mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+                ngx_add_timer(c->read, mgcf->upstream.read_timeout);
+            }
+
+            if(ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        if(n == 0 || n == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "mogilefs storage node \"%V\" prematurely closed connection",
+                          &ctx->store_name);
+
+            ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+
+        b->last += n;
+    }
+
+    if(c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    /*
+     * "HTTP/1.x NNN"
+     */
+    status = NGX_ERROR;
+
+    if((size_t) (p - b->pos) >= sizeof("HTTP/1.x NNN") - 1
+        && ngx_strncmp(b->pos, "HTTP/1.", sizeof("HTTP/1.") - 1) == 0)
+    {
+        status = ngx_atoi(b->pos + sizeof("HTTP/1.x ") - 1, 3);
+    }
+
+    if(status < 200 || status >= 300) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "mogilefs storage node \"%V\" has not stored \"%V\": \"%*s\"",
+                      &ctx->store_name, &ctx->dests[ctx->dest].path,
+                      (size_t) (p - b->pos), b->pos);
+
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    ngx_http_mogilefs_store_close(ctx);
+
+    ngx_http_mogilefs_put_next(r, ctx);
+}
+
+/*
+ * Tries the next destination, if any
+ */
+static void
+ngx_http_mogilefs_store_next(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_http_mogilefs_store_close(ctx);
+
+    if(++ctx->dest < ctx->ndests) {
+        rc = ngx_http_mogilefs_store(r, ctx);
+
+        if(rc == NGX_OK) {
+            return;
+        }
+    }
+
+    ngx_http_mogilefs_put_finalize(r, ctx, rc);
+}
+
+static void
+ngx_http_mogilefs_store_close(ngx_http_mogilefs_put_ctx_t *ctx)
+{
+    if(ctx->store_resolve != NULL) {
+        ngx_resolve_name_done(ctx->store_resolve);
+        ctx->store_resolve = NULL;
+    }
+
+    if(ctx->store.connection != NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->store.log, 0,
+                       "close mogilefs storage node connection");
+
+        ngx_close_connection(ctx->store.connection);
+        ctx->store.connection = NULL;
+    }
+}
+
+static void
+ngx_http_mogilefs_store_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    c = wev->data;
+    r = c->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "mogilefs storage node \"%V\" timed out", &ctx->store_name);
+
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_GATEWAY_TIME_OUT);
+    }
+    else {
+        ngx_http_mogilefs_store_send(r, ctx);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_mogilefs_store_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    c = rev->data;
+    r = c->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "mogilefs storage node \"%V\" timed out", &ctx->store_name);
+
+        ngx_http_mogilefs_store_next(r, ctx, NGX_HTTP_GATEWAY_TIME_OUT);
+    }
+    else {
+        ngx_http_mogilefs_store_read(r, ctx);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_mogilefs_store_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "mogilefs store dummy handler");
+}
+
+/*
+ * Filter context of the output chain is the request,
+ * as thread handler gets it from file->thread_ctx
+ */
+static ngx_int_t
+ngx_http_mogilefs_store_output_filter(void *data, ngx_chain_t *in)
+{
+    ngx_http_request_t                 *r = data;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    return ngx_chain_writer(&ctx->writer, in);
+}
+
+#if (NGX_MOGILEFS_THREADS)
+
+static ngx_int_t
+ngx_http_mogilefs_store_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                           name;
+    ngx_thread_pool_t                  *tp;
+    ngx_http_request_t                 *r;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_mogilefs_loc_conf_t       *mgcf;
+
+    r = file->thread_ctx;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    tp = mgcf->thread_pool;
+
+    if(tp == NULL) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        tp = clcf->thread_pool;
+
+        if(tp == NULL) {
+            if(ngx_http_complex_value(r, clcf->thread_pool_value, &name) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+            if(tp == NULL) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "thread pool \"%V\" not found", &name);
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_mogilefs_store_thread_event_handler;
+
+    if(ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    ctx->output.aio = 1;
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_store_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t                 *r = ev->data;
+    ngx_connection_t                   *c;
+    ngx_http_mogilefs_put_ctx_t        *ctx;
+
+    c = r->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "mogilefs store thread read done");
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    ctx->output.aio = 0;
+
+    if(ctx->store.connection != NULL) {
+        ngx_http_mogilefs_store_send(r, ctx);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_mogilefs_eval_tracker(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf)
+{
+    ngx_str_t             tracker;
+    ngx_http_upstream_t  *u;
+
+    if (ngx_http_script_run(r, &tracker, mgcf->tracker_lengths->elts, 0,
+                            mgcf->tracker_values->elts)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    u->resolved = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_resolved_t));
+    if (u->resolved == NULL) {
+        return NGX_ERROR;
+    }
+
+    u->resolved->host = tracker;
+    u->resolved->no_port = 1;
+
+    return NGX_OK;
+}
+
+typedef struct {
+    ngx_http_request_t                     *request;
+    ngx_resolver_ctx_t                     *resolve;
+    ngx_str_t                               name;
+    in_port_t                               port;
+    ngx_http_mogilefs_tracker_resolved_pt   handler;
+} ngx_http_mogilefs_tracker_resolve_t;
+
+/*
+ * Upstream for the tracker client of the module. Evaluated tracker
+ * names an upstream block or gives host[:port] of a single tracker,
+ * the same as u->resolved does for fetches. Host names go through
+ * the location's resolver, NGX_AGAIN is returned then and the
+ * handler gets the upstream, or NULL if resolving failed
+ */
+static ngx_int_t
+ngx_http_mogilefs_tracker_upstream(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_http_mogilefs_tracker_resolved_pt handler, ngx_http_upstream_srv_conf_t **uscfp)
+{
+    ngx_uint_t                              i;
+    ngx_str_t                               tracker;
+    ngx_url_t                               url;
+    socklen_t                               socklen;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_resolver_ctx_t                     *rctx, temp;
+    ngx_http_upstream_srv_conf_t          **uscfs;
+    ngx_http_upstream_main_conf_t          *umcf;
+    ngx_http_core_loc_conf_t               *clcf;
+    ngx_http_mogilefs_tracker_resolve_t    *tr;
+    u_char                                 *sockaddr;
+
+    if(mgcf->tracker_lengths == NULL) {
+        *uscfp = mgcf->upstream.upstream;
+        return NGX_OK;
+    }
+
+    if(ngx_http_script_run(r, &tracker, mgcf->tracker_lengths->elts, 0,
+                           mgcf->tracker_values->elts)
+        == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscfs = umcf->upstreams.elts;
+
+    for(i = 0;i < umcf->upstreams.nelts;i++) {
+        if(uscfs[i]->port == 0 && uscfs[i]->host.len == tracker.len
+            && ngx_strncasecmp(uscfs[i]->host.data, tracker.data, tracker.len) == 0)
+        {
+            *uscfp = uscfs[i];
+            return NGX_OK;
+        }
+    }
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url = tracker;
+    url.default_port = 6001;
+    url.no_resolve = 1;
+
+    if(ngx_parse_url(r->pool, &url) != NGX_OK || url.host.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "mogilefs: invalid tracker \"%V\"", &tracker);
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    sockaddr = ngx_pcalloc(r->pool, NGX_SOCKADDRLEN);
+    if(sockaddr == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(ngx_http_mogilefs_inet_addr(&url.host, (in_port_t) url.port, sockaddr, &socklen)
+        == NGX_OK)
+    {
+        *uscfp = ngx_http_mogilefs_tracker_implicit(r->pool, &tracker,
+                                                    (struct sockaddr *) sockaddr, socklen);
+
+        return *uscfp ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    temp.name = url.host;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if(rctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(rctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "no resolver defined to resolve %V", &url.host);
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    tr = ngx_palloc(r->pool, sizeof(ngx_http_mogilefs_tracker_resolve_t));
+    if(tr == NULL) {
+        ngx_resolve_name_done(rctx);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) {
+        ngx_resolve_name_done(rctx);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tr->request = r;
+    tr->resolve = rctx;
+    tr->name = tracker;
+    tr->port = (in_port_t) url.port;
+    tr->handler = handler;
+
+    cln->handler = ngx_http_mogilefs_tracker_resolve_cleanup;
+    cln->data = tr;
+
+    rctx->name = url.host;
+#if !(defined nginx_version && nginx_version >= 1005008)
+    rctx->type = NGX_RESOLVE_A;
+#endif
+    rctx->handler = ngx_http_mogilefs_tracker_resolve_handler;
+    rctx->data = tr;
+    rctx->timeout = clcf->resolver_timeout;
+
+    if(ngx_resolve_name(rctx) != NGX_OK) {
+        tr->resolve = NULL;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+static void
+ngx_http_mogilefs_tracker_resolve_handler(ngx_resolver_ctx_t *rctx)
+{
+    u_char                                 *sockaddr;
+    socklen_t                               socklen;
+    ngx_connection_t                       *c;
+    ngx_http_request_t                     *r;
+    ngx_http_upstream_srv_conf_t           *uscf;
+    ngx_http_mogilefs_tracker_resolve_t    *tr;
+#if !(defined nginx_version && nginx_version >= 1005008)
+    struct sockaddr_in                     *sin;
+#endif
+
+    tr = rctx->data;
+    r = tr->request;
+    c = r->connection;
+
+    uscf = NULL;
+
+    if(rctx->state) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "mogilefs tracker \"%V\" could not be resolved (%i: %s)",
+                      &rctx->name, rctx->state, ngx_resolver_strerror(rctx->state));
+        goto done;
+    }
+
+    sockaddr = ngx_pcalloc(r->pool, NGX_SOCKADDRLEN);
+    if(sockaddr == NULL) {
+        goto done;
+    }
+
+#if defined nginx_version && nginx_version >= 1005008
+    ngx_memcpy(sockaddr, rctx->addrs[0].sockaddr, rctx->addrs[0].socklen);
+    socklen = rctx->addrs[0].socklen;
+
+    ngx_inet_set_port((struct sockaddr *) sockaddr, tr->port);
+#else
+    sin = (struct sockaddr_in *) sockaddr;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(tr->port);
+    sin->sin_addr.s_addr = rctx->addrs[0];
+
+    socklen = sizeof(struct sockaddr_in);
+#endif
+
+    uscf = ngx_http_mogilefs_tracker_implicit(r->pool, &tr->name,
+                                              (struct sockaddr *) sockaddr, socklen);
+
+done:
+
+    ngx_resolve_name_done(rctx);
+    tr->resolve = NULL;
+
+    tr->handler(r, uscf);
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_mogilefs_tracker_resolve_cleanup(void *data)
+{
+    ngx_http_mogilefs_tracker_resolve_t    *tr = data;
+
+    if(tr->resolve != NULL) {
+        ngx_resolve_name_done(tr->resolve);
+        tr->resolve = NULL;
+    }
+}
+
+/*
+ * Upstream of a single tracker given by address,
+ * lives in the pool of the request
+ */
+static ngx_http_upstream_srv_conf_t *
+ngx_http_mogilefs_tracker_implicit(ngx_pool_t *pool, ngx_str_t *name,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+
+    uscf = ngx_pcalloc(pool, sizeof(ngx_http_upstream_srv_conf_t));
+    if(uscf == NULL) {
+        return NULL;
+    }
+
+    peers = ngx_pcalloc(pool, sizeof(ngx_http_upstream_rr_peers_t));
+    if(peers == NULL) {
+        return NULL;
+    }
+
+#if defined nginx_version && nginx_version >= 1009000
+    peer = ngx_pcalloc(pool, sizeof(ngx_http_upstream_rr_peer_t));
+    if(peer == NULL) {
+        return NULL;
+    }
+
+    peers->peer = peer;
+#else
+    peer = &peers->peer[0];
+#endif
+
+    peer->sockaddr = sockaddr;
+    peer->socklen = socklen;
+    peer->name = *name;
+    peer->weight = 1;
+    peer->max_fails = 1;
+    peer->fail_timeout = 10;
+
+    peers->single = 1;
+    peers->number = 1;
+    peers->name = &uscf->host;
+
+    uscf->host = *name;
+    uscf->peer.data = peers;
+
+    return uscf;
+}
+
+/*
+ * Fills sockaddr if host is an IPv4 or IPv6 (possibly
+ * bracketed) address, NGX_DECLINED otherwise
+ */
+static ngx_int_t
+ngx_http_mogilefs_inet_addr(ngx_str_t *host, in_port_t port, u_char *sockaddr,
+    socklen_t *socklen)
+{
+    u_char                 *p;
+    size_t                  len;
+    in_addr_t               addr;
+    struct sockaddr_in     *sin;
+#if (NGX_HAVE_INET6)
+    struct in6_addr         inaddr6;
+    struct sockaddr_in6    *sin6;
+#endif
+
+    p = host->data;
+    len = host->len;
+
+    if(len > 2 && p[0] == '[' && p[len - 1] == ']') {
+        p++;
+        len -= 2;
+    }
+
+    ngx_memzero(sockaddr, NGX_SOCKADDRLEN);
+
+    addr = ngx_inet_addr(p, len);
+
+    if(addr != INADDR_NONE) {
+        sin = (struct sockaddr_in *) sockaddr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = addr;
+
+        *socklen = sizeof(struct sockaddr_in);
+
+        return NGX_OK;
+    }
+
+#if (NGX_HAVE_INET6)
+    if(ngx_inet6_addr(p, len, inaddr6.s6_addr) == NGX_OK) {
+        sin6 = (struct sockaddr_in6 *) sockaddr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        ngx_memcpy(sin6->sin6_addr.s6_addr, inaddr6.s6_addr, 16);
+
+        *socklen = sizeof(struct sockaddr_in6);
+
+        return NGX_OK;
+    }
+#endif
+
+    return NGX_DECLINED;
+}
+
+/*
+ * Picks the first non-empty class, NGX_DECLINED if there is none
+ */
+static ngx_int_t
+ngx_http_mogilefs_eval_class(ngx_http_request_t *r, ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *class)
+{
+    ngx_uint_t                           i;
+    ngx_http_mogilefs_class_template_t  *t;
+
+    if(mgcf->class_templates == NULL) {
+        return NGX_DECLINED;
+    }
+
+    t = mgcf->class_templates->elts;
+
+    for(i = 0;i < mgcf->class_templates->nelts;i++) {
+        if(t->lengths != NULL && t->values != NULL) {
+            if(ngx_http_script_run(r, class, t->lengths->elts, 0,
+                                    t->values->elts)
+                == NULL)
+            {
+                return NGX_ERROR;
+            }
+        }
+        else {
+            *class = t->source;
+
+            return NGX_OK;
+        }
+
+        if(class->len) {
+            return NGX_OK;
+        }
+
+        t++;
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_eval_key(ngx_http_request_t *r, ngx_str_t *key)
+{
+    size_t                          loc_len;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+    /*
+     * If key is empty take the remaining part of request URI,
+     * otherwise run script to obtain key
+     */
+    if(mgcf->key.len == 0) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        loc_len = r->valid_location ? clcf->name.len : 0;
+
+        key->data = r->uri.data + loc_len;
+        key->len = r->uri.len - loc_len;
+    }
+    else {
+        if(mgcf->key_lengths != NULL) {
+            if (ngx_http_script_run(r, key, mgcf->key_lengths->elts, 0,
+                                    mgcf->key_values->elts)
+                == NULL)
+            {
+                return NGX_ERROR;
+            }
+        }
+        else {
+            *key = mgcf->key;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_set_cmd(ngx_http_request_t *r, ngx_http_mogilefs_ctx_t *ctx)
+{
+    ngx_http_mogilefs_cmd_t *c;
+
+    c = ngx_http_mogilefs_cmds;
+
+    while(c->name.data != NULL) {
+        if(c->method & r->method)
+            break;
+
+        c++;
+    }
+
+    if(c->name.data != NULL) {
+        ctx->cmd = c;
+        return NGX_OK;
+    }
+
+    return NGX_ERROR;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_create_request(ngx_http_request_t *r)
+{
+    size_t                          len, args_len, file_info_len;
+    u_char                         *p, *args;
+    ngx_str_t                       cmd;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_str_t                       request;
+    ngx_http_mogilefs_ctx_t        *ctx;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    cmd = ctx->cmd->name;
+
+    if(ctx->key.len == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ctx->start = ngx_current_msec;
+
+    /*
+     * Key and domain are escaped in one pass, so room is reserved
+     * for the case every character gets escaped
+     */
+    args_len = sizeof("key=") - 1 + 3 * ctx->key.len + (mgcf->cmd_template.domain.len != 0
+        ? mgcf->cmd_template.domain.len : sizeof("&domain=") - 1 + 3 * ctx->domain.len);
+
+    len = cmd.len + 1 + args_len + mgcf->cmd_template.args.len + sizeof(CRLF) - 1;
+
+    file_info_len = 0;
+
+    if(ctx->file_info) {
+        file_info_len = sizeof("file_info ") - 1 + args_len + sizeof(CRLF) - 1;
+    }
+
+    p = ngx_pnalloc(r->pool, file_info_len + len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->temporary = 1;
+
+    /*
+     * Leave room for file_info command, it is filled in
+     * after the main command
+     */
+    b->start = b->pos = b->last = p + file_info_len;
+    b->end = p + file_info_len + len;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    r->upstream->request_bufs = cl;
+
+    b->last = ngx_copy(b->last, cmd.data, cmd.len);
+
+    *b->last++ = ' ';
+
+    args = b->last;
+
+    b->last = ngx_copy(b->last, "key=", sizeof("key=") - 1);
+
+    b->last = ngx_http_mogilefs_escape_memcached(b->last, ctx->key.data, ctx->key.len);
+
+    if(mgcf->cmd_template.domain.len != 0) {
+        b->last = ngx_copy(b->last, mgcf->cmd_template.domain.data,
+                           mgcf->cmd_template.domain.len);
+    }
+    else {
+        b->last = ngx_copy(b->last, "&domain=", sizeof("&domain=") - 1);
+
+        b->last = ngx_http_mogilefs_escape_memcached(b->last, ctx->domain.data,
+                                                     ctx->domain.len);
+    }
+
+    /*
+     * file_info takes the same key and domain arguments,
+     * buffer is extended backwards to fit it
+     */
+    if(ctx->file_info) {
+        b->start -= sizeof("file_info ") - 1 + (b->last - args) + sizeof(CRLF) - 1;
+        b->pos = b->start;
+
+        p = ngx_copy(b->start, "file_info ", sizeof("file_info ") - 1);
+        p = ngx_copy(p, args, b->last - args);
+        *p++ = CR; *p++ = LF;
+    }
+
+    b->last = ngx_copy(b->last, mgcf->cmd_template.args.data, mgcf->cmd_template.args.len);
+
+    request.data = b->pos;
+    request.len = b->last - b->pos;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs request: \"%V\"", &request);
+
+    *b->last++ = CR; *b->last++ = LF;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_reinit_request(ngx_http_request_t *r)
+{
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    /*
+     * Request is sent again along with file_info command
+     */
+    ctx->file_info = (r->method & NGX_HTTP_GET && mgcf->file_info) ? 1 : 0;
+
+    return NGX_OK;
+}
+
+static int ngx_libc_cdecl ngx_http_mogilefs_cmp_sources(const void *one,
+    const void *two)
+{
+    ngx_http_mogilefs_src_t *first, *second;
+
+    first = (ngx_http_mogilefs_src_t *) one;
+    second = (ngx_http_mogilefs_src_t *) two;
+
+    return first->priority - second->priority;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_process_ok_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *line)
+{
+    ngx_int_t                        rc;
+
+    ngx_table_elt_t                *h;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_ctx_t        *ctx;
+
+    rc = ngx_http_mogilefs_parse_params(r, line);
+
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    /*
+     * Convert ok response to delete into No content
+     */
+    if(ctx->cmd->method & NGX_HTTP_DELETE) {
+        ngx_http_mogilefs_cache_delete(&ctx->domain, &ctx->key);
+
+        r->headers_out.content_length_n = 0;
+        u->headers_in.status_n = NGX_HTTP_NO_CONTENT;
+        u->state->status = NGX_HTTP_NO_CONTENT;
+
+        // Return no content
+        u->buffer.pos = u->buffer.pos;
+
+        return NGX_OK;
+    }
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    /*
+     * Response to file_info carries everything HEAD needs,
+     * so storage nodes are not contacted
+     */
+    if(ctx->cmd->method & NGX_HTTP_HEAD) {
+        rc = ngx_http_mogilefs_process_file_info(r, u, line);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+
+        if(ctx->class_name.len) {
+            h = ngx_list_push(&r->headers_out.headers);
+            if (h == NULL) {
+                return NGX_ERROR;
+            }
+
+            h->hash = 1;
+            h->key = ngx_http_mogilefs_class_header;
+            h->value = ctx->class_name;
+        }
+
+        /*
+         * Upstream copies the length from its own headers
+         * into the response once this handler returns
+         */
+        u->headers_in.content_length_n = (ctx->length.len != 0)
+            ? ngx_atoof(ctx->length.data, ctx->length.len) : -1;
+
+        u->headers_in.status_n = 200;
+        u->state->status = 200;
+
+        return NGX_OK;
+    }
+
+    if(ctx->cmd->method & NGX_HTTP_GET) {
+        ngx_http_mogilefs_status_paths(ctx->num_paths_returned);
+    }
+
+    /*
+     * If no paths retuned, but response was ok, tell the client it's unavailable
+     */
+    if(ctx->num_paths_returned <= 0 || ctx->sources.nelts == 0) {
+        r->headers_out.content_length_n = 0;
+        u->headers_in.status_n = NGX_HTTP_SERVICE_UNAVAILABLE;
+        u->state->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+        // Return no content
+        u->buffer.pos = u->buffer.pos;
+
+        return NGX_OK;
+    }
+
+    /*
+     * Sort sources and choose top source
+     */
+    if(ctx->sources.nelts > 1) {
+        ngx_qsort(ctx->sources.elts, ctx->sources.nelts, sizeof(ngx_http_mogilefs_src_t),
+            ngx_http_mogilefs_cmp_sources);
+    }
+
+    ngx_http_mogilefs_set_path_variables(r, ctx);
+
+    /*
+     * Redirect to fetch location
+     */
+    if (ctx->cmd->method & (NGX_HTTP_GET|NGX_HTTP_HEAD) && r->upstream->headers_in.x_accel_redirect == NULL) {
+
+        if(mgcf->cache_valid && ctx->cmd->method & NGX_HTTP_GET) {
+            ngx_http_mogilefs_cache_put(r->connection->log, ctx, mgcf->cache_valid,
+                ngx_max(mgcf->cache_stale, mgcf->cache_stale_if_error));
+        }
+
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+        h = ngx_list_push(&r->upstream->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(ngx_hash(
+                            ngx_hash('x', '-'), 'a'), 'c'), 'c'), 'e'), 'l'), '-'), 'r'), 'e'), 'd'), 'i'), 'r'), 'e'), 'c'), 't');
+
+        h->key.len = sizeof("X-Accel-Redirect") - 1;
+        h->key.data = (u_char *) "X-Accel-Redirect";
+        h->value = *ngx_http_mogilefs_redirect_location(r, ctx);
+        h->lowcase_key = (u_char *) "x-accel-redirect";
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
+
+        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    r->headers_out.content_length_n = 0;
+    u->headers_in.status_n = 200;
+    u->state->status = 200;
+
+    // Return no content
+    u->buffer.pos = u->buffer.pos;
+
+    return NGX_OK;
+}
+
+/*
+ * Sets $mogilefs_path variables from sorted sources
+ */
+static void
+ngx_http_mogilefs_set_path_variables(ngx_http_request_t *r,
+    ngx_http_mogilefs_ctx_t *ctx)
+{
+    ngx_uint_t                      i;
+    ngx_http_variable_value_t      *v;
+    ngx_http_mogilefs_src_t        *source;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    source = ctx->sources.elts;
+
+    for(i=0;i < ctx->sources.nelts && i < NGX_MOGILEFS_MAX_PATHS;i++) {
+        v = r->variables + mgcf->index[i];
+
+        v->data = source[i].path.data;
+        v->len = source[i].path.len;
+
+        v->not_found = 0;
+        v->no_cacheable = 0;
+        v->valid = 1;
+    }
+
+    if(ctx->length.len) {
+        v = r->variables + mgcf->length_index;
+
+        v->data = ctx->length.data;
+        v->len = ctx->length.len;
+
+        v->not_found = 0;
+        v->no_cacheable = 0;
+        v->valid = 1;
+    }
+}
+
+/*
+ * Parses the parameters of OK response
+ */
+static ngx_int_t
+ngx_http_mogilefs_parse_params(ngx_http_request_t *r, ngx_str_t *args)
+{
+    ngx_str_t                        name, value;
+    ngx_int_t                        rc;
+
+    for( ;; ) {
+        rc = ngx_http_mogilefs_next_param(args, &name, &value);
+
+        if(rc == NGX_DONE) {
+            return NGX_OK;
+        }
+
+        if(rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "mogilefs tracker has sent invalid param: \"%V\"", &name);
+            return NGX_ERROR;
+        }
+
+        rc = ngx_http_mogilefs_parse_param(r, &name, &value);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+    }
+}
+
+/*
+ * Sets $mogilefs_length from parsed response to file_info
+ */
+static ngx_int_t
+ngx_http_mogilefs_process_file_info(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *line)
+{
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_variable_value_t      *v;
+    ngx_http_mogilefs_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(ctx->length.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "mogilefs tracker has not sent file length");
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    v = r->variables + mgcf->length_index;
+
+    v->data = ctx->length.data;
+    v->len = ctx->length.len;
+
+    v->not_found = 0;
+    v->no_cacheable = 0;
+    v->valid = 1;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_process_error_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *line)
+{
+    ngx_http_mogilefs_error_t *e;
+    ngx_http_mogilefs_ctx_t   *ctx;
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "mogilefs error: \"%V\"", line);
+
+    e = ngx_http_mogilefs_find_error(line);
+
+    ngx_http_mogilefs_status_error(e);
+
+    ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_ERROR, line->data,
+        ngx_http_mogilefs_find(line->data, line->data + line->len, ' ', ' ') - line->data);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(e->delete_ok) {
+        ngx_http_mogilefs_cache_delete(&ctx->domain, &ctx->key);
+    }
+
+    /*
+     * Convert unknown_key response to delete into No content
+     */
+    if(ctx->cmd->method & NGX_HTTP_DELETE && e->delete_ok) {
+        r->headers_out.content_length_n = 0;
+        u->headers_in.status_n = NGX_HTTP_NO_CONTENT;
+        u->state->status = NGX_HTTP_NO_CONTENT;
+
+        // Return no content
+        u->buffer.pos = u->buffer.pos;
+
+        return NGX_OK;
+    }
+
+    r->headers_out.content_length_n = 0;
+    u->headers_in.status_n = e->status;
+    u->state->status = e->status;
+    ctx->status = e->status;
+
+    // Return no content
+    u->buffer.pos = u->buffer.pos;
+
+    return NGX_OK;
+}
+
+static ngx_http_mogilefs_error_t *
+ngx_http_mogilefs_find_error(ngx_str_t *line)
+{
+    ngx_http_mogilefs_error_t *e;
+
+    e = ngx_http_mogilefs_errors;
+
+    while(e->name.data != NULL) {
+        if(line->len >= e->name.len &&
+            ngx_strncmp(line->data, e->name.data, e->name.len) == 0)
+        {
+            break;
+        }
+
+        e++;
+    }
+
+    return e;
+}
+
+static void
+ngx_http_mogilefs_init_ctx_arrays(ngx_http_mogilefs_ctx_t *ctx, ngx_pool_t *pool)
+{
+    ctx->sources.elts = ctx->source_buf;
+    ctx->sources.nelts = 0;
+    ctx->sources.size = sizeof(ngx_http_mogilefs_src_t);
+    ctx->sources.nalloc = NGX_MOGILEFS_MAX_PATHS;
+    ctx->sources.pool = pool;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_parse_param(ngx_http_request_t *r, ngx_str_t *name, ngx_str_t *value) {
+    ngx_http_mogilefs_ctx_t   *ctx;
+    ngx_http_mogilefs_src_t   *source;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs param: \"%V\"=\"%V\"", name, value);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(name->len == ngx_http_mogilefs_length.len &&
+        ngx_strncmp(name->data, ngx_http_mogilefs_length.data, ngx_http_mogilefs_length.len) == 0)
+    {
+        ctx->length = *value;
+    }
+    else if(name->len == ngx_http_mogilefs_class.len &&
+        ngx_strncmp(name->data, ngx_http_mogilefs_class.data, ngx_http_mogilefs_class.len) == 0)
+    {
+        ctx->class_name = *value;
+    }
+    else if(name->len >= ctx->cmd->output_param.len
+        && ngx_strncmp(name->data, ctx->cmd->output_param.data, ctx->cmd->output_param.len) == 0
+        && ngx_atoi(name->data + ctx->cmd->output_param.len, name->len - ctx->cmd->output_param.len) != NGX_ERROR)
+    {
+        source = ngx_array_push(&ctx->sources);
+
+        if(source == NULL) {
+            return NGX_ERROR;
+        }
+
+        source->priority = ngx_atoi(name->data + ctx->cmd->output_param.len, name->len - ctx->cmd->output_param.len);
+        source->path = *value;
+    }
+    else if(name->len == ctx->cmd->output_count_param.len &&
+        ngx_strncmp(name->data, ctx->cmd->output_count_param.data, ctx->cmd->output_count_param.len) == 0)
+    {
+        ctx->num_paths_returned = ngx_atoi(value->data, value->len);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_process_header(ngx_http_request_t *r)
+{
+    ngx_int_t                     rc;
+    ngx_http_upstream_t          *u;
+    ngx_http_mogilefs_ctx_t      *ctx;
+    ngx_http_mogilefs_response_t  resp;
+
+    u = r->upstream;
+
+    rc = ngx_http_mogilefs_parse_response(u->buffer.pos, u->buffer.last, &resp);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs: \"%V\"", &resp.line);
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "mogilefs tracker has sent invalid response: \"%V\"", &resp.line);
+
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    /*
+     * Nothing more is expected from the tracker,
+     * the connection can be used again
+     */
+    if (!ctx->file_info && resp.next == u->buffer.last) {
+        ngx_http_mogilefs_keepalive_done(r);
+    }
+
+    if (!resp.ok) {
+        return ngx_http_mogilefs_process_error_response(r, u, &resp.args);
+    }
+
+    /*
+     * Response to pipelined file_info comes first,
+     * then goes response to the main command
+     */
+    if(ctx->file_info) {
+        ctx->file_info = 0;
+
+        rc = ngx_http_mogilefs_parse_params(r, &resp.args);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+
+        rc = ngx_http_mogilefs_process_file_info(r, u, &resp.args);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+
+        u->buffer.pos = resp.next;
+
+        return ngx_http_mogilefs_process_header(r);
+    }
+
+    return ngx_http_mogilefs_process_ok_response(r, u, &resp.args);
+}
+
+static void
+ngx_http_mogilefs_abort_request(ngx_http_request_t *r)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "abort mogilefs request");
+    return;
+}
+
+static void
+ngx_http_mogilefs_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+    u_char                         *p;
+    ngx_uint_t                      cmd;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_ctx_t        *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "finalize mogilefs request");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(ctx->slot != NULL) {
+        ngx_http_mogilefs_slot_free(ctx->slot);
+        ctx->slot = NULL;
+    }
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(ctx->cmd->method & NGX_HTTP_DELETE) {
+        cmd = NGX_MOGILEFS_STAT_DELETE;
+    }
+    else if(ctx->cmd->method & NGX_HTTP_HEAD) {
+        cmd = NGX_MOGILEFS_STAT_FILE_INFO;
+    }
+    else {
+        cmd = NGX_MOGILEFS_STAT_GET_PATHS;
+    }
+
+    ngx_http_mogilefs_status_update(cmd, r->upstream->peer.name,
+        (ngx_msec_int_t) (ngx_current_msec - ctx->start),
+        rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE
+        || ctx->status >= NGX_HTTP_SPECIAL_RESPONSE);
+
+    ngx_http_mogilefs_set_tracker_variables(r, cmd, r->upstream->peer.name,
+        (ngx_msec_int_t) (ngx_current_msec - ctx->start));
+
+    /*
+     * Expired paths of the key are served for a while
+     * if tracker keeps failing
+     */
+    if(mgcf->cache_stale_if_error && cmd == NGX_MOGILEFS_STAT_GET_PATHS
+        && (rc == NGX_ERROR || rc >= NGX_HTTP_INTERNAL_SERVER_ERROR
+            || ctx->status >= NGX_HTTP_INTERNAL_SERVER_ERROR))
+    {
+        ngx_http_mogilefs_cache_fail(&ctx->domain, &ctx->key);
+    }
+
+    if(ctx->num_paths_returned >= 0) {
+        p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+
+        if(p != NULL) {
+            ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_PATHS_RETURNED, p,
+                ngx_sprintf(p, "%z", ctx->num_paths_returned) - p);
+        }
+    }
+
+    return;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_filter_init(void *data)
+{
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_filter(void *data, ssize_t bytes)
+{
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_escape(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst)
+{
+    if (ngx_http_mogilefs_escape_span(src->data, src->len) == src->len) {
+        *dst = *src;
+        return NGX_OK;
+    }
+
+    dst->data = ngx_pnalloc(pool, 3 * src->len);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst->len = ngx_http_mogilefs_escape_memcached(dst->data, src->data, src->len)
+        - dst->data;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_list_arg(ngx_http_request_t *r, ngx_str_t *arg, ngx_str_t *value)
+{
+    u_char                         *dst, *src;
+    ngx_str_t                       unescaped;
+
+    unescaped.data = ngx_pnalloc(r->pool, arg->len);
+    if (unescaped.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dst = unescaped.data;
+    src = arg->data;
+
+    ngx_unescape_uri(&dst, &src, arg->len, NGX_UNESCAPE_URI);
+
+    unescaped.len = dst - unescaped.data;
+
+    if (unescaped.len > NGX_MOGILEFS_MAX_KEY_LEN) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /*
+     * NGX_ESCAPE_MEMCACHED leaves "&", "=" and "+" as is,
+     * which would let the client add arguments to list_keys
+     */
+    value->data = ngx_pnalloc(r->pool, 3 * unescaped.len);
+    if (value->data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    value->len = ngx_http_mogilefs_escape_arg(value->data, unescaped.data,
+                                              unescaped.len)
+        - value->data;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_list_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc, n;
+    ngx_str_t                       value, domain, after;
+    ngx_http_mogilefs_list_ctx_t   *ctx;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (r->method & NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = -1;
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+        r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+        return ngx_http_send_header(r);
+    }
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_mogilefs_list_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->cmd = ngx_http_mogilefs_cmds;
+
+    while(ctx->cmd->name.data != NULL) {
+        if(ctx->cmd->name.len == ngx_http_mogilefs_list_keys.len
+            && ngx_strncmp(ctx->cmd->name.data, ngx_http_mogilefs_list_keys.data,
+                           ngx_http_mogilefs_list_keys.len) == 0)
+        {
+            break;
+        }
+
+        ctx->cmd++;
+    }
+
+    ctx->page_size = mgcf->list_page_size;
+
+    if(ngx_http_complex_value(r, mgcf->domain_complex, &domain) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(ngx_http_mogilefs_escape(r->pool, &domain, &ctx->domain) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(ngx_http_arg(r, (u_char *) "prefix", sizeof("prefix") - 1, &value) == NGX_OK) {
+        rc = ngx_http_mogilefs_list_arg(r, &value, &ctx->prefix);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    /*
+     * next_after returned by tracker is kept here
+     * between the pages
+     */
+    ctx->after.data = ngx_pnalloc(r->pool, 3 * NGX_MOGILEFS_MAX_KEY_LEN);
+    if(ctx->after.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(ngx_http_arg(r, (u_char *) "after", sizeof("after") - 1, &value) == NGX_OK) {
+        rc = ngx_http_mogilefs_list_arg(r, &value, &after);
+
+        if(rc != NGX_OK) {
+            return rc;
+        }
+
+        ctx->after.len = ngx_cpymem(ctx->after.data, after.data, after.len)
+            - ctx->after.data;
+    }
+
+    if(ngx_http_arg(r, (u_char *) "limit", sizeof("limit") - 1, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if(n == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ctx->limit = n;
+    }
+
+    rc = ngx_http_mogilefs_tracker_upstream(r, mgcf,
+                                            ngx_http_mogilefs_list_tracker_resolved, &uscf);
+
+    if(rc == NGX_AGAIN) {
+        ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
+
+#if defined nginx_version && nginx_version >= 8011
+        r->main->count++;
+#endif
+
+        return NGX_DONE;
+    }
+
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    rc = ngx_http_mogilefs_list_start(r, ctx, uscf);
+
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+#if defined nginx_version && nginx_version >= 8011
+    r->main->count++;
+#endif
+
+    ngx_http_mogilefs_list_send_request(r, ctx);
+
+    return NGX_DONE;
+}
+
+/*
+ * Continues list handler once the tracker host name is resolved
+ */
+static void
+ngx_http_mogilefs_list_tracker_resolved(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                       rc;
+    ngx_http_mogilefs_list_ctx_t   *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(uscf == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    rc = ngx_http_mogilefs_list_start(r, ctx, uscf);
+
+    if(rc != NGX_OK) {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    ngx_http_mogilefs_list_send_request(r, ctx);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_list_start(ngx_http_request_t *r, ngx_http_mogilefs_list_ctx_t *ctx,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    size_t                          len;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_mogilefs_tracker_t    *t;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    t = ngx_http_mogilefs_tracker_create(r->pool, r->connection->log, mgcf, uscf);
+    if(t == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    len = ctx->cmd->name.len + sizeof(" domain=") - 1 + ctx->domain.len +
+        sizeof("&prefix=") - 1 + ctx->prefix.len +
+        sizeof("&after=") - 1 + 3 * NGX_MOGILEFS_MAX_KEY_LEN +
+        sizeof("&limit=") - 1 + NGX_INT_T_LEN + sizeof(CRLF) - 1;
+
+    t->request.start = ngx_pnalloc(r->pool, len);
+    if(t->request.start == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    t->request.end = t->request.start + len;
+
+    t->process = ngx_http_mogilefs_list_process;
+    t->handler = ngx_http_mogilefs_list_tracker_handler;
+    t->data = r;
+    t->stat = NGX_MOGILEFS_STAT_LIST_KEYS;
+
+    ctx->tracker = t;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_mogilefs_list_cleanup;
+    cln->data = ctx;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_mogilefs_module);
+
+    r->write_event_handler = ngx_http_mogilefs_list_write_handler;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_list_send_request(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx)
+{
+    ngx_buf_t                      *b;
+    ngx_str_t                       request;
+
+    ctx->page_limit = ctx->page_size;
+
+    if(ctx->limit && ctx->limit - ctx->total < ctx->page_limit) {
+        ctx->page_limit = ctx->limit - ctx->total;
+    }
+
+    ctx->page_keys = 0;
+    ctx->status = 0;
+
+    b = &ctx->tracker->request;
+
+    b->pos = b->start;
+
+    b->last = ngx_copy(b->start, ctx->cmd->name.data, ctx->cmd->name.len);
+
+    b->last = ngx_copy(b->last, " domain=", sizeof(" domain=") - 1);
+    b->last = ngx_copy(b->last, ctx->domain.data, ctx->domain.len);
+
+    if(ctx->prefix.len) {
+        b->last = ngx_copy(b->last, "&prefix=", sizeof("&prefix=") - 1);
+        b->last = ngx_copy(b->last, ctx->prefix.data, ctx->prefix.len);
+    }
+
+    if(ctx->after.len) {
+        b->last = ngx_copy(b->last, "&after=", sizeof("&after=") - 1);
+        b->last = ngx_copy(b->last, ctx->after.data, ctx->after.len);
+    }
+
+    b->last = ngx_sprintf(b->last, "&limit=%ui", ctx->page_limit);
+
+    request.data = b->pos;
+    request.len = b->last - b->pos;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs request: \"%V\"", &request);
+
+    *b->last++ = CR; *b->last++ = LF;
+
+    ngx_http_mogilefs_tracker_send(ctx->tracker);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_list_send_header(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx)
+{
+    ctx->header = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    return ngx_http_send_header(r);
+}
+
+/*
+ * Parses list_keys response as it arrives. Only complete
+ * parameters are consumed, so that the buffer never has to hold
+ * the whole response line. Keys are sent to the client
+ * one per line.
+ */
+static ngx_int_t
+ngx_http_mogilefs_list_process(ngx_http_mogilefs_tracker_t *t)
+{
+    u_char                         *p;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b, *out;
+    ngx_str_t                       line, param, name, value;
+    ngx_chain_t                    *cl;
+    ngx_http_request_t             *r;
+    ngx_http_mogilefs_cmd_t        *cmd;
+    ngx_http_mogilefs_error_t      *e;
+    ngx_http_mogilefs_list_ctx_t   *ctx;
+
+    r = t->data;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    /*
+     * Do not consume anything until the client
+     * receives what has been sent already
+     */
+    if(ctx->busy != NULL) {
+        return NGX_BUSY;
+    }
+
+    b = &t->buffer;
+
+    if(!ctx->status) {
+        if(b->last - b->pos >= (ssize_t) sizeof("OK ") - 1 &&
+            ngx_strncmp(b->pos, "OK ", sizeof("OK ") - 1) == 0)
+        {
+            b->pos += sizeof("OK ") - 1;
+
+            ctx->status = 1;
+
+            if(!ctx->header) {
+                rc = ngx_http_mogilefs_list_send_header(r, ctx);
+
+                if(rc == NGX_ERROR || rc > NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+        }
+        else if(b->last - b->pos < (ssize_t) sizeof("ERR ") - 1) {
+            return NGX_AGAIN;
+        }
+        else if(ngx_strncmp(b->pos, "ERR ", sizeof("ERR ") - 1) == 0) {
+            rc = ngx_http_mogilefs_tracker_process_line(t);
+
+            if(rc != NGX_OK) {
+                return rc;
+            }
+
+            line.data = t->line.data + sizeof("ERR ") - 1;
+            line.len = t->line.len - (sizeof("ERR ") - 1);
+
+            /*
+             * No more keys to list
+             */
+            if(line.len >= ngx_http_mogilefs_none_match.len &&
+                ngx_strncmp(line.data, ngx_http_mogilefs_none_match.data,
+                            ngx_http_mogilefs_none_match.len) == 0)
+            {
+                ctx->done = 1;
+                return NGX_OK;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "mogilefs error: \"%V\"", &line);
+
+            e = ngx_http_mogilefs_find_error(&line);
+
+            ngx_http_mogilefs_status_error(e);
+
+            ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_ERROR, line.data,
+                ngx_http_mogilefs_find(line.data, line.data + line.len, ' ', ' ') - line.data);
+
+            return e->status;
+        }
+        else {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "mogilefs tracker has sent invalid response");
+
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if(cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    out = cl->buf;
+
+    /*
+     * Unescaped keys never take more space than the parameters
+     * they were parsed from, so a buffer of the same size suffices
+     */
+    if(out->start == NULL) {
+        out->start = ngx_palloc(r->pool, b->end - b->start);
+        if(out->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        out->end = out->start + (b->end - b->start);
+        out->temporary = 1;
+        out->tag = (ngx_buf_tag_t) &ngx_http_mogilefs_module;
+    }
+
+    out->pos = out->start;
+    out->last = out->start;
+
+    cmd = ctx->cmd;
+    rc = NGX_AGAIN;
+
+    for(p = b->pos; p < b->last; p++) {
+        if(*p != '&' && *p != LF) {
+            continue;
+        }
+
+        name.data = b->pos;
+        name.len = p - b->pos;
+
+        if(name.len && name.data[name.len - 1] == CR) {
+            name.len--;
+        }
+
+        b->pos = p + 1;
+
+        param = name;
+
+        if(ngx_http_mogilefs_split_param(&param, &name, &value) == NGX_OK) {
+            if(name.len > cmd->output_param.len
+                && ngx_strncmp(name.data, cmd->output_param.data, cmd->output_param.len) == 0
+                && ngx_atoi(name.data + cmd->output_param.len,
+                            name.len - cmd->output_param.len) != NGX_ERROR)
+            {
+                out->last = ngx_http_mogilefs_unescape_arg(out->last, value.data,
+                                                           value.len);
+
+                *out->last++ = LF;
+
+                ctx->page_keys++;
+                ctx->total++;
+            }
+            else if(name.len == ngx_http_mogilefs_next_after.len
+                && ngx_strncmp(name.data, ngx_http_mogilefs_next_after.data,
+                               ngx_http_mogilefs_next_after.len) == 0)
+            {
+                if(value.len > 3 * NGX_MOGILEFS_MAX_KEY_LEN) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "mogilefs tracker has sent too long key: \"%V\"", &value);
+                    return NGX_ERROR;
+                }
+
+                ctx->after.len = ngx_cpymem(ctx->after.data, value.data, value.len)
+                    - ctx->after.data;
+            }
+        }
+
+        if(*p == LF) {
+            rc = NGX_OK;
+            break;
+        }
+    }
+
+    if(out->last == out->pos) {
+        cl->next = ctx->free;
+        ctx->free = cl;
+
+        return rc;
+    }
+
+    if(ngx_http_mogilefs_list_output(r, ctx, cl) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if(rc == NGX_AGAIN && ctx->busy != NULL) {
+        return NGX_BUSY;
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_list_output(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx, ngx_chain_t *out)
+{
+    ngx_int_t                       rc;
+    ngx_event_t                    *wev;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    rc = ngx_http_output_filter(r, out);
+
+    if(rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+#if defined nginx_version && nginx_version >= 1001004
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_mogilefs_module);
+#else
+    ngx_chain_update_chains(&ctx->free, &ctx->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_mogilefs_module);
+#endif
+
+    wev = r->connection->write;
+
+    if(ctx->busy != NULL) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if(wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_list_write_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_mogilefs_list_ctx_t   *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    if(r->connection->write->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+
+        r->connection->timedout = 1;
+
+        ngx_http_mogilefs_list_finalize(r, ctx, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if(ctx->busy == NULL) {
+        return;
+    }
+
+    rc = ngx_http_mogilefs_list_output(r, ctx, NULL);
+
+    if(rc == NGX_ERROR) {
+        ngx_http_mogilefs_list_finalize(r, ctx, NGX_ERROR);
+        return;
+    }
+
+    if(rc == NGX_OK && ctx->tracker->paused) {
+        ngx_http_mogilefs_tracker_read(ctx->tracker);
+    }
+}
+
+static void
+ngx_http_mogilefs_list_tracker_handler(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc)
+{
+    ngx_http_request_t             *r;
+    ngx_http_mogilefs_list_ctx_t   *ctx;
+
+    r = t->data;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mogilefs_module);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs list page: rc=%i, keys=%ui, total=%ui",
+                   rc, ctx->page_keys, ctx->total);
+
+    ngx_http_mogilefs_set_tracker_variables(r, NGX_MOGILEFS_STAT_LIST_KEYS, t->peer.name,
+        (ngx_msec_int_t) (ngx_current_msec - t->start));
+
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_list_finalize(r, ctx, rc);
+        return;
+    }
+
+    /*
+     * Full page means there might be more keys
+     */
+    if(!ctx->done && ctx->page_keys == ctx->page_limit && ctx->after.len
+        && (ctx->limit == 0 || ctx->total < ctx->limit))
+    {
+        ngx_http_mogilefs_list_send_request(r, ctx);
+        return;
+    }
+
+    ngx_http_mogilefs_list_finalize(r, ctx, NGX_OK);
+}
+
+static void
+ngx_http_mogilefs_list_finalize(ngx_http_request_t *r,
+    ngx_http_mogilefs_list_ctx_t *ctx, ngx_int_t rc)
+{
+    ngx_http_mogilefs_tracker_close(ctx->tracker);
+
+    if(rc == NGX_OK) {
+        if(!ctx->header) {
+            rc = ngx_http_mogilefs_list_send_header(r, ctx);
+
+            if(rc == NGX_ERROR || rc > NGX_OK) {
+                ngx_http_finalize_request(r, rc);
+                return;
+            }
+        }
+
+        ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
+        return;
+    }
+
+    /*
+     * Status cannot be changed once the header is sent
+     */
+    if(ctx->header && rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        rc = NGX_ERROR;
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+static void
+ngx_http_mogilefs_list_cleanup(void *data)
+{
+    ngx_http_mogilefs_list_ctx_t *ctx = data;
+
+    ngx_http_mogilefs_tracker_close(ctx->tracker);
+}
+
+static ngx_http_mogilefs_tracker_t *
+ngx_http_mogilefs_tracker_create(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_mogilefs_loc_conf_t *mgcf, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_mogilefs_tracker_t    *t;
+
+    t = ngx_pcalloc(pool, sizeof(ngx_http_mogilefs_tracker_t));
+    if(t == NULL) {
+        return NULL;
+    }
+
+    t->buffer.start = ngx_palloc(pool, mgcf->upstream.buffer_size);
+    if(t->buffer.start == NULL) {
+        return NULL;
+    }
+
+    t->buffer.pos = t->buffer.start;
+    t->buffer.last = t->buffer.start;
+    t->buffer.end = t->buffer.start + mgcf->upstream.buffer_size;
+    t->buffer.temporary = 1;
+
+    t->upstream = uscf;
+    t->conf = &mgcf->upstream;
+    t->loc_conf = mgcf;
+    t->read_timeout = mgcf->upstream.read_timeout;
+    t->keepalive = ngx_http_mogilefs_keepalive_find(t->upstream);
+    t->log = log;
+
+    t->process = ngx_http_mogilefs_tracker_process_line;
+
+    t->peer.log = log;
+    t->peer.log_error = NGX_ERROR_ERR;
+    t->peer.get = ngx_http_mogilefs_tracker_get_peer;
+    t->peer.data = t;
+
+    return t;
+}
+
+/*
+ * Sends the command in t->request and calls t->handler once
+ * t->process reports the response as complete. The connection
+ * stays open, so that the next command can be sent over it.
+ */
+static void
+ngx_http_mogilefs_tracker_send(ngx_http_mogilefs_tracker_t *t)
+{
+    ngx_http_upstream_rr_peers_t   *peers;
+
+    peers = t->upstream->peer.data;
+
+    t->received = 0;
+    t->paused = 0;
+    t->done = 0;
+
+    t->start = ngx_current_msec;
+
+    if(t->peer.connection == NULL) {
+        t->peer.tries = peers->number;
+
+        ngx_http_mogilefs_tracker_connect(t);
+        return;
+    }
+
+    /*
+     * One more try in case the tracker has closed
+     * the connection in the meantime
+     */
+    t->peer.tries = peers->number + 1;
+
+    t->peer.connection->write->handler = ngx_http_mogilefs_tracker_write_handler;
+
+    ngx_http_mogilefs_tracker_write(t);
+}
+
+/*
+ * Picks the next live tracker of the upstream, trackers that failed
+ * max_fails times are skipped for fail_timeout like round robin does
+ */
+static ngx_int_t
+ngx_http_mogilefs_tracker_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_mogilefs_tracker_t    *t = data;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_uint_t                      i, n;
+    time_t                          now;
+
+    peers = t->upstream->peer.data;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    n = ngx_http_mogilefs_tracker_rr++ % peers->number;
+
+    for(peer = ngx_http_mogilefs_peer_first(peers);n--;
+        peer = ngx_http_mogilefs_peer_next(peers, peer))
+    {
+        /* void */
+    }
+
+    for(i = 0;i < peers->number;i++) {
+        if(peer == NULL) {
+            peer = ngx_http_mogilefs_peer_first(peers);
+        }
+
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+        if(ngx_http_mogilefs_peer_failed(peer, now)) {
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+
+            peer = ngx_http_mogilefs_peer_next(peers, peer);
+            continue;
+        }
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+
+        pc->sockaddr = peer->sockaddr;
+        pc->socklen = peer->socklen;
+        pc->name = &peer->name;
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if(t->loc_conf->adaptive_factor) {
+            t->read_timeout = ngx_http_mogilefs_adaptive_timeout(t->loc_conf, pc->name);
+        }
+
+        if(t->keepalive != NULL) {
+            pc->connection = ngx_http_mogilefs_keepalive_get(t->keepalive, pc);
+
+            if(pc->connection != NULL) {
+                return NGX_DONE;
+            }
+        }
+
+        /*
+         * Only fresh connections are accounted, an idle one
+         * closed by the tracker does not make it failed
+         */
+        t->rr_peer = peer;
+
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_BUSY;
+}
+
+static ngx_uint_t
+ngx_http_mogilefs_peer_failed(ngx_http_upstream_rr_peer_t *peer, time_t now)
+{
+    if(peer->down) {
+        return 1;
+    }
+
+    if(peer->max_fails == 0 || peer->fails < peer->max_fails) {
+        return 0;
+    }
+
+#if defined nginx_version && nginx_version >= 1002000
+    if(now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+        return 0;
+    }
+#else
+    if(now - peer->accessed > peer->fail_timeout) {
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * Accounts the result of a command on a fresh connection
+ * in fails of the tracker, as round robin peer free does
+ */
+static void
+ngx_http_mogilefs_tracker_free_peer(ngx_http_mogilefs_tracker_t *t, ngx_uint_t failed)
+{
+    time_t                          now;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_rr_peers_t   *peers;
+#endif
+    ngx_http_upstream_rr_peer_t    *peer;
+
+    peer = t->rr_peer;
+
+    if(peer == NULL) {
+        return;
+    }
+
+    t->rr_peer = NULL;
+
+    /*
+     * The locks are no-ops without the upstream zone, and so
+     * peers would be set but not used
+     */
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    peers = t->upstream->peer.data;
+#endif
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    if(failed) {
+        now = ngx_time();
+
+        peer->fails++;
+        peer->accessed = now;
+#if defined nginx_version && nginx_version >= 1002000
+        peer->checked = now;
+#endif
+
+        if(peer->max_fails && peer->fails >= peer->max_fails) {
+            ngx_log_error(NGX_LOG_WARN, t->log, 0,
+                          "mogilefs tracker %V temporarily disabled", &peer->name);
+        }
+    }
+#if defined nginx_version && nginx_version >= 1002000
+    else if(peer->accessed < peer->checked) {
+        peer->fails = 0;
+    }
+#else
+    else {
+        peer->fails = 0;
+    }
+#endif
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+static void
+ngx_http_mogilefs_tracker_connect(ngx_http_mogilefs_tracker_t *t)
+{
+    ngx_int_t                       rc;
+    ngx_connection_t               *c;
+
+    rc = ngx_event_connect_peer(&t->peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, t->log, 0,
+                   "mogilefs tracker connect: %i", rc);
+
+    if(rc == NGX_ERROR) {
+        ngx_http_mogilefs_tracker_finish(t, NGX_ERROR);
+        return;
+    }
+
+    if(rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, t->log, 0, "mogilefs: no live trackers");
+        ngx_http_mogilefs_tracker_finish(t, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    if(rc == NGX_DECLINED) {
+        ngx_http_mogilefs_tracker_next(t, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    c = t->peer.connection;
+
+    c->data = t;
+    c->read->handler = ngx_http_mogilefs_tracker_read_handler;
+    c->write->handler = ngx_http_mogilefs_tracker_write_handler;
+
+    if(rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, t->conf->connect_timeout);
+        return;
+    }
+
+    ngx_http_mogilefs_tracker_write(t);
+}
+
+static void
+ngx_http_mogilefs_tracker_write(ngx_http_mogilefs_tracker_t *t)
+{
+    ssize_t                         n;
+    ngx_buf_t                      *b;
+    ngx_connection_t               *c;
+
+    c = t->peer.connection;
+    b = &t->request;
+
+    while(b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if(n == NGX_ERROR) {
+            ngx_http_mogilefs_tracker_next(t, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+
+        if(n == NGX_AGAIN) {
+            ngx_add_timer(c->write, t->conf->send_timeout);
+
+            if(ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_http_mogilefs_tracker_finish(t, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    if(c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_http_mogilefs_tracker_dummy_handler;
+
+    ngx_add_timer(c->read, t->read_timeout);
+
+    ngx_http_mogilefs_tracker_read(t);
+}
+
+static void
+ngx_http_mogilefs_tracker_read(ngx_http_mogilefs_tracker_t *t)
+{
+    ssize_t                         n;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_connection_t               *c;
+
+    c = t->peer.connection;
+    b = &t->buffer;
+
+    t->paused = 0;
+
+    for( ;; ) {
+        if(b->pos != b->last) {
+            rc = t->process(t);
+
+            if(rc == NGX_BUSY) {
+                t->paused = 1;
+
+                if(c->read->timer_set) {
+                    ngx_del_timer(c->read);
+                }
+
+                return;
+            }
+
+            if(rc != NGX_AGAIN) {
+                if(c->read->timer_set) {
+                    ngx_del_timer(c->read);
+                }
+
+                ngx_http_mogilefs_tracker_finish(t, rc);
+                return;
+            }
+        }
+
+        if(b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+        else if(b->last == b->end) {
+            if(b->pos == b->start) {
+                ngx_log_error(NGX_LOG_ERR, t->log, 0,
+                              "mogilefs tracker has sent too long response line");
+
+                ngx_http_mogilefs_tracker_finish(t, NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if(n == NGX_AGAIN) {
+            if(!c->read->timer_set) {
+                ngx_add_timer(c->read, t->read_timeout);
+            }
+
+            if(ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_mogilefs_tracker_finish(t, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if(n == 0 || n == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, t->log, 0,
+                          "mogilefs tracker prematurely closed connection");
+
+            if(t->received) {
+                ngx_http_mogilefs_tracker_finish(t, NGX_HTTP_BAD_GATEWAY);
+            }
+            else {
+                ngx_http_mogilefs_tracker_next(t, NGX_HTTP_BAD_GATEWAY);
+            }
+
+            return;
+        }
+
+        t->received = 1;
+
+        b->last += n;
+
+        ngx_add_timer(c->read, t->read_timeout);
+    }
+}
+
+/*
+ * Retries the command with the next tracker,
+ * unless the response has already been started
+ */
+static void
+ngx_http_mogilefs_tracker_next(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc)
+{
+    ngx_http_mogilefs_tracker_free_peer(t, 1);
+
+    ngx_http_mogilefs_tracker_close(t);
+
+    if(t->received || t->peer.tries == 0 || --t->peer.tries == 0) {
+        ngx_http_mogilefs_tracker_finish(t, rc);
+        return;
+    }
+
+    t->request.pos = t->request.start;
+
+    t->buffer.pos = t->buffer.start;
+    t->buffer.last = t->buffer.start;
+
+    ngx_http_mogilefs_tracker_connect(t);
+}
+
+static void
+ngx_http_mogilefs_tracker_finish(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc)
+{
+    ngx_http_mogilefs_status_update(t->stat, t->peer.name,
+        (ngx_msec_int_t) (ngx_current_msec - t->start), rc != NGX_OK);
+
+    ngx_http_mogilefs_tracker_free_peer(t, rc != NGX_OK);
+
+    if(rc != NGX_OK) {
+        ngx_http_mogilefs_tracker_close(t);
+    }
+    else {
+        t->done = (t->buffer.pos == t->buffer.last);
+    }
+
+    t->handler(t, rc);
+}
+
+static void
+ngx_http_mogilefs_tracker_close(ngx_http_mogilefs_tracker_t *t)
+{
+    if(t->peer.connection != NULL) {
+        if(t->done && t->keepalive != NULL
+            && ngx_http_mogilefs_keepalive_put(t->keepalive, &t->peer) == NGX_OK)
+        {
+            t->peer.connection = NULL;
+            return;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, t->log, 0,
+                       "close mogilefs tracker connection");
+
+        ngx_http_mogilefs_keepalive_close_connection(t->peer.connection);
+        t->peer.connection = NULL;
+    }
+}
+
+static void
+ngx_http_mogilefs_tracker_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t               *c;
+    ngx_http_mogilefs_tracker_t    *t;
+
+    c = wev->data;
+    t = c->data;
+
+    if(wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, t->log, NGX_ETIMEDOUT,
+                      "mogilefs tracker timed out");
+
+        ngx_http_mogilefs_tracker_next(t, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    ngx_http_mogilefs_tracker_write(t);
+}
+
+static void
+ngx_http_mogilefs_tracker_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t               *c;
+    ngx_http_mogilefs_tracker_t    *t;
+
+    c = rev->data;
+    t = c->data;
+
+    if(rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, t->log, NGX_ETIMEDOUT,
+                      "mogilefs tracker timed out");
+
+        ngx_http_mogilefs_tracker_next(t, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    /*
+     * Nothing is expected between the commands, the tracker
+     * has closed the connection. The next command reconnects
+     */
+    if(t->done) {
+        t->done = 0;
+
+        ngx_http_mogilefs_tracker_close(t);
+        return;
+    }
+
+    ngx_http_mogilefs_tracker_read(t);
+}
+
+static void
+ngx_http_mogilefs_tracker_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "mogilefs tracker dummy handler");
+}
+
+static ngx_int_t
+ngx_http_mogilefs_tracker_process_line(ngx_http_mogilefs_tracker_t *t)
+{
+    u_char                         *p;
+    ngx_buf_t                      *b;
+
+    b = &t->buffer;
+
+    for(p = b->pos; p < b->last; p++) {
+        if(*p == LF) {
+            t->line.data = b->pos;
+            t->line.len = p - b->pos;
+
+            if(t->line.len && t->line.data[t->line.len - 1] == CR) {
+                t->line.len--;
+            }
+
+            b->pos = p + 1;
+
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+static ngx_http_mogilefs_upstream_t *
+ngx_http_mogilefs_upstream_find(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                      i;
+    ngx_http_mogilefs_upstream_t   *us;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || uscf == NULL) {
+        return NULL;
+    }
+
+    us = mmcf->upstreams.elts;
+
+    for(i = 0;i < mmcf->upstreams.nelts;i++) {
+        if(us[i].upstream == uscf) {
+            return &us[i];
+        }
+    }
+
+    return NULL;
+}
+
+static ngx_http_mogilefs_upstream_t *
+ngx_http_mogilefs_keepalive_find(ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->keepalive_max == 0) {
+        return NULL;
+    }
+
+    return ngx_http_mogilefs_upstream_find(us);
+}
+
+/*
+ * Takes idle connection to the peer chosen by balancer
+ */
+static ngx_connection_t *
+ngx_http_mogilefs_keepalive_get(ngx_http_mogilefs_upstream_t *ka,
+    ngx_peer_connection_t *pc)
+{
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    for(q = ngx_queue_head(&ka->cache);
+        q != ngx_queue_sentinel(&ka->cache);
+        q = ngx_queue_next(q))
+    {
+        kc = ngx_queue_data(q, ngx_http_mogilefs_keepalive_conn_t, queue);
+
+        if(kc->state != NGX_MOGILEFS_KEEPALIVE_IDLE
+            || kc->socklen != pc->socklen
+            || ngx_memcmp(kc->sockaddr, pc->sockaddr, pc->socklen) != 0)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&ka->free, q);
+
+        c = kc->connection;
+
+        c->idle = 0;
+        c->log = pc->log;
+        c->read->log = pc->log;
+        c->write->log = pc->log;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "mogilefs tracker keepalive: using connection %p", c);
+
+        return c;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns connection that is done with a command into the cache,
+ * NGX_DECLINED means that it has to be closed
+ */
+static ngx_int_t
+ngx_http_mogilefs_keepalive_put(ngx_http_mogilefs_upstream_t *ka,
+    ngx_peer_connection_t *pc)
+{
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    c = pc->connection;
+
+    if(ngx_queue_empty(&ka->free) || ngx_exiting || ngx_terminate
+        || c->read->eof || c->read->error || c->read->timedout
+        || c->write->error || c->write->timedout)
+    {
+        return NGX_DECLINED;
+    }
+
+    if(c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if(c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if(ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(&ka->free);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&ka->cache, q);
+
+    kc = ngx_queue_data(q, ngx_http_mogilefs_keepalive_conn_t, queue);
+
+    kc->connection = c;
+    kc->sockaddr = pc->sockaddr;
+    kc->socklen = pc->socklen;
+    kc->state = NGX_MOGILEFS_KEEPALIVE_IDLE;
+
+    /*
+     * Upstream borrows request pool for the connection
+     */
+#if !defined nginx_version || nginx_version < 1001004
+    c->pool = NULL;
+#endif
+
+    c->data = kc;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    c->read->handler = ngx_http_mogilefs_keepalive_close_handler;
+    c->write->handler = ngx_http_mogilefs_tracker_dummy_handler;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "mogilefs tracker keepalive: saving connection %p", c);
+
+    if(c->read->ready) {
+        ngx_http_mogilefs_keepalive_close_handler(c->read);
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Opens missing connections to each live tracker
+ */
+static void
+ngx_http_mogilefs_keepalive_fill(ngx_http_mogilefs_upstream_t *ka)
+{
+    time_t                               now;
+    ngx_uint_t                           n;
+    ngx_queue_t                         *q;
+    ngx_http_upstream_rr_peer_t         *peer;
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+    ngx_http_mogilefs_main_conf_t       *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    peers = ka->upstream->peer.data;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for(peer = ngx_http_mogilefs_peer_first(peers);peer;
+        peer = ngx_http_mogilefs_peer_next(peers, peer))
+    {
+        if(peer->down || (peer->max_fails && peer->fails >= peer->max_fails
+                          && now - peer->accessed <= peer->fail_timeout))
+        {
+            continue;
+        }
+
+        n = 0;
+
+        for(q = ngx_queue_head(&ka->cache);
+            q != ngx_queue_sentinel(&ka->cache);
+            q = ngx_queue_next(q))
+        {
+            kc = ngx_queue_data(q, ngx_http_mogilefs_keepalive_conn_t, queue);
+
+            if(kc->socklen == peer->socklen
+                && ngx_memcmp(kc->sockaddr, peer->sockaddr, peer->socklen) == 0)
+            {
+                n++;
+            }
+        }
+
+        for( ;n < mmcf->keepalive_max && !ngx_queue_empty(&ka->free);n++) {
+            ngx_http_mogilefs_keepalive_connect(ka, peer);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+static void
+ngx_http_mogilefs_keepalive_connect(ngx_http_mogilefs_upstream_t *ka,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_peer_connection_t                pc;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = &peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mogilefs tracker keepalive: connect to %V: %i", &peer->name, rc);
+
+    if(rc != NGX_OK && rc != NGX_AGAIN) {
+        return;
+    }
+
+    c = pc.connection;
+
+    q = ngx_queue_head(&ka->free);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&ka->cache, q);
+
+    kc = ngx_queue_data(q, ngx_http_mogilefs_keepalive_conn_t, queue);
+
+    kc->connection = c;
+    kc->sockaddr = peer->sockaddr;
+    kc->socklen = peer->socklen;
+
+    c->data = kc;
+    c->read->handler = ngx_http_mogilefs_keepalive_close_handler;
+    c->write->handler = ngx_http_mogilefs_keepalive_connect_handler;
+
+    if(rc == NGX_AGAIN) {
+        kc->state = NGX_MOGILEFS_KEEPALIVE_CONNECT;
+        return;
+    }
+
+    kc->state = NGX_MOGILEFS_KEEPALIVE_IDLE;
+    c->write->handler = ngx_http_mogilefs_tracker_dummy_handler;
+    c->idle = 1;
+}
+
+static void
+ngx_http_mogilefs_keepalive_connect_handler(ngx_event_t *wev)
+{
+    int                                  err;
+    socklen_t                            len;
+    ngx_connection_t                    *c;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    c = wev->data;
+    kc = c->data;
+
+    err = 0;
+    len = sizeof(int);
+
+    if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if(err) {
+        ngx_log_error(NGX_LOG_ERR, c->log, err,
+                      "mogilefs tracker keepalive: connect() failed");
+
+        ngx_http_mogilefs_keepalive_close(kc);
+        return;
+    }
+
+    kc->state = NGX_MOGILEFS_KEEPALIVE_IDLE;
+
+    c->write->handler = ngx_http_mogilefs_tracker_dummy_handler;
+    c->idle = 1;
+}
+
+/*
+ * Tracker is not supposed to send anything to an idle connection,
+ * except for the response to noop. It is buffered until LF, as
+ * it may come in pieces, and must be the only line
+ */
+static void
+ngx_http_mogilefs_keepalive_close_handler(ngx_event_t *rev)
+{
+    u_char                               buf[1];
+    ssize_t                              n;
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_mogilefs_response_t         resp;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    c = rev->data;
+    kc = c->data;
+
+    if(c->close || rev->timedout) {
+        goto close;
+    }
+
+    if(kc->state == NGX_MOGILEFS_KEEPALIVE_NOOP) {
+        for( ;; ) {
+            if(kc->received == NGX_MOGILEFS_KEEPALIVE_BUFFER) {
+                goto close;
+            }
+
+            n = c->recv(c, kc->buffer + kc->received,
+                        NGX_MOGILEFS_KEEPALIVE_BUFFER - kc->received);
+
+            if(n == NGX_AGAIN) {
+                if(ngx_handle_read_event(rev, 0) != NGX_OK) {
+                    goto close;
+                }
+
+                return;
+            }
+
+            if(n == NGX_ERROR || n == 0) {
+                goto close;
+            }
+
+            kc->received += n;
+
+            rc = ngx_http_mogilefs_parse_response(kc->buffer, kc->buffer + kc->received,
+                                                  &resp);
+
+            if(rc == NGX_AGAIN) {
+                continue;
+            }
+
+            if(rc == NGX_ERROR || !resp.ok || resp.next != kc->buffer + kc->received
+                || kc->sent != sizeof("noop" CRLF) - 1)
+            {
+                goto close;
+            }
+
+            kc->received = 0;
+            kc->state = NGX_MOGILEFS_KEEPALIVE_IDLE;
+
+            return;
+        }
+    }
+
+    n = recv(c->fd, (char *) buf, 1, MSG_PEEK);
+
+    if(n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        if(ngx_handle_read_event(rev, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    ngx_http_mogilefs_keepalive_close(kc);
+}
+
+static void
+ngx_http_mogilefs_keepalive_close(ngx_http_mogilefs_keepalive_conn_t *kc)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mogilefs tracker keepalive: closing connection %p", kc->connection);
+
+    ngx_http_mogilefs_keepalive_close_connection(kc->connection);
+
+    kc->connection = NULL;
+
+    ngx_queue_remove(&kc->queue);
+    ngx_queue_insert_head(&kc->keepalive->free, &kc->queue);
+}
+
+static void
+ngx_http_mogilefs_keepalive_close_connection(ngx_connection_t *c)
+{
+#if defined nginx_version && nginx_version >= 1001004
+    if(c->pool != NULL) {
+        ngx_destroy_pool(c->pool);
+    }
+#endif
+
+    ngx_close_connection(c);
+}
+
+/*
+ * Sends noop over idle connections, the ones that have not answered
+ * previous noop or have not connected since are closed
+ */
+static void
+ngx_http_mogilefs_keepalive_noop_handler(ngx_event_t *ev)
+{
+    ngx_queue_t                         *q, *next;
+    ngx_http_mogilefs_upstream_t        *ka;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+    ngx_http_mogilefs_main_conf_t       *mmcf;
+
+    ka = ev->data;
+
+    if(ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    for(q = ngx_queue_head(&ka->cache);
+        q != ngx_queue_sentinel(&ka->cache);
+        q = next)
+    {
+        next = ngx_queue_next(q);
+
+        kc = ngx_queue_data(q, ngx_http_mogilefs_keepalive_conn_t, queue);
+
+        if(kc->state != NGX_MOGILEFS_KEEPALIVE_IDLE) {
+            ngx_http_mogilefs_keepalive_close(kc);
+            continue;
+        }
+
+        kc->state = NGX_MOGILEFS_KEEPALIVE_NOOP;
+        kc->sent = 0;
+        kc->received = 0;
+
+        if(ngx_http_mogilefs_keepalive_send_noop(kc) == NGX_ERROR) {
+            ngx_http_mogilefs_keepalive_close(kc);
+        }
+    }
+
+    ngx_http_mogilefs_keepalive_fill(ka);
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    ngx_add_timer(ev, mmcf->keepalive_noop);
+}
+
+/*
+ * Part of noop not taken by the socket is sent once it is writable
+ */
+static ngx_int_t
+ngx_http_mogilefs_keepalive_send_noop(ngx_http_mogilefs_keepalive_conn_t *kc)
+{
+    ssize_t                              n;
+    ngx_connection_t                    *c;
+
+    c = kc->connection;
+
+    while(kc->sent < sizeof("noop" CRLF) - 1) {
+        n = c->send(c, (u_char *) "noop" CRLF + kc->sent,
+                    sizeof("noop" CRLF) - 1 - kc->sent);
+
+        if(n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if(n == NGX_AGAIN || n == 0) {
+            c->write->handler = ngx_http_mogilefs_keepalive_write_handler;
+
+            if(ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        kc->sent += n;
+    }
+
+    c->write->handler = ngx_http_mogilefs_tracker_dummy_handler;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_keepalive_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+
+    c = wev->data;
+    kc = c->data;
+
+    if(ngx_http_mogilefs_keepalive_send_noop(kc) == NGX_ERROR) {
+        ngx_http_mogilefs_keepalive_close(kc);
+    }
+}
+
+static ngx_int_t
+ngx_http_mogilefs_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_mogilefs_upstream_t   *mu;
+    ngx_http_mogilefs_peer_t       *mp;
+
+    mu = ngx_http_mogilefs_upstream_find(us);
+
+    if(mu->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_mogilefs_peer_t));
+    if(mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    mp->request = r;
+    mp->keepalive = ngx_http_mogilefs_keepalive_find(us);
+    mp->data = r->upstream->peer.data;
+    mp->original_get_peer = r->upstream->peer.get;
+    mp->original_free_peer = r->upstream->peer.free;
+    mp->done = 0;
+
+    r->upstream->peer.data = mp;
+    r->upstream->peer.get = ngx_http_mogilefs_get_peer;
+    r->upstream->peer.free = ngx_http_mogilefs_free_peer;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_mogilefs_peer_t       *mp = data;
+    ngx_int_t                       rc;
+    ngx_msec_t                      timeout;
+    ngx_http_upstream_t            *u;
+    ngx_http_upstream_conf_t       *conf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    mp->done = 0;
+
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    /*
+     * Read timeout follows latency of the tracker chosen,
+     * the request gets its own copy of upstream conf for that
+     */
+    mgcf = ngx_http_get_module_loc_conf(mp->request, ngx_http_mogilefs_module);
+
+    if(mgcf->adaptive_factor) {
+        u = mp->request->upstream;
+
+        timeout = ngx_http_mogilefs_adaptive_timeout(mgcf, pc->name);
+
+        if(timeout != u->conf->read_timeout) {
+            if(u->conf == &mgcf->upstream) {
+                conf = ngx_palloc(mp->request->pool, sizeof(ngx_http_upstream_conf_t));
+                if(conf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                *conf = mgcf->upstream;
+                u->conf = conf;
+            }
+
+            u->conf->read_timeout = timeout;
+        }
+    }
+
+    if(mp->keepalive == NULL) {
+        return NGX_OK;
+    }
+
+    pc->connection = ngx_http_mogilefs_keepalive_get(mp->keepalive, pc);
+
+    if(pc->connection != NULL) {
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_mogilefs_peer_t       *mp = data;
+
+    if(mp->done && mp->keepalive != NULL && !(state & NGX_PEER_FAILED)
+        && pc->connection != NULL
+        && ngx_http_mogilefs_keepalive_put(mp->keepalive, pc) == NGX_OK)
+    {
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+/*
+ * Called once the last response line has been read
+ */
+static void
+ngx_http_mogilefs_keepalive_done(ngx_http_request_t *r)
+{
+    ngx_http_mogilefs_peer_t       *mp;
+
+    if(r->upstream->peer.free != ngx_http_mogilefs_free_peer) {
+        return;
+    }
+
+    mp = r->upstream->peer.data;
+    mp->done = 1;
+}
+
+/*
+ * Takes a slot of mogilefs_tracker_max_conns. Returns NGX_BUSY if all
+ * slots of the upstream are taken, upstreams not limited get no slot.
+ * Slots are counted per worker, like max_conns of upstream servers
+ * without a zone, so a tracker sees up to worker_processes times more
+ */
+static ngx_int_t
+ngx_http_mogilefs_slot_get(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_mogilefs_upstream_t **slot)
+{
+    ngx_http_mogilefs_upstream_t   *us;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    *slot = NULL;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->max_conns == 0) {
+        return NGX_OK;
+    }
+
+    us = ngx_http_mogilefs_upstream_find(uscf);
+
+    if(us == NULL) {
+        return NGX_OK;
+    }
+
+    if(us->active >= mmcf->max_conns) {
+        return NGX_BUSY;
+    }
+
+    us->active++;
+
+    *slot = us;
+
+    return NGX_OK;
+}
+
+/*
+ * Releases a slot and passes it to the first waiting request.
+ * The request is resumed from posted event, not from the stack
+ * of the request that released the slot
+ */
+static void
+ngx_http_mogilefs_slot_free(ngx_http_mogilefs_upstream_t *us)
+{
+    ngx_queue_t                    *q;
+    ngx_http_mogilefs_waiter_t     *w;
+
+    us->active--;
+
+    if(ngx_queue_empty(&us->waiting)) {
+        return;
+    }
+
+    q = ngx_queue_head(&us->waiting);
+    ngx_queue_remove(q);
+
+    us->queued--;
+
+    w = ngx_queue_data(q, ngx_http_mogilefs_waiter_t, queue);
+
+    w->queued = 0;
+
+    if(w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    us->active++;
+
+    *w->slot = us;
+
+    ngx_post_event(&w->event, &ngx_posted_events);
+}
+
+static void
+ngx_http_mogilefs_slot_cleanup(void *data)
+{
+    ngx_http_mogilefs_upstream_t   *us = data;
+
+    ngx_http_mogilefs_slot_free(us);
+}
+
+/*
+ * Puts the request to the queue of the upstream, returns
+ * NGX_HTTP_SERVICE_UNAVAILABLE if the queue is full
+ */
+static ngx_int_t
+ngx_http_mogilefs_slot_wait(ngx_http_request_t *r, ngx_http_mogilefs_upstream_t **slot,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_mogilefs_resume_pt resume)
+{
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_mogilefs_waiter_t     *w;
+    ngx_http_mogilefs_upstream_t   *us;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+
+    us = ngx_http_mogilefs_upstream_find(uscf);
+
+    if(us->queued >= mmcf->max_queue) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "mogilefs: %ui requests are already waiting for tracker \"%V\"",
+                      us->queued, &uscf->host);
+
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    w = ngx_pcalloc(r->pool, sizeof(ngx_http_mogilefs_waiter_t));
+    if(w == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    w->request = r;
+    w->slot = slot;
+    w->resume = resume;
+    w->upstream = us;
+
+    w->event.handler = ngx_http_mogilefs_slot_handler;
+    w->event.data = w;
+    w->event.log = r->connection->log;
+
+    cln->handler = ngx_http_mogilefs_slot_wait_cleanup;
+    cln->data = w;
+
+    ngx_queue_insert_tail(&us->waiting, &w->queue);
+
+    w->queued = 1;
+    us->queued++;
+
+    ngx_add_timer(&w->event, mmcf->queue_timeout);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs waiting for tracker slot, queued: %ui", us->queued);
+
+    return NGX_DONE;
+}
+
+static void
+ngx_http_mogilefs_slot_handler(ngx_event_t *ev)
+{
+    ngx_connection_t               *c;
+    ngx_http_request_t             *r;
+    ngx_http_mogilefs_waiter_t     *w;
+
+    w = ev->data;
+    r = w->request;
+    c = r->connection;
+
+    if(ev->timedout) {
+        ngx_queue_remove(&w->queue);
+
+        w->queued = 0;
+        w->upstream->queued--;
+
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "mogilefs: timed out waiting for tracker slot");
+
+        ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+    }
+    else {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "mogilefs got tracker slot");
+
+        w->started = 1;
+
+        w->resume(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+ * Request has gone while waiting for a slot or
+ * before it could use the slot passed to it
+ */
+static void
+ngx_http_mogilefs_slot_wait_cleanup(void *data)
+{
+    ngx_http_mogilefs_waiter_t     *w = data;
+
+    if(w->queued) {
+        ngx_queue_remove(&w->queue);
+        w->upstream->queued--;
+    }
+
+    if(w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    if(w->event.posted) {
+        ngx_delete_posted_event(&w->event);
+    }
+
+    if(*w->slot != NULL && !w->started) {
+        ngx_http_mogilefs_slot_free(*w->slot);
+        *w->slot = NULL;
+    }
+}
+
+/*
+ * Variables are set directly in r->variables, so they survive
+ * the redirect to fetch location. Subrequests share r->variables
+ * with the main request, so the values reach it as well.
+ */
+static void
+ngx_http_mogilefs_set_variable(ngx_http_request_t *r, ngx_uint_t var,
+    u_char *data, size_t len)
+{
+    ngx_http_variable_value_t      *v;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+
+    v = r->variables + mmcf->var_index[var];
+
+    v->data = data;
+    v->len = len;
+
+    v->not_found = 0;
+    v->no_cacheable = 0;
+    v->valid = 1;
+}
+
+static void
+ngx_http_mogilefs_set_tracker_variables(ngx_http_request_t *r, ngx_uint_t cmd,
+    ngx_str_t *tracker, ngx_msec_int_t elapsed)
+{
+    ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_COMMAND,
+        ngx_http_mogilefs_stat_cmds[cmd].data, ngx_http_mogilefs_stat_cmds[cmd].len);
+
+    if(tracker != NULL) {
+        ngx_http_mogilefs_set_variable(r, NGX_MOGILEFS_VAR_TRACKER_ADDR,
+            tracker->data, tracker->len);
+    }
+
+    ngx_http_mogilefs_set_time_variable(r, NGX_MOGILEFS_VAR_TRACKER_TIME, elapsed);
+}
+
+/*
+ * Sets variable to elapsed time in seconds with milliseconds
+ */
+static void
+ngx_http_mogilefs_set_time_variable(ngx_http_request_t *r, ngx_uint_t var,
+    ngx_msec_int_t elapsed)
+{
+    u_char                         *p;
+
+    if(elapsed < 0) {
+        elapsed = 0;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if(p == NULL) {
+        return;
+    }
+
+    ngx_http_mogilefs_set_variable(r, var, p,
+        ngx_sprintf(p, "%T.%03M", (time_t) elapsed / 1000, (ngx_msec_t) elapsed % 1000) - p);
+}
+
+/*
+ * Logs phase breakdown of an upload, which took longer
+ * than mogilefs_slow_put_threshold
+ */
+static void
+ngx_http_mogilefs_put_done(ngx_http_request_t *r, ngx_http_mogilefs_put_ctx_t *ctx,
+    ngx_int_t status)
+{
+    ngx_msec_t                      total;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    total = ngx_current_msec - ctx->start;
+
+    if(mgcf->slow_put_threshold == 0 || total < mgcf->slow_put_threshold) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "mogilefs slow put: key=\"%V\" status=%i size=%O total=%Mms "
+                  "body=%Mms create_open=%Mms store=%Mms create_close=%Mms",
+                  &ctx->key, status, r->headers_in.content_length_n, total,
+                  ctx->body_time, ctx->create_open_time, ctx->store_time,
+                  ctx->create_close_time);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_status_handler(ngx_http_request_t *r)
+{
+    size_t                          len;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, n, format;
+    ngx_str_t                       value, name;
+    ngx_buf_t                      *b;
+    ngx_chain_t                     out;
+    ngx_http_mogilefs_status_t     *status;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    status = mmcf->status;
+
+    format = mgcf->status_format;
+
+    if(ngx_http_arg(r, (u_char *) "format", sizeof("format") - 1, &value) == NGX_OK) {
+        if(value.len == sizeof("json") - 1 && ngx_strncmp(value.data, "json", value.len) == 0) {
+            format = NGX_MOGILEFS_STATUS_JSON;
+        }
+        else if(value.len == sizeof("text") - 1 && ngx_strncmp(value.data, "text", value.len) == 0) {
+            format = NGX_MOGILEFS_STATUS_TEXT;
+        }
+    }
+
+    n = ngx_min(status->ntrackers, NGX_MOGILEFS_STATUS_TRACKERS);
+
+    len = sizeof("{\"commands\":{},\"errors\":{},\"paths_returned\":[],\"trackers\":{}}" CRLF)
+        + (NGX_MOGILEFS_STAT_CMDS + n) * (sizeof("tracker ") + NGX_SOCKADDR_STRLEN
+            + sizeof("{\"requests\":,\"errors\":,\"latency_ms\":{}},") + 2 * NGX_ATOMIC_T_LEN
+            + NGX_MOGILEFS_LATENCY_BUCKETS * (sizeof("\"\":,") + 2 * NGX_ATOMIC_T_LEN))
+        + NGX_MOGILEFS_ERRORS * (sizeof("error \"\":,") + 32 + NGX_ATOMIC_T_LEN)
+        + sizeof("paths_returned") + (NGX_MOGILEFS_MAX_PATHS + 1) * (sizeof(" :,") + 2 * NGX_ATOMIC_T_LEN);
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(format == NGX_MOGILEFS_STATUS_JSON) {
+        b->last = ngx_copy(b->last, "{\"commands\":{", sizeof("{\"commands\":{") - 1);
+
+        for(i = 0;i < NGX_MOGILEFS_STAT_CMDS;i++) {
+            if(i > 0) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_http_mogilefs_status_stat(b->last, &ngx_http_mogilefs_stat_cmds[i],
+                &status->cmds[i], format);
+        }
+
+        b->last = ngx_copy(b->last, "},\"errors\":{", sizeof("},\"errors\":{") - 1);
+
+        for(i = 0;i < NGX_MOGILEFS_ERRORS;i++) {
+            name = ngx_http_mogilefs_errors[i].name;
+
+            if(name.data == NULL) {
+                ngx_str_set(&name, "other");
+            }
+
+            b->last = ngx_sprintf(b->last, "%s\"%V\":%uA", i > 0 ? "," : "",
+                                  &name, status->errors[i]);
+        }
+
+        b->last = ngx_copy(b->last, "},\"paths_returned\":[", sizeof("},\"paths_returned\":[") - 1);
+
+        for(i = 0;i < NGX_MOGILEFS_MAX_PATHS + 1;i++) {
+            b->last = ngx_sprintf(b->last, "%s%uA", i > 0 ? "," : "",
+                                  status->paths_returned[i]);
+        }
+
+        b->last = ngx_copy(b->last, "],\"trackers\":{", sizeof("],\"trackers\":{") - 1);
+
+        for(i = 0;i < n;i++) {
+            if(i > 0) {
+                *b->last++ = ',';
+            }
+
+            name.data = status->trackers[i].name;
+            name.len = status->trackers[i].name_len;
+
+            b->last = ngx_http_mogilefs_status_stat(b->last, &name,
+                &status->trackers[i].stat, format);
+        }
+
+        b->last = ngx_copy(b->last, "}}" CRLF, sizeof("}}" CRLF) - 1);
+
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+    else {
+        for(i = 0;i < NGX_MOGILEFS_STAT_CMDS;i++) {
+            b->last = ngx_copy(b->last, "command ", sizeof("command ") - 1);
+
+            b->last = ngx_http_mogilefs_status_stat(b->last, &ngx_http_mogilefs_stat_cmds[i],
+                &status->cmds[i], format);
+        }
+
+        for(i = 0;i < NGX_MOGILEFS_ERRORS;i++) {
+            name = ngx_http_mogilefs_errors[i].name;
+
+            if(name.data == NULL) {
+                ngx_str_set(&name, "other");
+            }
+
+            b->last = ngx_sprintf(b->last, "error %V %uA" CRLF, &name, status->errors[i]);
+        }
+
+        b->last = ngx_copy(b->last, "paths_returned", sizeof("paths_returned") - 1);
+
+        for(i = 0;i < NGX_MOGILEFS_MAX_PATHS + 1;i++) {
+            b->last = ngx_sprintf(b->last, " %ui:%uA", i, status->paths_returned[i]);
+        }
+
+        *b->last++ = CR; *b->last++ = LF;
+
+        for(i = 0;i < n;i++) {
+            b->last = ngx_copy(b->last, "tracker ", sizeof("tracker ") - 1);
+
+            name.data = status->trackers[i].name;
+            name.len = status->trackers[i].name_len;
+
+            b->last = ngx_http_mogilefs_status_stat(b->last, &name,
+                &status->trackers[i].stat, format);
+        }
+
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static u_char *
+ngx_http_mogilefs_status_stat(u_char *p, ngx_str_t *name,
+    ngx_http_mogilefs_stat_t *st, ngx_uint_t format)
+{
+    ngx_uint_t                      i;
+
+    if(format == NGX_MOGILEFS_STATUS_JSON) {
+        p = ngx_sprintf(p, "\"%V\":{\"requests\":%uA,\"errors\":%uA,\"latency_ms\":{",
+                        name, st->requests, st->errors);
+
+        for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS - 1;i++) {
+            p = ngx_sprintf(p, "\"%M\":%uA,", ngx_http_mogilefs_latency_bounds[i],
+                            st->latency[i]);
+        }
+
+        return ngx_sprintf(p, "\"inf\":%uA}}", st->latency[i]);
+    }
+
+    p = ngx_sprintf(p, "%V requests %uA errors %uA latency_ms", name,
+                    st->requests, st->errors);
+
+    for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS - 1;i++) {
+        p = ngx_sprintf(p, " %M:%uA", ngx_http_mogilefs_latency_bounds[i],
+                        st->latency[i]);
+    }
+
+    return ngx_sprintf(p, " inf:%uA" CRLF, st->latency[i]);
+}
+
+/*
+ * Accounts a tracker command, which took elapsed milliseconds
+ */
+static void
+ngx_http_mogilefs_status_update(ngx_uint_t cmd, ngx_str_t *tracker,
+    ngx_msec_int_t elapsed, ngx_uint_t failed)
+{
+    ngx_uint_t                         i, j;
+    ngx_http_mogilefs_stat_t          *st[2];
+    ngx_http_mogilefs_tracker_stat_t  *ts;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->status == NULL) {
+        return;
+    }
+
+    for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS - 1;i++) {
+        if(elapsed <= (ngx_msec_int_t) ngx_http_mogilefs_latency_bounds[i]) {
+            break;
+        }
+    }
+
+    st[0] = &mmcf->status->cmds[cmd];
+    st[1] = NULL;
+
+    if(tracker != NULL) {
+        ts = ngx_http_mogilefs_status_tracker(mmcf, tracker);
+
+        if(ts != NULL) {
+            st[1] = &ts->stat;
+
+            if(!failed) {
+                ngx_http_mogilefs_status_recent(ts, i);
+            }
+        }
+    }
+
+    for(j = 0;j < 2 && st[j] != NULL;j++) {
+        (void) ngx_atomic_fetch_add(&st[j]->requests, 1);
+
+        if(failed) {
+            (void) ngx_atomic_fetch_add(&st[j]->errors, 1);
+        }
+
+        (void) ngx_atomic_fetch_add(&st[j]->latency[i], 1);
+    }
+}
+
+static void
+ngx_http_mogilefs_status_error(ngx_http_mogilefs_error_t *e)
+{
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->status == NULL) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&mmcf->status->errors[e - ngx_http_mogilefs_errors], 1);
+}
+
+static void
+ngx_http_mogilefs_status_paths(ssize_t n)
+{
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->status == NULL) {
+        return;
+    }
+
+    if(n < 0) {
+        n = 0;
+    }
+
+    if(n > NGX_MOGILEFS_MAX_PATHS) {
+        n = NGX_MOGILEFS_MAX_PATHS;
+    }
+
+    (void) ngx_atomic_fetch_add(&mmcf->status->paths_returned[n], 1);
+}
+
+/*
+ * Finds the slot of a tracker, new slots are taken under
+ * the zone mutex and published by incrementing ntrackers
+ */
+static ngx_http_mogilefs_tracker_stat_t *
+ngx_http_mogilefs_status_tracker(ngx_http_mogilefs_main_conf_t *mmcf, ngx_str_t *name)
+{
+    ngx_uint_t                         i, n;
+    ngx_http_mogilefs_status_t        *status;
+    ngx_http_mogilefs_tracker_stat_t  *ts;
+
+    status = mmcf->status;
+
+    n = status->ntrackers;
+
+    for(i = 0;i < n;i++) {
+        ts = &status->trackers[i];
+
+        if(ts->name_len == name->len && ngx_strncmp(ts->name, name->data, name->len) == 0) {
+            return ts;
+        }
+    }
+
+    ngx_shmtx_lock(&mmcf->status_shpool->mutex);
+
+    for( /* void */ ;i < status->ntrackers;i++) {
+        ts = &status->trackers[i];
+
+        if(ts->name_len == name->len && ngx_strncmp(ts->name, name->data, name->len) == 0) {
+            ngx_shmtx_unlock(&mmcf->status_shpool->mutex);
+            return ts;
+        }
+    }
+
+    if(status->ntrackers == NGX_MOGILEFS_STATUS_TRACKERS || name->len > NGX_SOCKADDR_STRLEN) {
+        ngx_shmtx_unlock(&mmcf->status_shpool->mutex);
+        return NULL;
+    }
+
+    ts = &status->trackers[status->ntrackers];
+
+    ts->name_len = name->len;
+    ngx_memcpy(ts->name, name->data, name->len);
+
+    ngx_memory_barrier();
+
+    status->ntrackers++;
+
+    ngx_shmtx_unlock(&mmcf->status_shpool->mutex);
+
+    return ts;
+}
+
+/*
+ * Accounts latency of a successful command in the current window.
+ * The window that comes next reuses counters of the previous one
+ */
+static void
+ngx_http_mogilefs_status_recent(ngx_http_mogilefs_tracker_stat_t *ts,
+    ngx_uint_t bucket)
+{
+    ngx_uint_t                         i;
+    ngx_atomic_uint_t                  window, current;
+
+    current = ngx_time() / NGX_MOGILEFS_LATENCY_WINDOW;
+    window = ts->window;
+
+    if(window != current && ngx_atomic_cmp_set(&ts->window, window, current)) {
+        for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS;i++) {
+            ts->recent[current & 1][i] = 0;
+
+            if(current - window > 1) {
+                ts->recent[window & 1][i] = 0;
+            }
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&ts->recent[current & 1][bucket], 1);
+}
+
+/*
+ * Read timeout for a tracker: mogilefs_adaptive_timeout times
+ * recent 99th percentile of its latency, within min and max
+ */
+static ngx_msec_t
+ngx_http_mogilefs_adaptive_timeout(ngx_http_mogilefs_loc_conf_t *mgcf,
+    ngx_str_t *tracker)
+{
+    ngx_uint_t                         i;
+    ngx_msec_t                         timeout;
+    ngx_atomic_uint_t                  n, total;
+    ngx_http_mogilefs_tracker_stat_t  *ts;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->status == NULL || tracker == NULL) {
+        return mgcf->adaptive_max;
+    }
+
+    ts = ngx_http_mogilefs_status_tracker(mmcf, tracker);
+
+    if(ts == NULL
+        || ngx_time() / NGX_MOGILEFS_LATENCY_WINDOW - ts->window > 1)
+    {
+        return mgcf->adaptive_max;
+    }
+
+    total = 0;
+
+    for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS;i++) {
+        total += ts->recent[0][i] + ts->recent[1][i];
+    }
+
+    if(total < NGX_MOGILEFS_ADAPTIVE_SAMPLES) {
+        return mgcf->adaptive_max;
+    }
+
+    n = 0;
+
+    for(i = 0;i < NGX_MOGILEFS_LATENCY_BUCKETS - 1;i++) {
+        n += ts->recent[0][i] + ts->recent[1][i];
+
+        if(n * 100 >= total * 99) {
+            break;
+        }
+    }
+
+    if(i == NGX_MOGILEFS_LATENCY_BUCKETS - 1) {
+        return mgcf->adaptive_max;
+    }
+
+    timeout = ngx_http_mogilefs_latency_bounds[i] * mgcf->adaptive_factor;
+
+    timeout = ngx_max(timeout, mgcf->adaptive_min);
+    timeout = ngx_min(timeout, mgcf->adaptive_max);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mogilefs adaptive timeout of \"%V\": %M", tracker, timeout);
+
+    return timeout;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_init_status_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_mogilefs_main_conf_t  *ommcf = data;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = shm_zone->data;
+
+    mmcf->status_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /*
+     * Counters survive reconfiguration
+     */
+    if(ommcf != NULL) {
+        mmcf->status = ommcf->status;
+        return NGX_OK;
+    }
+
+    mmcf->status = ngx_slab_alloc(mmcf->status_shpool, sizeof(ngx_http_mogilefs_status_t));
+    if(mmcf->status == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(mmcf->status, sizeof(ngx_http_mogilefs_status_t));
+
+    return NGX_OK;
+}
+
+/*
+ * Looks up paths of the key in the cache zone and copies them
+ * into the request pool. Returns NGX_AGAIN if paths have expired, but
+ * may be served stale, ctx->cache_refresh is set then if this request
+ * has to refresh them. Returns NGX_DECLINED if nothing is cached.
+ * Generation of the key is remembered, so that paths are not
+ * stored if the key is written while tracker is being asked
+ */
+static ngx_int_t
+ngx_http_mogilefs_cache_get(ngx_http_request_t *r, ngx_http_mogilefs_ctx_t *ctx)
+{
+    u_char                            *p, *q;
+    size_t                             len;
+    time_t                             now;
+    uint32_t                           hash;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_http_mogilefs_src_t           *source;
+    ngx_http_mogilefs_cache_node_t    *cn;
+    ngx_http_mogilefs_loc_conf_t      *mgcf;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_mogilefs_module);
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(mmcf->cache == NULL) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_http_mogilefs_cache_hash(&ctx->domain, &ctx->key);
+
+    ctx->cache_generation =
+        mmcf->cache->generation[hash % NGX_MOGILEFS_CACHE_GENERATIONS];
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    cn = ngx_http_mogilefs_cache_lookup(mmcf, &ctx->domain, &ctx->key, hash);
+
+    if(cn == NULL) {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /*
+     * Prefetch of the key is in progress
+     */
+    if(cn->npaths == 0) {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    now = ngx_time();
+
+    rc = NGX_OK;
+
+    if(cn->expire < now) {
+        if(cn->drop < now) {
+            ngx_http_mogilefs_cache_free(mmcf, cn);
+            ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        if(cn->expire + mgcf->cache_stale < now
+            && (!cn->failed || cn->expire + mgcf->cache_stale_if_error < now))
+        {
+            ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        /*
+         * One refresh at a time, until it is
+         * supposed to have timed out
+         */
+        if(cn->update < now) {
+            cn->update = now + ngx_http_mogilefs_cache_timeout(mgcf);
+
+            ctx->cache_refresh = 1;
+        }
+
+        rc = NGX_AGAIN;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&mmcf->cache->queue, &cn->queue);
+
+    len = cn->length_len;
+
+    for(i = 0;i < cn->npaths;i++) {
+        len += cn->path_len[i];
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+
+    if(p == NULL) {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    q = cn->data + cn->domain_len + cn->key_len;
+
+    ctx->length.data = p;
+    ctx->length.len = cn->length_len;
+
+    p = ngx_cpymem(p, q, cn->length_len);
+    q += cn->length_len;
+
+    for(i = 0;i < cn->npaths;i++) {
+        source = ngx_array_push(&ctx->sources);
+
+        if(source == NULL) {
+            ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        source->priority = i;
+        source->path.data = p;
+        source->path.len = cn->path_len[i];
+
+        p = ngx_cpymem(p, q, cn->path_len[i]);
+        q += cn->path_len[i];
+    }
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+    ctx->num_paths_returned = ctx->sources.nelts;
+
+    return rc;
+}
+
+/*
+ * Stores sorted paths of the key in the cache zone, they are
+ * kept for stale seconds more after they have expired
+ */
+static void
+ngx_http_mogilefs_cache_put(ngx_log_t *log, ngx_http_mogilefs_ctx_t *ctx,
+    time_t valid, time_t stale)
+{
+    u_char                            *p;
+    size_t                             n, len;
+    uint32_t                           hash;
+    ngx_uint_t                         i;
+    ngx_rbtree_node_t                 *node;
+    ngx_http_mogilefs_src_t           *source;
+    ngx_http_mogilefs_cache_node_t    *cn;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL) {
+        return;
+    }
+
+    if(ctx->domain.len > 0xffff || ctx->key.len > 0xffff || ctx->length.len > 0xffff) {
+        return;
+    }
+
+    source = ctx->sources.elts;
+
+    n = ngx_min(ctx->sources.nelts, NGX_MOGILEFS_MAX_PATHS);
+
+    len = ctx->domain.len + ctx->key.len + ctx->length.len;
+
+    for(i = 0;i < n;i++) {
+        if(source[i].path.len > 0xffff) {
+            return;
+        }
+
+        len += source[i].path.len;
+    }
+
+    hash = ngx_http_mogilefs_cache_hash(&ctx->domain, &ctx->key);
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    /*
+     * Key was written or purged since the lookup
+     */
+    if(mmcf->cache->generation[hash % NGX_MOGILEFS_CACHE_GENERATIONS]
+        != ctx->cache_generation)
+    {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return;
+    }
+
+    ngx_http_mogilefs_cache_expire(mmcf, 0);
+
+    cn = ngx_http_mogilefs_cache_lookup(mmcf, &ctx->domain, &ctx->key, hash);
+
+    if(cn != NULL) {
+        ngx_http_mogilefs_cache_free(mmcf, cn);
+    }
+
+    len += offsetof(ngx_rbtree_node_t, color)
+         + offsetof(ngx_http_mogilefs_cache_node_t, data);
+
+    node = ngx_slab_alloc_locked(mmcf->cache_shpool, len);
+
+    if(node == NULL) {
+        ngx_http_mogilefs_cache_expire(mmcf, 1);
+
+        node = ngx_slab_alloc_locked(mmcf->cache_shpool, len);
+
+        if(node == NULL) {
+            ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "mogilefs cache zone \"%V\" is full",
+                          &mmcf->cache_zone->shm.name);
+            return;
+        }
+    }
+
+    node->key = hash;
+
+    cn = (ngx_http_mogilefs_cache_node_t *) &node->color;
+
+    cn->npaths = (u_char) n;
+    cn->domain_len = (u_short) ctx->domain.len;
+    cn->key_len = (u_short) ctx->key.len;
+    cn->length_len = (u_short) ctx->length.len;
+    cn->expire = ngx_time() + valid;
+    cn->drop = cn->expire + stale;
+    cn->update = 0;
+    cn->failed = 0;
+    cn->saved = mmcf->cache->epoch ^ mmcf->cache->saving;
+
+    p = ngx_cpymem(cn->data, ctx->domain.data, ctx->domain.len);
+    p = ngx_cpymem(p, ctx->key.data, ctx->key.len);
+    p = ngx_cpymem(p, ctx->length.data, ctx->length.len);
+
+    for(i = 0;i < n;i++) {
+        cn->path_len[i] = (u_short) source[i].path.len;
+        p = ngx_cpymem(p, source[i].path.data, source[i].path.len);
+    }
+
+    ngx_rbtree_insert(&mmcf->cache->rbtree, node);
+
+    ngx_queue_insert_head(&mmcf->cache->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+}
+
+/*
+ * Drops cached paths of a key that was deleted, stored again or purged.
+ * Generation of the key is bumped first, so that paths of
+ * get_paths in flight are not stored by any worker
+ */
+static void
+ngx_http_mogilefs_cache_delete(ngx_str_t *domain, ngx_str_t *key)
+{
+    uint32_t                           hash;
+    ngx_http_mogilefs_cache_node_t    *cn;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL) {
+        return;
+    }
+
+    hash = ngx_http_mogilefs_cache_hash(domain, key);
+
+    (void) ngx_atomic_fetch_add(
+        &mmcf->cache->generation[hash % NGX_MOGILEFS_CACHE_GENERATIONS], 1);
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    cn = ngx_http_mogilefs_cache_lookup(mmcf, domain, key, hash);
+
+    if(cn != NULL) {
+        ngx_http_mogilefs_cache_free(mmcf, cn);
+    }
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+}
+
+/*
+ * Marks cached paths of the key as failed to refresh,
+ * so that they are served within mogilefs_cache_stale_if_error
+ */
+static void
+ngx_http_mogilefs_cache_fail(ngx_str_t *domain, ngx_str_t *key)
+{
+    uint32_t                           hash;
+    ngx_http_mogilefs_cache_node_t    *cn;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL) {
+        return;
+    }
+
+    hash = ngx_http_mogilefs_cache_hash(domain, key);
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    cn = ngx_http_mogilefs_cache_lookup(mmcf, domain, key, hash);
+
+    if(cn != NULL) {
+        cn->failed = 1;
+        cn->update = 0;
+    }
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+}
+
+/*
+ * Time a background get_paths is supposed to have timed out within
+ */
+static time_t
+ngx_http_mogilefs_cache_timeout(ngx_http_mogilefs_loc_conf_t *mgcf)
+{
+    return (time_t) ((mgcf->upstream.connect_timeout + mgcf->upstream.send_timeout
+        + mgcf->upstream.read_timeout) / 1000) + 1;
+}
+
+/*
+ * Puts a placeholder without paths for a key that is not cached,
+ * so that the key is prefetched once. Returns NGX_DECLINED if
+ * the key is cached or being prefetched already
+ */
+static ngx_int_t
+ngx_http_mogilefs_cache_reserve(ngx_http_mogilefs_loc_conf_t *mgcf, ngx_str_t *domain,
+    ngx_str_t *key, ngx_atomic_uint_t *generation)
+{
+    size_t                             len;
+    time_t                             now;
+    uint32_t                           hash;
+    ngx_rbtree_node_t                 *node;
+    ngx_http_mogilefs_cache_node_t    *cn;
+    ngx_http_mogilefs_main_conf_t     *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_http_mogilefs_cache_hash(domain, key);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    cn = ngx_http_mogilefs_cache_lookup(mmcf, domain, key, hash);
+
+    if(cn != NULL) {
+        if(cn->drop >= now) {
+            ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        ngx_http_mogilefs_cache_free(mmcf, cn);
+    }
+
+    ngx_http_mogilefs_cache_expire(mmcf, 0);
+
+    len = domain->len + key->len + offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_mogilefs_cache_node_t, data);
+
+    /*
+     * Prefetch does not evict anything
+     */
+    node = ngx_slab_alloc_locked(mmcf->cache_shpool, len);
+
+    if(node == NULL) {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    node->key = hash;
+
+    cn = (ngx_http_mogilefs_cache_node_t *) &node->color;
+
+    cn->npaths = 0;
+    cn->domain_len = (u_short) domain->len;
+    cn->key_len = (u_short) key->len;
+    cn->length_len = 0;
+    cn->expire = 0;
+    cn->drop = now + ngx_http_mogilefs_cache_timeout(mgcf);
+    cn->update = cn->drop;
+    cn->failed = 0;
+    cn->saved = mmcf->cache->epoch ^ mmcf->cache->saving;
+
+    ngx_memcpy(ngx_cpymem(cn->data, domain->data, domain->len), key->data, key->len);
+
+    ngx_rbtree_insert(&mmcf->cache->rbtree, node);
+
+    ngx_queue_insert_head(&mmcf->cache->queue, &cn->queue);
+
+    *generation = mmcf->cache->generation[hash % NGX_MOGILEFS_CACHE_GENERATIONS];
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+    return NGX_OK;
+}
+
+/*
+ * Matches the key against mogilefs_prefetch regex and fetches paths
+ * of the keys that follow, i.e. with the first capture incremented.
+ * Zero padding of the number is preserved
+ */
+static void
+ngx_http_mogilefs_prefetch(ngx_http_request_t *r, ngx_http_mogilefs_ctx_t *ctx)
+{
+#if (NGX_PCRE)
+    u_char                         *p, *start, *end;
+    u_char                          buf[NGX_MOGILEFS_MAX_KEY_LEN];
+    u_char                          num[NGX_INT_T_LEN];
+    size_t                          width, len;
+    ngx_int_t                       n, rc;
+    ngx_uint_t                      i;
+    ngx_str_t                       key;
+    ngx_atomic_uint_t               generation;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    int                             captures[6];
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(mgcf->upstream.upstream == NULL) {
+        return;
+    }
+
+    rc = ngx_regex_exec(mgcf->prefetch->regex, &ctx->key, captures, 6);
+
+    if(rc == NGX_REGEX_NO_MATCHED) {
+        return;
+    }
+
+    if(rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      ngx_regex_exec_n " failed: %i on \"%V\"", rc, &ctx->key);
+        return;
+    }
+
+    if(rc < 2 || captures[2] < 0) {
+        return;
+    }
+
+    start = ctx->key.data + captures[2];
+    end = ctx->key.data + captures[3];
+    width = end - start;
+
+    n = ngx_atoi(start, width);
+
+    if(n == NGX_ERROR) {
+        return;
+    }
+
+    for(i = 1;i <= mgcf->prefetch->count;i++) {
+        len = ngx_sprintf(num, "%i", n + (ngx_int_t) i) - num;
+
+        if(ctx->key.len - width + ngx_max(len, width) > NGX_MOGILEFS_MAX_KEY_LEN) {
+            return;
+        }
+
+        p = ngx_cpymem(buf, ctx->key.data, start - ctx->key.data);
+
+        /* captures may be padded wider than any number */
+        if(len < width) {
+            ngx_memset(p, '0', width - len);
+            p += width - len;
+        }
+
+        p = ngx_cpymem(p, num, len);
+        p = ngx_cpymem(p, end, ctx->key.data + ctx->key.len - end);
+
+        key.data = buf;
+        key.len = p - buf;
+
+        if(ngx_http_mogilefs_cache_reserve(mgcf, &ctx->domain, &key, &generation)
+            != NGX_OK)
+        {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "mogilefs prefetch: \"%V\"", &key);
+
+        ngx_http_mogilefs_cache_refresh(mgcf, &ctx->domain, &key, generation);
+    }
+#endif
+}
+
+/*
+ * Sends get_paths for stale or prefetched paths of the key
+ * through tracker client, the request does not wait for it
+ */
+static void
+ngx_http_mogilefs_cache_refresh(ngx_http_mogilefs_loc_conf_t *mgcf, ngx_str_t *domain,
+    ngx_str_t *key, ngx_atomic_uint_t generation)
+{
+    size_t                          len;
+    ngx_buf_t                      *b;
+    ngx_pool_t                     *pool;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_mogilefs_refresh_t    *rf;
+    ngx_http_mogilefs_tracker_t    *t;
+    ngx_http_mogilefs_upstream_t   *slot;
+
+    /*
+     * Tracker evaluated per request can not be
+     * contacted in background
+     */
+    if(mgcf->upstream.upstream == NULL) {
+        return;
+    }
+
+    /*
+     * Background requests do not wait for a slot,
+     * clients come first
+     */
+    if(ngx_http_mogilefs_slot_get(mgcf->upstream.upstream, &slot) == NGX_BUSY) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "mogilefs cache refresh skipped: domain=\"%V\" key=\"%V\"",
+                       domain, key);
+        return;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if(pool == NULL) {
+        if(slot != NULL) {
+            ngx_http_mogilefs_slot_free(slot);
+        }
+
+        return;
+    }
+
+    if(slot != NULL) {
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if(cln == NULL) {
+            ngx_http_mogilefs_slot_free(slot);
+            goto failed;
+        }
+
+        cln->handler = ngx_http_mogilefs_slot_cleanup;
+        cln->data = slot;
+    }
+
+    rf = ngx_pcalloc(pool, sizeof(ngx_http_mogilefs_refresh_t));
+    if(rf == NULL) {
+        goto failed;
+    }
+
+    rf->pool = pool;
+    rf->valid = mgcf->cache_valid;
+    rf->stale = ngx_max(mgcf->cache_stale, mgcf->cache_stale_if_error);
+
+    rf->ctx.cache_generation = generation;
+    rf->ctx.num_paths_returned = -1;
+
+    rf->ctx.domain.data = ngx_pstrdup(pool, domain);
+    rf->ctx.domain.len = domain->len;
+
+    rf->ctx.key.data = ngx_pstrdup(pool, key);
+    rf->ctx.key.len = key->len;
+
+    if(rf->ctx.domain.data == NULL || rf->ctx.key.data == NULL) {
+        goto failed;
+    }
+
+    ngx_http_mogilefs_init_ctx_arrays(&rf->ctx, pool);
+
+    t = ngx_http_mogilefs_tracker_create(pool, ngx_cycle->log, mgcf,
+                                         mgcf->upstream.upstream);
+    if(t == NULL) {
+        goto failed;
+    }
+
+    t->process = ngx_http_mogilefs_cache_refresh_process;
+    t->handler = ngx_http_mogilefs_cache_refresh_handler;
+    t->data = rf;
+    t->stat = NGX_MOGILEFS_STAT_GET_PATHS;
+
+    len = sizeof("get_paths key=") - 1 + 3 * key->len
+        + sizeof("&domain=") - 1 + 3 * domain->len
+        + mgcf->cmd_template.args.len + sizeof(CRLF) - 1;
+
+    b = &t->request;
+
+    b->start = ngx_pnalloc(pool, len);
+    if(b->start == NULL) {
+        goto failed;
+    }
+
+    b->end = b->start + len;
+    b->pos = b->start;
+
+    b->last = ngx_copy(b->start, "get_paths key=", sizeof("get_paths key=") - 1);
+    b->last = ngx_http_mogilefs_escape_memcached(b->last, key->data, key->len);
+    b->last = ngx_copy(b->last, "&domain=", sizeof("&domain=") - 1);
+    b->last = ngx_http_mogilefs_escape_memcached(b->last, domain->data, domain->len);
+    b->last = ngx_copy(b->last, mgcf->cmd_template.args.data, mgcf->cmd_template.args.len);
+
+    *b->last++ = CR; *b->last++ = LF;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mogilefs cache refresh: domain=\"%V\" key=\"%V\"",
+                   domain, key);
+
+    ngx_http_mogilefs_tracker_send(t);
+
+    return;
+
+failed:
+
+    ngx_destroy_pool(pool);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_cache_refresh_process(ngx_http_mogilefs_tracker_t *t)
+{
+    ngx_int_t                       rc;
+    ngx_http_mogilefs_refresh_t    *rf;
+
+    rf = t->data;
+
+    rc = ngx_http_mogilefs_parse_response(t->buffer.pos, t->buffer.last, &rf->resp);
+
+    if(rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if(rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, t->log, 0,
+                      "mogilefs tracker has sent invalid response: \"%V\"", &rf->resp.line);
+
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    t->buffer.pos = rf->resp.next;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_cache_refresh_handler(ngx_http_mogilefs_tracker_t *t, ngx_int_t rc)
+{
+    ngx_str_t                       name, value;
+    ngx_http_mogilefs_src_t        *source;
+    ngx_http_mogilefs_cmd_t        *cmd;
+    ngx_http_mogilefs_error_t      *e;
+    ngx_http_mogilefs_refresh_t    *rf;
+
+    rf = t->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, t->log, 0,
+                   "mogilefs cache refresh done: %i", rc);
+
+    if(rc != NGX_OK) {
+        goto failed;
+    }
+
+    if(!rf->resp.ok) {
+        e = ngx_http_mogilefs_find_error(&rf->resp.args);
+
+        if(e->delete_ok) {
+            ngx_http_mogilefs_cache_delete(&rf->ctx.domain, &rf->ctx.key);
+            goto done;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, t->log, 0,
+                      "mogilefs error: \"%V\"", &rf->resp.args);
+
+        goto failed;
+    }
+
+    cmd = &ngx_http_mogilefs_cmds[0];
+
+    for( ;; ) {
+        rc = ngx_http_mogilefs_next_param(&rf->resp.args, &name, &value);
+
+        if(rc == NGX_DONE) {
+            break;
+        }
+
+        if(rc != NGX_OK) {
+            goto failed;
+        }
+
+        if(name.len > cmd->output_param.len
+            && ngx_strncmp(name.data, cmd->output_param.data, cmd->output_param.len) == 0
+            && ngx_atoi(name.data + cmd->output_param.len,
+                        name.len - cmd->output_param.len) != NGX_ERROR)
+        {
+            source = ngx_array_push(&rf->ctx.sources);
+            if(source == NULL) {
+                goto failed;
+            }
+
+            source->priority = ngx_atoi(name.data + cmd->output_param.len,
+                                        name.len - cmd->output_param.len);
+            source->path = value;
+        }
+    }
+
+    if(rf->ctx.sources.nelts == 0) {
+        goto failed;
+    }
+
+    if(rf->ctx.sources.nelts > 1) {
+        ngx_qsort(rf->ctx.sources.elts, rf->ctx.sources.nelts, sizeof(ngx_http_mogilefs_src_t),
+            ngx_http_mogilefs_cmp_sources);
+    }
+
+    ngx_http_mogilefs_cache_put(t->log, &rf->ctx, rf->valid, rf->stale);
+
+    goto done;
+
+failed:
+
+    ngx_http_mogilefs_cache_fail(&rf->ctx.domain, &rf->ctx.key);
+
+done:
+
+    ngx_http_mogilefs_tracker_close(t);
+
+    ngx_destroy_pool(rf->pool);
+}
+
+/*
+ * Drops cached paths on behalf of writers that
+ * do not go through this module
+ */
+static ngx_int_t
+ngx_http_mogilefs_purge_handler(ngx_http_request_t *r)
+{
+    u_char                         *dst, *src;
+    ngx_int_t                       rc;
+    ngx_str_t                       arg, domain, key;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mgcf = ngx_http_get_module_loc_conf(r, ngx_http_mogilefs_module);
+
+    if(ngx_http_arg(r, (u_char *) "key", sizeof("key") - 1, &arg) != NGX_OK
+        || arg.len == 0)
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    key.data = ngx_pnalloc(r->pool, arg.len);
+    if (key.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dst = key.data;
+    src = arg.data;
+
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+
+    key.len = dst - key.data;
+
+    if(ngx_http_arg(r, (u_char *) "domain", sizeof("domain") - 1, &arg) == NGX_OK) {
+        domain.data = ngx_pnalloc(r->pool, arg.len);
+        if (domain.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        dst = domain.data;
+        src = arg.data;
+
+        ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+
+        domain.len = dst - domain.data;
+    }
+    else if(mgcf->domain_complex != NULL) {
+        if(ngx_http_complex_value(r, mgcf->domain_complex, &domain) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "mogilefs purge: domain=\"%V\" key=\"%V\"", &domain, &key);
+
+    ngx_http_mogilefs_cache_delete(&domain, &key);
+
+    r->headers_out.status = NGX_HTTP_NO_CONTENT;
+    r->headers_out.content_length_n = 0;
+    r->header_only = 1;
+
+    return ngx_http_send_header(r);
+}
+
+static uint32_t
+ngx_http_mogilefs_cache_hash(ngx_str_t *domain, ngx_str_t *key)
+{
+    uint32_t                           hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, domain->data, domain->len);
+    ngx_crc32_update(&hash, key->data, key->len);
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_cache_cmp(ngx_http_mogilefs_cache_node_t *cn, ngx_str_t *domain,
+    ngx_str_t *key)
+{
+    ngx_int_t                          rc;
+
+    if(cn->domain_len != domain->len) {
+        return (ngx_int_t) cn->domain_len - (ngx_int_t) domain->len;
+    }
+
+    if(cn->key_len != key->len) {
+        return (ngx_int_t) cn->key_len - (ngx_int_t) key->len;
+    }
+
+    rc = ngx_memcmp(cn->data, domain->data, domain->len);
+
+    if(rc != 0) {
+        return rc;
+    }
+
+    return ngx_memcmp(cn->data + cn->domain_len, key->data, key->len);
+}
+
+/*
+ * Must be called with cache zone locked
+ */
+static ngx_http_mogilefs_cache_node_t *
+ngx_http_mogilefs_cache_lookup(ngx_http_mogilefs_main_conf_t *mmcf,
+    ngx_str_t *domain, ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_mogilefs_cache_node_t    *cn;
+
+    node = mmcf->cache->rbtree.root;
+    sentinel = mmcf->cache->rbtree.sentinel;
+
+    while(node != sentinel) {
+
+        if(hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if(hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        cn = (ngx_http_mogilefs_cache_node_t *) &node->color;
+
+        rc = ngx_http_mogilefs_cache_cmp(cn, domain, key);
+
+        if(rc == 0) {
+            return cn;
+        }
+
+        /* rc is node minus the one searched for, smaller nodes are on the left */
+        node = (rc < 0) ? node->right : node->left;
+    }
+
+    return NULL;
+}
+
+/*
+ * Removes expired entries from the tail of LRU queue,
+ * the least recently used one is removed unconditionally if forced
+ */
+static void
+ngx_http_mogilefs_cache_expire(ngx_http_mogilefs_main_conf_t *mmcf, ngx_uint_t force)
+{
+    time_t                             now;
+    ngx_uint_t                         n;
+    ngx_queue_t                       *q;
+    ngx_http_mogilefs_cache_node_t    *cn;
+
+    now = ngx_time();
+
+    for(n = 0;n < 3;n++) {
+
+        if(ngx_queue_empty(&mmcf->cache->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&mmcf->cache->queue);
+
+        if(q == &mmcf->cache->marker) {
+            q = ngx_queue_prev(q);
+
+            if(q == ngx_queue_sentinel(&mmcf->cache->queue)) {
+                return;
+            }
+        }
+
+        cn = ngx_queue_data(q, ngx_http_mogilefs_cache_node_t, queue);
+
+        if(!force && cn->drop >= now) {
+            return;
+        }
+
+        force = 0;
+
+        ngx_http_mogilefs_cache_free(mmcf, cn);
+    }
+}
+
+static void
+ngx_http_mogilefs_cache_free(ngx_http_mogilefs_main_conf_t *mmcf,
+    ngx_http_mogilefs_cache_node_t *cn)
+{
+    ngx_rbtree_node_t                 *node;
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_queue_remove(&cn->queue);
+
+    ngx_rbtree_delete(&mmcf->cache->rbtree, node);
+
+    ngx_slab_free_locked(mmcf->cache_shpool, node);
+}
+
+static void
+ngx_http_mogilefs_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_str_t                          domain, key;
+    ngx_rbtree_node_t                **p;
+    ngx_http_mogilefs_cache_node_t    *cn, *cnt;
+
+    for( ;; ) {
+
+        if(node->key < temp->key) {
+            p = &temp->left;
+        }
+        else if(node->key > temp->key) {
+            p = &temp->right;
+        }
+        else {
+            cn = (ngx_http_mogilefs_cache_node_t *) &node->color;
+            cnt = (ngx_http_mogilefs_cache_node_t *) &temp->color;
+
+            domain.data = cn->data;
+            domain.len = cn->domain_len;
+
+            key.data = cn->data + cn->domain_len;
+            key.len = cn->key_len;
+
+            p = (ngx_http_mogilefs_cache_cmp(cnt, &domain, &key) > 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if(*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t
+ngx_http_mogilefs_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_mogilefs_main_conf_t  *ommcf = data;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = shm_zone->data;
+
+    mmcf->cache_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /*
+     * Cached paths survive reconfiguration
+     */
+    if(ommcf != NULL) {
+        mmcf->cache = ommcf->cache;
+        return NGX_OK;
+    }
+
+    mmcf->cache = ngx_slab_alloc(mmcf->cache_shpool, sizeof(ngx_http_mogilefs_cache_sh_t));
+    if(mmcf->cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(mmcf->cache, sizeof(ngx_http_mogilefs_cache_sh_t));
+
+    ngx_rbtree_init(&mmcf->cache->rbtree, &mmcf->cache->sentinel,
+                    ngx_http_mogilefs_cache_rbtree_insert_value);
+
+    ngx_queue_init(&mmcf->cache->queue);
+
+    return NGX_OK;
+}
+
+/*
+ * Loads cache snapshot into an empty cache zone, i.e. on start
+ * and binary upgrade, but not on reconfiguration. Entries that
+ * are past the time they could be served at are skipped
+ */
+static void
+ngx_http_mogilefs_cache_load(ngx_cycle_t *cycle, ngx_http_mogilefs_main_conf_t *mmcf)
+{
+    u_char                                *p, *last, *start, *data;
+    size_t                                 len, size;
+    time_t                                 now;
+    uint32_t                               hash;
+    ngx_fd_t                               fd;
+    ngx_str_t                              domain, key;
+    ngx_uint_t                             i, n, loaded;
+    ngx_file_info_t                        fi;
+    ngx_rbtree_node_t                     *node;
+    ngx_http_mogilefs_cache_node_t        *cn;
+    ngx_http_mogilefs_snapshot_entry_t    *e;
+    ngx_http_mogilefs_snapshot_header_t   *h;
+
+    fd = ngx_open_file(mmcf->cache_snapshot.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(fd == NGX_INVALID_FILE) {
+        if(ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%V\" failed", &mmcf->cache_snapshot);
+        }
+        return;
+    }
+
+    if(ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &mmcf->cache_snapshot);
+        goto close;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if(size < sizeof(ngx_http_mogilefs_snapshot_header_t)) {
+        goto invalid;
+    }
+
+    start = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(start == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      "mmap(%uz) \"%V\" failed", size, &mmcf->cache_snapshot);
+        goto close;
+    }
+
+    h = (ngx_http_mogilefs_snapshot_header_t *) start;
+
+    if(h->magic != NGX_MOGILEFS_SNAPSHOT_MAGIC
+        || h->version != NGX_MOGILEFS_SNAPSHOT_VERSION
+        || h->max_paths != NGX_MOGILEFS_MAX_PATHS)
+    {
+        munmap(start, size);
+        goto invalid;
+    }
+
+    now = ngx_time();
+
+    if(mmcf->cache_snapshot_valid && h->time + mmcf->cache_snapshot_valid < now) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "mogilefs cache snapshot \"%V\" is too old",
+                      &mmcf->cache_snapshot);
+        munmap(start, size);
+        goto close;
+    }
+
+    p = start + ngx_align(sizeof(ngx_http_mogilefs_snapshot_header_t), NGX_ALIGNMENT);
+    last = start + size;
+
+    loaded = 0;
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    for(n = 0;n < h->nentries;n++) {
+        if((size_t) (last - p) < sizeof(ngx_http_mogilefs_snapshot_entry_t)) {
+            break;
+        }
+
+        e = (ngx_http_mogilefs_snapshot_entry_t *) p;
+        data = p + sizeof(ngx_http_mogilefs_snapshot_entry_t);
+
+        if(e->npaths > NGX_MOGILEFS_MAX_PATHS) {
+            break;
+        }
+
+        len = e->domain_len + e->key_len + e->length_len;
+
+        for(i = 0;i < e->npaths;i++) {
+            len += e->path_len[i];
+        }
+
+        if((size_t) (last - data) < len) {
+            break;
+        }
+
+        p = data + ngx_align(len, NGX_ALIGNMENT);
+
+        if(e->drop < now || e->npaths == 0) {
+            continue;
+        }
+
+        domain.data = data;
+        domain.len = e->domain_len;
+
+        key.data = data + e->domain_len;
+        key.len = e->key_len;
+
+        hash = ngx_http_mogilefs_cache_hash(&domain, &key);
+
+        if(ngx_http_mogilefs_cache_lookup(mmcf, &domain, &key, hash) != NULL) {
+            continue;
+        }
+
+        node = ngx_slab_alloc_locked(mmcf->cache_shpool, len
+                   + offsetof(ngx_rbtree_node_t, color)
+                   + offsetof(ngx_http_mogilefs_cache_node_t, data));
+
+        if(node == NULL) {
+            break;
+        }
+
+        node->key = hash;
+
+        cn = (ngx_http_mogilefs_cache_node_t *) &node->color;
+
+        cn->npaths = (u_char) e->npaths;
+        cn->domain_len = e->domain_len;
+        cn->key_len = e->key_len;
+        cn->length_len = e->length_len;
+        cn->expire = e->expire;
+        cn->drop = e->drop;
+        cn->update = 0;
+        cn->failed = 0;
+        cn->saved = mmcf->cache->epoch ^ mmcf->cache->saving;
+
+        ngx_memcpy(cn->path_len, e->path_len, e->npaths * sizeof(u_short));
+        ngx_memcpy(cn->data, data, len);
+
+        ngx_rbtree_insert(&mmcf->cache->rbtree, node);
+
+        ngx_queue_insert_head(&mmcf->cache->queue, &cn->queue);
+
+        loaded++;
+    }
+
+    mmcf->cache->snapshot = h->time;
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "mogilefs cache snapshot \"%V\": %ui of %uD entries loaded",
+                  &mmcf->cache_snapshot, loaded, h->nentries);
+
+    munmap(start, size);
+
+    goto close;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                  "mogilefs cache snapshot \"%V\" is invalid, ignored",
+                  &mmcf->cache_snapshot);
+
+close:
+
+    if(ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &mmcf->cache_snapshot);
+    }
+}
+
+/*
+ * Writes the cache to the snapshot file. The zone is locked for
+ * NGX_MOGILEFS_SNAPSHOT_BATCH entries at a time, the marker keeps the
+ * place in the queue in between. Entries used meanwhile move to the
+ * head and are met again, the epoch bit tells they are already saved.
+ * Entries added while saving are saved too
+ */
+static void
+ngx_http_mogilefs_cache_save(ngx_log_t *log, ngx_http_mogilefs_main_conf_t *mmcf,
+    ngx_uint_t force)
+{
+    u_char                                *buf, *p;
+    size_t                                 len, size, bsize, need;
+    off_t                                  offset;
+    time_t                                 now;
+    ngx_uint_t                             i, n, nentries, done;
+    ngx_file_t                             file;
+    ngx_queue_t                           *q, *marker;
+    ngx_http_mogilefs_cache_sh_t          *cache;
+    ngx_http_mogilefs_cache_node_t        *cn;
+    ngx_http_mogilefs_snapshot_entry_t    *e;
+    ngx_http_mogilefs_snapshot_header_t    h;
+
+    now = ngx_time();
+
+    cache = mmcf->cache;
+    marker = &cache->marker;
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    if(cache->saving || cache->snapshot == now
+        || (!force && cache->snapshot + mmcf->cache_snapshot_interval > now))
+    {
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+        return;
+    }
+
+    cache->snapshot = now;
+    cache->saving = 1;
+    cache->epoch ^= 1;
+
+    ngx_queue_insert_tail(&cache->queue, marker);
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+    nentries = 0;
+    bsize = NGX_MOGILEFS_SNAPSHOT_BUFFER;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = NGX_INVALID_FILE;
+    file.name = mmcf->cache_snapshot_temp;
+    file.log = log;
+
+    buf = ngx_alloc(bsize, log);
+    if(buf == NULL) {
+        goto done;
+    }
+
+    file.fd = ngx_open_file(mmcf->cache_snapshot_temp.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if(file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &mmcf->cache_snapshot_temp);
+        goto done;
+    }
+
+    offset = ngx_align(sizeof(ngx_http_mogilefs_snapshot_header_t), NGX_ALIGNMENT);
+
+    for( ;; ) {
+        p = buf;
+        need = 0;
+        done = 0;
+
+        ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+        for(n = 0;n < NGX_MOGILEFS_SNAPSHOT_BATCH;n++) {
+            q = ngx_queue_prev(marker);
+
+            if(q == ngx_queue_sentinel(&cache->queue)) {
+                done = 1;
+                break;
+            }
+
+            cn = ngx_queue_data(q, ngx_http_mogilefs_cache_node_t, queue);
+
+            if(cn->npaths != 0 && cn->saved != cache->epoch) {
+                len = cn->domain_len + cn->key_len + cn->length_len;
+
+                for(i = 0;i < cn->npaths;i++) {
+                    len += cn->path_len[i];
+                }
+
+                size = sizeof(ngx_http_mogilefs_snapshot_entry_t) + ngx_align(len, NGX_ALIGNMENT);
+
+                if(size > (size_t) (buf + bsize - p)) {
+                    if(p == buf) {
+                        need = size;
+                    }
+
+                    break;
+                }
+
+                e = (ngx_http_mogilefs_snapshot_entry_t *) p;
+
+                ngx_memzero(e, size);
+
+                e->expire = cn->expire;
+                e->drop = cn->drop;
+                e->domain_len = cn->domain_len;
+                e->key_len = cn->key_len;
+                e->length_len = cn->length_len;
+                e->npaths = cn->npaths;
+
+                for(i = 0;i < cn->npaths;i++) {
+                    e->path_len[i] = cn->path_len[i];
+                }
+
+                ngx_memcpy(p + sizeof(ngx_http_mogilefs_snapshot_entry_t), cn->data, len);
+
+                p += size;
+
+                cn->saved = cache->epoch;
+                nentries++;
+            }
+
+            /* steps over the node */
+            ngx_queue_remove(marker);
+            ngx_queue_insert_after(ngx_queue_prev(q), marker);
+        }
+
+        ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+
+        if(p != buf) {
+            if(ngx_write_file(&file, buf, p - buf, offset) == NGX_ERROR) {
+                goto failed;
+            }
+
+            offset += p - buf;
+        }
+
+        if(done) {
+            break;
+        }
+
+        if(need) {
+            ngx_free(buf);
+
+            bsize = need;
+
+            buf = ngx_alloc(bsize, log);
+            if(buf == NULL) {
+                goto failed;
+            }
+        }
+    }
+
+    ngx_memzero(&h, sizeof(ngx_http_mogilefs_snapshot_header_t));
+
+    h.magic = NGX_MOGILEFS_SNAPSHOT_MAGIC;
+    h.version = NGX_MOGILEFS_SNAPSHOT_VERSION;
+    h.max_paths = NGX_MOGILEFS_MAX_PATHS;
+    h.nentries = (uint32_t) nentries;
+    h.time = now;
+
+    if(ngx_write_file(&file, (u_char *) &h, sizeof(ngx_http_mogilefs_snapshot_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    if(ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &mmcf->cache_snapshot_temp);
+        file.fd = NGX_INVALID_FILE;
+        goto failed;
+    }
+
+    file.fd = NGX_INVALID_FILE;
+
+    if(ngx_rename_file(mmcf->cache_snapshot_temp.data, mmcf->cache_snapshot.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%V\" to \"%V\" failed",
+                      &mmcf->cache_snapshot_temp, &mmcf->cache_snapshot);
+        goto done;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "mogilefs cache snapshot: %ui entries, %O bytes", nentries, offset);
+
+    goto done;
+
+failed:
+
+    if(file.fd != NGX_INVALID_FILE) {
+        if(ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", &mmcf->cache_snapshot_temp);
+        }
+
+        file.fd = NGX_INVALID_FILE;
+    }
+
+    if(ngx_delete_file(mmcf->cache_snapshot_temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed", &mmcf->cache_snapshot_temp);
+    }
+
+done:
+
+    if(file.fd != NGX_INVALID_FILE) {
+        if(ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", &mmcf->cache_snapshot_temp);
+        }
+    }
+
+    if(buf != NULL) {
+        ngx_free(buf);
+    }
+
+    ngx_shmtx_lock(&mmcf->cache_shpool->mutex);
+
+    ngx_queue_remove(marker);
+    cache->saving = 0;
+
+    ngx_shmtx_unlock(&mmcf->cache_shpool->mutex);
+}
+
+static void
+ngx_http_mogilefs_cache_snapshot_handler(ngx_event_t *ev)
+{
+    ngx_http_mogilefs_main_conf_t  *mmcf = ev->data;
+
+    ngx_http_mogilefs_cache_save(ev->log, mmcf, 0);
+
+    if(!ngx_exiting && !ngx_quit && !ngx_terminate) {
+        ngx_add_timer(ev, mmcf->cache_snapshot_interval * 1000);
+    }
+}
+
+static ngx_int_t
+ngx_http_mogilefs_init_module(ngx_cycle_t *cycle)
+{
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL || mmcf->cache_snapshot.len == 0) {
+        return NGX_OK;
+    }
+
+    if(ngx_queue_empty(&mmcf->cache->queue)) {
+        ngx_http_mogilefs_cache_load(cycle, mmcf);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_mogilefs_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i, j, n;
+    ngx_event_t                         *ev;
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_mogilefs_upstream_t        *ka;
+    ngx_http_mogilefs_keepalive_conn_t  *kc;
+    ngx_http_mogilefs_main_conf_t       *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ka = mmcf->upstreams.elts;
+
+    for(i = 0;i < mmcf->upstreams.nelts;i++) {
+        ngx_queue_init(&ka[i].waiting);
+    }
+
+    /*
+     * Trackers are connected to before the first request comes
+     */
+    for(i = 0;mmcf->keepalive_max && i < mmcf->upstreams.nelts;i++) {
+        ngx_queue_init(&ka[i].cache);
+        ngx_queue_init(&ka[i].free);
+
+        peers = ka[i].upstream->peer.data;
+
+        n = mmcf->keepalive_max * peers->number;
+
+        kc = ngx_pcalloc(cycle->pool, n * sizeof(ngx_http_mogilefs_keepalive_conn_t));
+        if(kc == NULL) {
+            return NGX_ERROR;
+        }
+
+        for(j = 0;j < n;j++) {
+            kc[j].keepalive = &ka[i];
+            ngx_queue_insert_head(&ka[i].free, &kc[j].queue);
+        }
+
+        ngx_http_mogilefs_keepalive_fill(&ka[i]);
+
+        ev = &ka[i].event;
+
+        ev->handler = ngx_http_mogilefs_keepalive_noop_handler;
+        ev->data = &ka[i];
+        ev->log = cycle->log;
+
+#if defined nginx_version && nginx_version >= 1007011
+        ev->cancelable = 1;
+#endif
+
+        ngx_add_timer(ev, mmcf->keepalive_noop);
+    }
+
+    if(mmcf->cache == NULL || mmcf->cache_snapshot.len == 0) {
+        return NGX_OK;
+    }
+
+    ev = &mmcf->cache_snapshot_event;
+
+    ev->handler = ngx_http_mogilefs_cache_snapshot_handler;
+    ev->data = mmcf;
+    ev->log = cycle->log;
+
+    /*
+     * Older versions wait for all timers on graceful shutdown,
+     * the timer is not rearmed then
+     */
+#if defined nginx_version && nginx_version >= 1007011
+    ev->cancelable = 1;
+#endif
+
+    ngx_add_timer(ev, mmcf->cache_snapshot_interval * 1000);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_mogilefs_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_mogilefs_module);
+
+    if(mmcf == NULL || mmcf->cache == NULL || mmcf->cache_snapshot.len == 0) {
+        return;
+    }
+
+    ngx_http_mogilefs_cache_save(cycle->log, mmcf, 1);
+}
+
+static void *
+ngx_http_mogilefs_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_mogilefs_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_mogilefs_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->status_zone = NULL;
+     *     conf->status = NULL;
+     *     conf->status_used = 0;
+     *     conf->adaptive_used = 0;
+     *     conf->cache_zone = NULL;
+     *     conf->cache = NULL;
+     *     conf->cache_used = 0;
+     *     conf->cache_snapshot = { 0, NULL };
+     *     conf->cache_snapshot_interval = 0;
+     *     conf->cache_snapshot_valid = 0;
+     *     conf->keepalive_max = 0;
+     *     conf->max_conns = 0;
+     *     conf->dispatch_srv = NULL;
+     */
+
+    if (ngx_array_init(&conf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_mogilefs_upstream_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->dispatch, cf->pool, 16,
+                       sizeof(ngx_http_mogilefs_dispatch_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    conf->keepalive_noop = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+static void *
+ngx_http_mogilefs_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_mogilefs_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_mogilefs_loc_conf_t));
+
+    if (conf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+
+    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+
+    /* the hardcoded values */
+    conf->upstream.cyclic_temp_file = 0;
+    conf->upstream.buffering = 0;
+    conf->upstream.ignore_client_abort = 0;
+    conf->upstream.send_lowat = 0;
+    conf->upstream.bufs.num = 0;
+    conf->upstream.busy_buffers_size = 0;
+    conf->upstream.max_temp_file_size = 0;
+    conf->upstream.temp_file_write_size = 0;
+    conf->upstream.intercept_errors = 1;
+    conf->upstream.intercept_404 = 1;
+    conf->upstream.pass_request_headers = 0;
+    conf->upstream.pass_request_body = 0;
+
+    conf->noverify = NGX_CONF_UNSET;
+    conf->checksum = NGX_CONF_UNSET;
+#if (NGX_MOGILEFS_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->file_info = NGX_CONF_UNSET;
+    conf->slow_put_threshold = NGX_CONF_UNSET_MSEC;
+    conf->put_memory_threshold = NGX_CONF_UNSET_SIZE;
+    conf->adaptive_factor = NGX_CONF_UNSET_UINT;
+    conf->adaptive_min = NGX_CONF_UNSET_MSEC;
+    conf->adaptive_max = NGX_CONF_UNSET_MSEC;
+    conf->cache_valid = NGX_CONF_UNSET;
+    conf->cache_stale = NGX_CONF_UNSET;
+    conf->cache_stale_if_error = NGX_CONF_UNSET;
+    conf->redirect = NGX_CONF_UNSET;
+    conf->redirect_min_size = NGX_CONF_UNSET;
+    conf->redirect_expires = NGX_CONF_UNSET;
+    conf->methods = 0;
+
+    return conf;
+}
+
+static char *
+ngx_http_mogilefs_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_mogilefs_loc_conf_t *prev = parent;
+    ngx_http_mogilefs_loc_conf_t *conf = child;
+
+    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
+                              prev->upstream.connect_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
+                              prev->upstream.send_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
+                              prev->upstream.read_timeout, 60000);
+
+    ngx_conf_merge_size_value(conf->upstream.buffer_size,
+                              prev->upstream.buffer_size,
+                              (size_t) ngx_pagesize);
+
+    ngx_conf_merge_bitmask_value(conf->upstream.next_upstream,
+                              prev->upstream.next_upstream,
+                              (NGX_CONF_BITMASK_SET
+                               |NGX_HTTP_UPSTREAM_FT_ERROR
+                               |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+
+    if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
+        conf->upstream.next_upstream = NGX_CONF_BITMASK_SET
+                                       |NGX_HTTP_UPSTREAM_FT_OFF;
+    }
+
+    if (conf->upstream.upstream == NULL) {
+        conf->upstream.upstream = prev->upstream.upstream;
+    }
+
+    if (conf->domain_complex == NULL) {
+        conf->domain_complex = prev->domain_complex;
+    }
+
+    ngx_conf_merge_value(conf->noverify, prev->noverify, 0);
+
+    ngx_conf_merge_value(conf->checksum, prev->checksum, 0);
+
+#if (NGX_MOGILEFS_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
+    ngx_conf_merge_value(conf->file_info, prev->file_info, 0);
+
+    ngx_conf_merge_msec_value(conf->slow_put_threshold,
+                              prev->slow_put_threshold, 0);
+
+    ngx_conf_merge_size_value(conf->put_memory_threshold,
+                              prev->put_memory_threshold, 0);
+
+    ngx_conf_merge_uint_value(conf->adaptive_factor, prev->adaptive_factor, 0);
+
+    ngx_conf_merge_msec_value(conf->adaptive_min, prev->adaptive_min, 100);
+
+    ngx_conf_merge_msec_value(conf->adaptive_max, prev->adaptive_max,
+                              conf->upstream.read_timeout);
+
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 0);
+
+    ngx_conf_merge_sec_value(conf->cache_stale, prev->cache_stale, 0);
+
+    ngx_conf_merge_sec_value(conf->cache_stale_if_error,
+                             prev->cache_stale_if_error, 0);
+
+    if(conf->prefetch == NULL) {
+        conf->prefetch = prev->prefetch;
+    }
+
+    ngx_conf_merge_bitmask_value(conf->methods, prev->methods,
+                         (NGX_CONF_BITMASK_SET|NGX_HTTP_GET));
+
+    if(conf->methods & NGX_HTTP_GET) {
+        conf->methods |= NGX_HTTP_HEAD;
+    }
+
+    if(conf->class_templates == NULL) {
+        conf->class_templates = prev->class_templates;
+    }
+
+    if(conf->local_roots == NULL) {
+        conf->local_roots = prev->local_roots;
+    }
+
+    ngx_conf_merge_value(conf->redirect, prev->redirect, 0);
+
+    ngx_conf_merge_off_value(conf->redirect_min_size, prev->redirect_min_size, 0);
+
+    ngx_conf_merge_str_value(conf->redirect_secret, prev->redirect_secret, "");
+
+    ngx_conf_merge_sec_value(conf->redirect_expires, prev->redirect_expires, 0);
+
+    if(conf->redirect_secret.len != 0) {
+        ngx_http_mogilefs_hmac_init(conf);
+    }
+
+    if(conf->location_type == NGX_MOGILEFS_LIST_KEYS) {
+        if(conf->upstream.upstream == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "mogilefs_list_keys requires mogilefs_tracker without variables");
+            return NGX_CONF_ERROR;
+        }
+
+        if(conf->domain_complex == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "mogilefs_list_keys requires mogilefs_domain");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return ngx_http_mogilefs_compile_cmd_template(cf, conf);
+}
+
+/*
+ * Keeps MD5 state after inner and outer padded keys of HMAC,
+ * so that only the URL and the inner hash are digested per path
+ */
+static void
+ngx_http_mogilefs_hmac_init(ngx_http_mogilefs_loc_conf_t *mgcf)
+{
+    ngx_uint_t                           i;
+    ngx_md5_t                            md5;
+    u_char                               key[64], pad[64];
+
+    ngx_memzero(key, sizeof(key));
+
+    if(mgcf->redirect_secret.len > sizeof(key)) {
+        ngx_md5_init(&md5);
+        ngx_md5_update(&md5, mgcf->redirect_secret.data, mgcf->redirect_secret.len);
+        ngx_md5_final(key, &md5);
+    }
+    else {
+        ngx_memcpy(key, mgcf->redirect_secret.data, mgcf->redirect_secret.len);
+    }
+
+    for(i = 0;i < sizeof(key);i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+
+    ngx_md5_init(&mgcf->redirect_ipad);
+    ngx_md5_update(&mgcf->redirect_ipad, pad, sizeof(pad));
+
+    for(i = 0;i < sizeof(key);i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+
+    ngx_md5_init(&mgcf->redirect_opad);
+    ngx_md5_update(&mgcf->redirect_opad, pad, sizeof(pad));
+}
+
+/*
+ * Renders escaped static domain, noverify and static class,
+ * so that only the key is escaped per request
+ */
+static char *
+ngx_http_mogilefs_compile_cmd_template(ngx_conf_t *cf, ngx_http_mogilefs_loc_conf_t *mgcf)
+{
+    u_char                              *p;
+    ngx_str_t                           *domain, *class;
+    ngx_http_mogilefs_class_template_t  *t;
+
+    if(mgcf->domain_complex != NULL && mgcf->domain_complex->lengths == NULL) {
+        domain = &mgcf->domain_complex->value;
+
+        p = ngx_pnalloc(cf->pool, sizeof("&domain=") - 1 + 3 * domain->len);
+        if(p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        mgcf->cmd_template.domain.data = p;
+
+        p = ngx_copy(p, "&domain=", sizeof("&domain=") - 1);
+
+        p = ngx_http_mogilefs_escape_memcached(p, domain->data, domain->len);
+
+        mgcf->cmd_template.domain.len = p - mgcf->cmd_template.domain.data;
+    }
+
+    /*
+     * Static class is used if it comes first,
+     * otherwise classes are evaluated per request
+     */
+    class = NULL;
+
+    if(mgcf->class_templates != NULL && mgcf->class_templates->nelts) {
+        t = mgcf->class_templates->elts;
+
+        if(t->lengths == NULL) {
+            class = &t->source;
+        }
+    }
+
+    mgcf->cmd_template.static_class = (class != NULL);
+
+    mgcf->cmd_template.args.len = (mgcf->noverify ? sizeof("&noverify=1") - 1 : 0)
+        + (class != NULL ? 1 + ngx_http_mogilefs_class.len + 1 + class->len : 0);
+
+    if(mgcf->cmd_template.args.len == 0) {
+        return NGX_CONF_OK;
+    }
+
+    p = ngx_pnalloc(cf->pool, mgcf->cmd_template.args.len);
+    if(p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mgcf->cmd_template.args.data = p;
+
+    if(mgcf->noverify) {
+        p = ngx_copy(p, "&noverify=1", sizeof("&noverify=1") - 1);
+    }
+
+    if(class != NULL) {
+        *p++ = '&';
+        p = ngx_copy(p, ngx_http_mogilefs_class.data, ngx_http_mogilefs_class.len);
+        *p++ = '=';
+        p = ngx_copy(p, class->data, class->len);
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_mogilefs_add_variables(ngx_conf_t *cf)
+{
+    ngx_uint_t           i;
+    ngx_http_variable_t  *var, *v;
+    ngx_str_t            name;
+
+    /*
+     * Add 10 instances of mogilefs_path variable with
+     * different names
+     */
+    v = &ngx_http_mogilefs_path_variable_template;
+
+    for(i=0;i<NGX_MOGILEFS_MAX_PATHS;i++) {
+        name.data = v->name.data;
+        name.len = v->name.len - 1;
+
+        if(i > 0) {
+            name.data[name.len] = '0' + i;
+            name.len++;
+        }
+
+        var = ngx_http_add_variable(cf, &name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    for (v = ngx_http_mogilefs_variables; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_mogilefs_path_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data) 
+{
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    v->len = 0;
+    v->data = (u_char*)"";
+
+    return NGX_OK;
+}
+
+static char *
+ngx_http_mogilefs_tracker_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mogilefs_loc_conf_t    *mgcf = conf;
+    ngx_http_mogilefs_main_conf_t   *mmcf;
+    ngx_http_mogilefs_upstream_t    *ka;
+    ngx_str_t                       *value;
+    ngx_url_t                        u;
+    ngx_uint_t                       i, n;
+    ngx_http_script_compile_t        sc;
+
+    if (mgcf->upstream.upstream || mgcf->tracker_lengths) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_http_script_variables_count(&value[1]);
+
+    if(n) { 
+        ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+
+        sc.cf = cf;
+        sc.source = &value[1];
+        sc.lengths = &mgcf->tracker_lengths;
+        sc.values = &mgcf->tracker_values;
+        sc.variables = n;
+        sc.complete_lengths = 1;
+        sc.complete_values = 1;
+
+        if (ngx_http_script_compile(&sc) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.no_resolve = 1;
+    u.default_port = 6001;
+
+    mgcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
+    if (mgcf->upstream.upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * Remember the upstream for mogilefs_tracker_keepalive
+     * and mogilefs_tracker_max_conns
+     */
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+
+    ka = mmcf->upstreams.elts;
+
+    for (i = 0; i < mmcf->upstreams.nelts; i++) {
+        if (ka[i].upstream == mgcf->upstream.upstream) {
+            return NGX_CONF_OK;
+        }
+    }
+
+    ka = ngx_array_push(&mmcf->upstreams);
+    if (ka == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(ka, sizeof(ngx_http_mogilefs_upstream_t));
+
+    ka->upstream = mgcf->upstream.upstream;
+
+    return NGX_CONF_OK;
+}
+
+/* 
+ * Copied from: nginx-1.0.0/src/http/ngx_http_script.c
+ * ngx_http_set_complex_value_slot() 
+ */
+static char *
+ngx_http_mogilefs_complex_command(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_str_t                          *value;
+    ngx_http_complex_value_t          **cv;
+    ngx_http_compile_complex_value_t    ccv;
+
+    cv = (ngx_http_complex_value_t **) (p + cmd->offset);
+
+    if (*cv != NULL) {
+        return "duplicate";
+    }
+
+    *cv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (*cv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = *cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_mogilefs_class_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mogilefs_loc_conf_t        *mgcf = conf;
+    ngx_http_mogilefs_class_template_t  *t;
+    ngx_str_t                           *value;
+    ngx_uint_t                           i, n;
+    ngx_http_script_compile_t            sc;
+
+    if(mgcf->class_templates == NULL) {
+        mgcf->class_templates = ngx_array_create(cf->pool, cf->args->nelts,
+            sizeof(ngx_http_mogilefs_class_template_t));
+
+        if(mgcf->class_templates == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    for(i = 1;i < cf->args->nelts;i++) {
+        t = ngx_array_push(mgcf->class_templates);
+
+        if(t == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        t->source = value[i];
+        t->lengths = NULL;
+        t->values = NULL;
+
+        n = ngx_http_script_variables_count(&t->source);
+
+        if(n) { 
+            ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+
+            sc.cf = cf;
+            sc.source = &value[i];
+            sc.lengths = &t->lengths;
+            sc.values = &t->values;
+            sc.variables = n;
+            sc.complete_lengths = 1;
+            sc.complete_values = 1;
+
+            if (ngx_http_script_compile(&sc) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_http_conf_ctx_t *
+ngx_http_mogilefs_create_loc_ctx(ngx_conf_t *cf)
+{
+    ngx_http_conf_ctx_t       *ctx, *pctx;
+    ngx_uint_t                 i;
+    ngx_http_module_t         *module;
+    void                      *mconf;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_conf_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    pctx = cf->ctx;
+    ctx->main_conf = pctx->main_conf;
+    ctx->srv_conf = pctx->srv_conf;
+
+    ctx->loc_conf = ngx_pcalloc(cf->pool, sizeof(void *) * ngx_http_max_module);
+    if (ctx->loc_conf == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; ngx_modules[i]; i++) {
+        if (ngx_modules[i]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = ngx_modules[i]->ctx;
+
+        if (module->create_loc_conf) {
+
+            mconf = module->create_loc_conf(cf);
+            if (mconf == NULL) {
+                 return NULL;
+            }
+
+            ctx->loc_conf[ngx_modules[i]->ctx_index] = mconf;
+        }
+    }
+
+    return ctx;
+}
+
+/*
+ * Creates configuration of the fetch block. It is kept as a nameless
+ * location nested in mogilefs_pass location, the same way limit_except
+ * does, so it is merged but never appears in the location tree
+ */
+static ngx_http_conf_ctx_t *
+ngx_http_mogilefs_create_fetch_ctx(ngx_conf_t *cf)
+{
+    ngx_http_conf_ctx_t           *ctx;
+    ngx_http_core_loc_conf_t      *clcf, *pclcf;
+    ngx_http_mogilefs_loc_conf_t  *mgcf;
+
+    ctx = ngx_http_mogilefs_create_loc_ctx(cf);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    pclcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf = ctx->loc_conf[ngx_http_core_module.ctx_index];
+
+    mgcf = ctx->loc_conf[ngx_http_mogilefs_module.ctx_index];
+
+    mgcf->location_type = NGX_MOGILEFS_FETCH;
+
+    clcf->loc_conf = ctx->loc_conf;
+    clcf->name = pclcf->name;
+    clcf->noname = 1;
+
+    if (ngx_http_add_location(cf, &pclcf->locations, clcf) != NGX_OK) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/*
+ * Adds the internal location mogilefs_pass locations of a server
+ * redirect to once paths are known. It is created once per server
+ */
+static char *
+ngx_http_mogilefs_create_dispatch_location(ngx_conf_t *cf)
+{
+    ngx_http_conf_ctx_t            *ctx;
+    ngx_http_core_loc_conf_t       *clcf, *rclcf;
+    ngx_http_core_srv_conf_t       *cscf;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+    cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+
+    if (mmcf->dispatch_srv == cscf) {
+        return NGX_CONF_OK;
+    }
+
+    ctx = ngx_http_mogilefs_create_loc_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ctx->loc_conf[ngx_http_core_module.ctx_index];
+
+    mgcf = ctx->loc_conf[ngx_http_mogilefs_module.ctx_index];
+
+    mgcf->location_type = NGX_MOGILEFS_DISPATCH;
+
+    clcf->handler = ngx_http_mogilefs_dispatch_handler;
+
+    clcf->loc_conf = ctx->loc_conf;
+    clcf->name.len = sizeof(NGX_MOGILEFS_DISPATCH_PREFIX) - 1;
+    clcf->name.data = (u_char *) NGX_MOGILEFS_DISPATCH_PREFIX;
+    clcf->exact_match = 0;
+    clcf->noname = 0;
+    clcf->internal = 1;
+    clcf->noregex = 1;
+
+    rclcf = cscf->ctx->loc_conf[ngx_http_core_module.ctx_index];
+
+    if (ngx_http_add_location(cf, &rclcf->locations, clcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->dispatch_srv = cscf;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_mogilefs_pass_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mogilefs_loc_conf_t *pmgcf = conf;
+    ngx_http_core_loc_conf_t  *pclcf;
+    ngx_http_conf_ctx_t       *ctx;
+    char                      *rv;
+    ngx_str_t                 *value;
+    ngx_conf_t                 save;
+    ngx_http_script_compile_t  sc;
+    ngx_uint_t                 n, i;
+    char                      *rc;
+    ngx_str_t                  name;
+    ngx_http_mogilefs_dispatch_t  *d;
+    ngx_http_mogilefs_main_conf_t *mmcf;
+
+    if (pmgcf->fetch_location.len != 0) {
+        return "is duplicate";
+    }
+
+    if (pmgcf->upstream.upstream == 0 && pmgcf->tracker_lengths == NULL) {
+        return "no tracker defined";
+    }
+
+    if (pmgcf->domain_complex == NULL) {
+        return "no domain defined";
+    }
+
+    for(i=0;i < NGX_MOGILEFS_MAX_PATHS;i++) {
+        name.data = ngx_http_mogilefs_path.data;
+        name.len = ngx_http_mogilefs_path.len - 1;
+
+        if(i > 0) {
+            name.data[name.len] = '0' + i;
+            name.len++;
+        }
+
+        pmgcf->index[i] = ngx_http_get_variable_index(cf, &name);
+
+        if (pmgcf->index[i] == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    pmgcf->length_index = ngx_http_get_variable_index(cf, &ngx_http_mogilefs_length_variable_name);
+
+    if (pmgcf->length_index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    rc = ngx_http_mogilefs_create_dispatch_location(cf);
+
+    if(rc != NGX_CONF_OK) {
+        return rc;
+    }
+
+    ctx = ngx_http_mogilefs_create_fetch_ctx(cf);
+
+    if(ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+
+    d = ngx_array_push(&mmcf->dispatch);
+    if(d == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    d->loc_conf = ((ngx_http_conf_ctx_t *) cf->ctx)->loc_conf;
+    d->fetch_loc_conf = ctx->loc_conf;
+
+    /*
+     * Only the index of this location is rendered into the URIs,
+     * the location tree is not grown by mogilefs_pass
+     */
+    n = sizeof(NGX_MOGILEFS_DISPATCH_PREFIX) - 1 + 1 + NGX_INT_T_LEN;
+
+    pmgcf->fetch_location.data = ngx_pnalloc(cf->pool, n);
+    pmgcf->local_location.data = ngx_pnalloc(cf->pool, n);
+    pmgcf->redirect_location.data = ngx_pnalloc(cf->pool, n);
+
+    if(pmgcf->fetch_location.data == NULL || pmgcf->local_location.data == NULL
+        || pmgcf->redirect_location.data == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    pmgcf->fetch_location.len = ngx_sprintf(pmgcf->fetch_location.data,
+        NGX_MOGILEFS_DISPATCH_PREFIX "f%ui", mmcf->dispatch.nelts - 1)
+        - pmgcf->fetch_location.data;
+
+    pmgcf->local_location.len = ngx_sprintf(pmgcf->local_location.data,
+        NGX_MOGILEFS_DISPATCH_PREFIX "l%ui", mmcf->dispatch.nelts - 1)
+        - pmgcf->local_location.data;
+
+    pmgcf->redirect_location.len = ngx_sprintf(pmgcf->redirect_location.data,
+        NGX_MOGILEFS_DISPATCH_PREFIX "r%ui", mmcf->dispatch.nelts - 1)
+        - pmgcf->redirect_location.data;
+
+    pmgcf->location_type = NGX_MOGILEFS_MAIN;
+
+    pclcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    pclcf->handler = ngx_http_mogilefs_handler;
+
+    if(cf->args->nelts > 1) { 
+        value = cf->args->elts;
+
+        pmgcf->key = value[1];
+
+        n = ngx_http_script_variables_count(&pmgcf->key);
+
+        ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+
+        sc.cf = cf;
+        sc.source = &pmgcf->key;
+        sc.lengths = &pmgcf->key_lengths;
+        sc.values = &pmgcf->key_values;
+        sc.variables = n;
+        sc.complete_lengths = 1;
+        sc.complete_values = 1;
+
+        if (ngx_http_script_compile(&sc) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    save = *cf;
+    cf->ctx = ctx;
+    cf->cmd_type = NGX_HTTP_LOC_CONF;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    return rv;
+}
+
+static char *
+ngx_http_mogilefs_list_keys_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mogilefs_loc_conf_t *mgcf = conf;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_str_t                    *value;
+    ngx_int_t                     n;
+
+    if (mgcf->list_page_size != 0) {
+        return "is duplicate";
+    }
+
+    mgcf->list_page_size = NGX_MOGILEFS_LIST_PAGE_SIZE;
+
+    if(cf->args->nelts > 1) {
+        value = cf->args->elts;
+
+        n = ngx_atoi(value[1].data, value[1].len);
+
+        if(n == NGX_ERROR || n == 0 || n > NGX_MOGILEFS_LIST_PAGE_SIZE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid page size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        mgcf->list_page_size = n;
+    }
+
+    mgcf->location_type = NGX_MOGILEFS_LIST_KEYS;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mogilefs_list_handler;
+
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_mogilefs_filter_init(void *data)
+static char *
+ngx_http_mogilefs_status_zone_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    return NGX_OK;
+    ngx_http_mogilefs_main_conf_t *mmcf = conf;
+    ngx_str_t                     *value;
+    ssize_t                        size;
+
+    if (mmcf->status_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->status_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                              &ngx_http_mogilefs_module);
+    if (mmcf->status_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (mmcf->status_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->status_zone->init = ngx_http_mogilefs_init_status_zone;
+    mmcf->status_zone->data = mmcf;
+
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_mogilefs_filter(void *data, ssize_t bytes)
+static char *
+ngx_http_mogilefs_status_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    return NGX_OK;
+    ngx_http_mogilefs_loc_conf_t  *mgcf = conf;
+    ngx_http_mogilefs_main_conf_t *mmcf;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_str_t                     *value;
+
+    value = cf->args->elts;
+
+    mgcf->status_format = NGX_MOGILEFS_STATUS_TEXT;
+
+    if (cf->args->nelts > 1) {
+        if (ngx_strcmp(value[1].data, "json") == 0) {
+            mgcf->status_format = NGX_MOGILEFS_STATUS_JSON;
+        }
+        else if (ngx_strcmp(value[1].data, "text") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid format \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+    mmcf->status_used = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mogilefs_status_handler;
+
+    return NGX_CONF_OK;
 }
 
-static void *
-ngx_http_mogilefs_create_loc_conf(ngx_conf_t *cf)
+/*
+ * mogilefs_local_root <storage node URL prefix> <root>
+ */
+static char *
+ngx_http_mogilefs_local_root_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_mogilefs_loc_conf_t  *conf;
+    ngx_http_mogilefs_loc_conf_t    *mgcf = conf;
+    ngx_str_t                       *value;
+    ngx_http_mogilefs_local_root_t  *lr;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_mogilefs_loc_conf_t));
+    value = cf->args->elts;
 
-    if (conf == NULL) {
-        return NGX_CONF_ERROR;
+    if (value[1].len == 0 || value[2].len == 0) {
+        return "takes empty argument";
     }
 
-    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+    if (mgcf->local_roots == NULL) {
+        mgcf->local_roots = ngx_array_create(cf->pool, 2,
+                                             sizeof(ngx_http_mogilefs_local_root_t));
+        if (mgcf->local_roots == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
-    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    lr = ngx_array_push(mgcf->local_roots);
+    if (lr == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    /* the hardcoded values */
-    conf->upstream.cyclic_temp_file = 0;
-    conf->upstream.buffering = 0;
-    conf->upstream.ignore_client_abort = 0;
-    conf->upstream.send_lowat = 0;
-    conf->upstream.bufs.num = 0;
-    conf->upstream.busy_buffers_size = 0;
-    conf->upstream.max_temp_file_size = 0;
-    conf->upstream.temp_file_write_size = 0;
-    conf->upstream.intercept_errors = 1;
-    conf->upstream.intercept_404 = 1;
-    conf->upstream.pass_request_headers = 0;
-    conf->upstream.pass_request_body = 0;
+    lr->prefix = value[1];
+    lr->root = value[2];
 
-    conf->noverify = NGX_CONF_UNSET;
-    conf->methods = 0;
+    if (ngx_conf_full_name(cf->cycle, &lr->root, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
-    return conf;
+    return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_mogilefs_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+ngx_http_mogilefs_cache_zone_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_mogilefs_loc_conf_t *prev = parent;
-    ngx_http_mogilefs_loc_conf_t *conf = child;
+    ngx_http_mogilefs_main_conf_t *mmcf = conf;
+    ngx_str_t                     *value;
+    ssize_t                        size;
 
-    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
-                              prev->upstream.connect_timeout, 60000);
+    if (mmcf->cache_zone != NULL) {
+        return "is duplicate";
+    }
 
-    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
-                              prev->upstream.send_timeout, 60000);
+    value = cf->args->elts;
 
-    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
-                              prev->upstream.read_timeout, 60000);
+    size = ngx_parse_size(&value[2]);
 
-    ngx_conf_merge_size_value(conf->upstream.buffer_size,
-                              prev->upstream.buffer_size,
-                              (size_t) ngx_pagesize);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
 
-    ngx_conf_merge_bitmask_value(conf->upstream.next_upstream,
-                              prev->upstream.next_upstream,
-                              (NGX_CONF_BITMASK_SET
-                               |NGX_HTTP_UPSTREAM_FT_ERROR
-                               |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
-        conf->upstream.next_upstream = NGX_CONF_BITMASK_SET
-                                       |NGX_HTTP_UPSTREAM_FT_OFF;
+    mmcf->cache_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                             &ngx_http_mogilefs_module);
+    if (mmcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    if (conf->upstream.upstream == NULL) {
-        conf->upstream.upstream = prev->upstream.upstream;
+    if (mmcf->cache_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    if (conf->domain_complex == NULL) {
-        conf->domain_complex = prev->domain_complex;
+    mmcf->cache_zone->init = ngx_http_mogilefs_init_cache_zone;
+    mmcf->cache_zone->data = mmcf;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * mogilefs_prefetch <regex> <count>
+ */
+static char *
+ngx_http_mogilefs_prefetch_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_PCRE)
+    ngx_http_mogilefs_loc_conf_t  *mgcf = conf;
+    ngx_str_t                     *value;
+    ngx_int_t                      n;
+    ngx_regex_compile_t            rc;
+    u_char                         errstr[NGX_MAX_CONF_ERRSTR];
+
+    if (mgcf->prefetch != NULL) {
+        return "is duplicate";
     }
 
-    ngx_conf_merge_value(conf->noverify, prev->noverify, 0);
+    value = cf->args->elts;
 
-    ngx_conf_merge_bitmask_value(conf->methods, prev->methods,
-                         (NGX_CONF_BITMASK_SET|NGX_HTTP_GET));
+    n = ngx_atoi(value[2].data, value[2].len);
 
-    if(conf->methods & NGX_HTTP_GET) {
-        conf->methods |= NGX_HTTP_HEAD;
+    if (n == NGX_ERROR || n == 0 || n > NGX_MOGILEFS_MAX_PREFETCH) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of keys \"%V\", must be 1..%d",
+                           &value[2], NGX_MOGILEFS_MAX_PREFETCH);
+        return NGX_CONF_ERROR;
     }
 
-    if(conf->class_templates == NULL) {
-        conf->class_templates = prev->class_templates;
+    mgcf->prefetch = ngx_palloc(cf->pool, sizeof(ngx_http_mogilefs_prefetch_t));
+    if (mgcf->prefetch == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mgcf->prefetch->count = n;
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pattern = value[1];
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    if (ngx_regex_compile(&rc) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+        return NGX_CONF_ERROR;
     }
 
+    if (rc.captures < 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "regex \"%V\" must capture the number of the key",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mgcf->prefetch->regex = rc.regex;
+
     return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"mogilefs_prefetch\" requires PCRE library");
+    return NGX_CONF_ERROR;
+#endif
 }
 
-static ngx_int_t ngx_http_mogilefs_add_variables(ngx_conf_t *cf)
+/*
+ * mogilefs_thread_pool <name> | off
+ */
+static char *
+ngx_http_mogilefs_thread_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_uint_t           i;
-    ngx_http_variable_t  *var, *v;
-    ngx_str_t            name;
-
-    /*
-     * Add 10 instances of mogilefs_path variable with
-     * different names
-     */
-    v = &ngx_http_mogilefs_path_variable_template;
+#if (NGX_MOGILEFS_THREADS)
+    ngx_http_mogilefs_loc_conf_t  *mgcf = conf;
+    ngx_str_t                     *value;
 
-    for(i=0;i<NGX_MOGILEFS_MAX_PATHS;i++) {
-        name.data = v->name.data;
-        name.len = v->name.len - 1;
+    if (mgcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-        if(i > 0) {
-            name.data[name.len] = '0' + i;
-            name.len++;
-        }
+    value = cf->args->elts;
 
-        var = ngx_http_add_variable(cf, &name, v->flags);
-        if (var == NULL) {
-            return NGX_ERROR;
-        }
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mgcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
 
-        var->get_handler = v->get_handler;
-        var->data = v->data;
+    mgcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (mgcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_OK;
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"mogilefs_thread_pool\" requires nginx 1.7.11 "
+                       "built with thread pools support");
+    return NGX_CONF_ERROR;
+#endif
 }
 
-static ngx_int_t ngx_http_mogilefs_path_variable(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t data) 
+/*
+ * mogilefs_tracker_keepalive <connections> [noop=<time>]
+ */
+static char *
+ngx_http_mogilefs_tracker_keepalive_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
+    ngx_http_mogilefs_main_conf_t *mmcf = conf;
+    ngx_str_t                     *value, s;
+    ngx_int_t                      n;
 
-    v->len = 0;
-    v->data = (u_char*)"";
+    if (mmcf->keepalive_max) {
+        return "is duplicate";
+    }
 
-    return NGX_OK;
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->keepalive_max = n;
+    mmcf->keepalive_noop = 30000;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "noop=", sizeof("noop=") - 1) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - (sizeof("noop=") - 1);
+        s.data = value[2].data + sizeof("noop=") - 1;
+
+        mmcf->keepalive_noop = ngx_parse_time(&s, 0);
+
+        if (mmcf->keepalive_noop == (ngx_msec_t) NGX_ERROR
+            || mmcf->keepalive_noop == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
 }
 
+/*
+ * mogilefs_adaptive_timeout <factor> [min=<time>] [max=<time>] | off
+ */
 static char *
-ngx_http_mogilefs_tracker_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_mogilefs_adaptive_timeout_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_mogilefs_loc_conf_t    *mgcf = conf;
-    ngx_str_t                       *value;
-    ngx_url_t                        u;
-    ngx_uint_t                       n;
-    ngx_http_script_compile_t        sc;
+    ngx_http_mogilefs_loc_conf_t  *mgcf = conf;
+    ngx_str_t                     *value, s;
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
+    ngx_http_mogilefs_main_conf_t *mmcf;
 
-    if (mgcf->upstream.upstream || mgcf->tracker_lengths) {
+    if (mgcf->adaptive_factor != NGX_CONF_UNSET_UINT) {
         return "is duplicate";
     }
 
     value = cf->args->elts;
 
-    n = ngx_http_script_variables_count(&value[1]);
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        mgcf->adaptive_factor = 0;
+        return NGX_CONF_OK;
+    }
 
-    if(n) { 
-        ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+    n = ngx_atoi(value[1].data, value[1].len);
 
-        sc.cf = cf;
-        sc.source = &value[1];
-        sc.lengths = &mgcf->tracker_lengths;
-        sc.values = &mgcf->tracker_values;
-        sc.variables = n;
-        sc.complete_lengths = 1;
-        sc.complete_values = 1;
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid factor \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-        if (ngx_http_script_compile(&sc) != NGX_OK) {
-            return NGX_CONF_ERROR;
+    mgcf->adaptive_factor = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", sizeof("min=") - 1) == 0) {
+
+            s.len = value[i].len - (sizeof("min=") - 1);
+            s.data = value[i].data + sizeof("min=") - 1;
+
+            mgcf->adaptive_min = ngx_parse_time(&s, 0);
+
+            if (mgcf->adaptive_min == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", sizeof("max=") - 1) == 0) {
+
+            s.len = value[i].len - (sizeof("max=") - 1);
+            s.data = value[i].data + sizeof("max=") - 1;
+
+            mgcf->adaptive_max = ngx_parse_time(&s, 0);
+
+            if (mgcf->adaptive_max == (ngx_msec_t) NGX_ERROR
+                || mgcf->adaptive_max == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
         }
 
-        return NGX_CONF_OK;
+        goto invalid;
     }
 
-    ngx_memzero(&u, sizeof(ngx_url_t));
-
-    u.url = value[1];
-    u.no_resolve = 1;
-    u.default_port = 6001;
-
-    mgcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
-    if (mgcf->upstream.upstream == NULL) {
+    if (mgcf->adaptive_min != NGX_CONF_UNSET_MSEC
+        && mgcf->adaptive_max != NGX_CONF_UNSET_MSEC
+        && mgcf->adaptive_min > mgcf->adaptive_max)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "min is greater than max");
         return NGX_CONF_ERROR;
     }
 
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+
+    mmcf->adaptive_used = 1;
+
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
-/* 
- * Copied from: nginx-1.0.0/src/http/ngx_http_script.c
- * ngx_http_set_complex_value_slot() 
+/*
+ * mogilefs_tracker_max_conns <connections> [queue=<number>] [timeout=<time>]
+ *
+ * The limit and the queue are per worker process and per upstream
  */
 static char *
-ngx_http_mogilefs_complex_command(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
+ngx_http_mogilefs_tracker_max_conns_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char  *p = conf;
-
-    ngx_str_t                          *value;
-    ngx_http_complex_value_t          **cv;
-    ngx_http_compile_complex_value_t    ccv;
-
-    cv = (ngx_http_complex_value_t **) (p + cmd->offset);
-
-    if (*cv != NULL) {
-        return "duplicate";
-    }
+    ngx_http_mogilefs_main_conf_t *mmcf = conf;
+    ngx_str_t                     *value, s;
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
 
-    *cv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (*cv == NULL) {
-        return NGX_CONF_ERROR;
+    if (mmcf->max_conns) {
+        return "is duplicate";
     }
 
     value = cf->args->elts;
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
-
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = *cv;
+    n = ngx_atoi(value[1].data, value[1].len);
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
         return NGX_CONF_ERROR;
     }
 
-    return NGX_CONF_OK;
-}
+    mmcf->max_conns = n;
+    mmcf->max_queue = 100;
+    mmcf->queue_timeout = 1000;
 
-static char *
-ngx_http_mogilefs_class_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_mogilefs_loc_conf_t        *mgcf = conf;
-    ngx_http_mogilefs_class_template_t  *t;
-    ngx_str_t                           *value;
-    ngx_uint_t                           i, n;
-    ngx_http_script_compile_t            sc;
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    if(mgcf->class_templates == NULL) {
-        mgcf->class_templates = ngx_array_create(cf->pool, cf->args->nelts,
-            sizeof(ngx_http_mogilefs_class_template_t));
+        if (ngx_strncmp(value[i].data, "queue=", sizeof("queue=") - 1) == 0) {
 
-        if(mgcf->class_templates == NULL) {
-            return NGX_CONF_ERROR;
-        }
-    }
+            n = ngx_atoi(value[i].data + sizeof("queue=") - 1,
+                         value[i].len - (sizeof("queue=") - 1));
 
-    value = cf->args->elts;
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
 
-    for(i = 1;i < cf->args->nelts;i++) {
-        t = ngx_array_push(mgcf->class_templates);
+            mmcf->max_queue = n;
 
-        if(t == NULL) {
-            return NGX_CONF_ERROR;
+            continue;
         }
 
-        t->source = value[i];
-        t->lengths = NULL;
-        t->values = NULL;
-
-        n = ngx_http_script_variables_count(&t->source);
+        if (ngx_strncmp(value[i].data, "timeout=", sizeof("timeout=") - 1) == 0) {
 
-        if(n) { 
-            ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+            s.len = value[i].len - (sizeof("timeout=") - 1);
+            s.data = value[i].data + sizeof("timeout=") - 1;
 
-            sc.cf = cf;
-            sc.source = &value[i];
-            sc.lengths = &t->lengths;
-            sc.values = &t->values;
-            sc.variables = n;
-            sc.complete_lengths = 1;
-            sc.complete_values = 1;
+            mmcf->queue_timeout = ngx_parse_time(&s, 0);
 
-            if (ngx_http_script_compile(&sc) != NGX_OK) {
-                return NGX_CONF_ERROR;
+            if (mmcf->queue_timeout == (ngx_msec_t) NGX_ERROR
+                || mmcf->queue_timeout == 0)
+            {
+                goto invalid;
             }
+
+            continue;
         }
+
+        goto invalid;
     }
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
-static char*
-ngx_http_mogilefs_create_spare_location(ngx_conf_t *cf, ngx_http_conf_ctx_t **octx, ngx_str_t *name,
-    ngx_http_mogilefs_location_type_t location_type)
+/*
+ * mogilefs_cache_snapshot <file> [interval=<time>] [valid=<time>]
+ */
+static char *
+ngx_http_mogilefs_cache_snapshot_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_mogilefs_loc_conf_t *mgcf, *pmgcf;
-    ngx_http_conf_ctx_t       *ctx, *pctx = cf->ctx;
-    ngx_uint_t                 i;
-    ngx_http_module_t         *module;
-    void                      *mconf;
-    ngx_http_core_loc_conf_t  *clcf, *pclcf, *rclcf;
-    ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_mogilefs_main_conf_t *mmcf = conf;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    u_char                        *p;
 
-    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_conf_ctx_t));
-    if (ctx == NULL) {
+    if (mmcf->cache_snapshot.data != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mmcf->cache_snapshot = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &mmcf->cache_snapshot, 0) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    pctx = cf->ctx;
-    ctx->main_conf = pctx->main_conf;
-    ctx->srv_conf = pctx->srv_conf;
+    mmcf->cache_snapshot_temp.len = mmcf->cache_snapshot.len + sizeof(".tmp") - 1;
 
-    ctx->loc_conf = ngx_pcalloc(cf->pool, sizeof(void *) * ngx_http_max_module);
-    if (ctx->loc_conf == NULL) {
+    p = ngx_pnalloc(cf->pool, mmcf->cache_snapshot_temp.len + 1);
+    if (p == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    for (i = 0; ngx_modules[i]; i++) {
-        if (ngx_modules[i]->type != NGX_HTTP_MODULE) {
-            continue;
-        }
+    mmcf->cache_snapshot_temp.data = p;
 
-        module = ngx_modules[i]->ctx;
+    p = ngx_cpymem(p, mmcf->cache_snapshot.data, mmcf->cache_snapshot.len);
+    ngx_memcpy(p, ".tmp", sizeof(".tmp"));
 
-        if (module->create_loc_conf) {
+    mmcf->cache_snapshot_interval = 60;
+    mmcf->cache_snapshot_valid = 0;
 
-            mconf = module->create_loc_conf(cf);
-            if (mconf == NULL) {
-                 return NGX_CONF_ERROR;
-            }
+    for (i = 2; i < cf->args->nelts; i++) {
 
-            ctx->loc_conf[ngx_modules[i]->ctx_index] = mconf;
-        }
-    }
+        if (ngx_strncmp(value[i].data, "interval=", sizeof("interval=") - 1) == 0) {
+            s.len = value[i].len - (sizeof("interval=") - 1);
+            s.data = value[i].data + sizeof("interval=") - 1;
 
-    pclcf = pctx->loc_conf[ngx_http_core_module.ctx_index];
+            mmcf->cache_snapshot_interval = ngx_parse_time(&s, 1);
 
-    clcf = ctx->loc_conf[ngx_http_core_module.ctx_index];
+            if (mmcf->cache_snapshot_interval == (time_t) NGX_ERROR
+                || mmcf->cache_snapshot_interval == 0)
+            {
+                goto invalid;
+            }
 
-    mgcf = ctx->loc_conf[ngx_http_mogilefs_module.ctx_index];
+            continue;
+        }
 
-    mgcf->location_type = location_type;
+        if (ngx_strncmp(value[i].data, "valid=", sizeof("valid=") - 1) == 0) {
+            s.len = value[i].len - (sizeof("valid=") - 1);
+            s.data = value[i].data + sizeof("valid=") - 1;
 
-    if(location_type != NGX_MOGILEFS_FETCH) {
-        pmgcf = pctx->loc_conf[ngx_http_mogilefs_module.ctx_index];
+            mmcf->cache_snapshot_valid = ngx_parse_time(&s, 1);
 
-        mgcf->methods = NGX_HTTP_PUT;
+            if (mmcf->cache_snapshot_valid == (time_t) NGX_ERROR) {
+                goto invalid;
+            }
 
-        /*
-         * Copy tracker configuration
-         */
-        mgcf->tracker_lengths = pmgcf->tracker_lengths;
-        mgcf->tracker_values = pmgcf->tracker_values;
+            continue;
+        }
 
-        mgcf->parent = pmgcf;
+        goto invalid;
+    }
 
-        ngx_memcpy(&mgcf->upstream, &pmgcf->upstream, sizeof(ngx_http_upstream_conf_t));
+    mmcf->cache_used = 1;
 
-        ngx_memcpy(mgcf->index, pmgcf->index, NGX_MOGILEFS_MAX_PATHS * sizeof(ngx_int_t));
+    return NGX_CONF_OK;
 
-        clcf->handler = ngx_http_mogilefs_handler;
-    }
+invalid:
 
-    name->len = sizeof("/mogstored_spare_") - 1 + NGX_OFF_T_LEN + 1;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
 
-    name->data = ngx_palloc(cf->pool, name->len);
+    return NGX_CONF_ERROR;
+}
 
-    if(name->data == NULL) {
-        return NGX_CONF_ERROR;
-    }
+/*
+ * mogilefs_cache <time> | off
+ */
+static char *
+ngx_http_mogilefs_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mogilefs_loc_conf_t  *mgcf = conf;
+    ngx_http_mogilefs_main_conf_t *mmcf;
+    ngx_str_t                     *value;
 
-    name->len = ngx_sprintf(name->data, "/mogstored_spare_%O/", (off_t)(uintptr_t)clcf) - name->data;
+    if (mgcf->cache_valid != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
 
-    clcf->loc_conf = ctx->loc_conf;
-    clcf->name = *name;
-    clcf->exact_match = 0;
-    clcf->noname = 0;
-    clcf->internal = 1;
-    clcf->noregex = 1;
+    value = cf->args->elts;
 
-    cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mgcf->cache_valid = 0;
+        return NGX_CONF_OK;
+    }
 
-    rclcf = cscf->ctx->loc_conf[ngx_http_core_module.ctx_index];
+    mgcf->cache_valid = ngx_parse_time(&value[1], 1);
 
-    if (ngx_http_add_location(cf, &rclcf->locations, clcf) != NGX_OK) {
+    if (mgcf->cache_valid == (time_t) NGX_ERROR || mgcf->cache_valid == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid time \"%V\"", &value[1]);
         return NGX_CONF_ERROR;
     }
 
-    if(octx != NULL) {
-        *octx = ctx;
-    }
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+    mmcf->cache_used = 1;
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_mogilefs_pass_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_mogilefs_purge_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_mogilefs_loc_conf_t *pmgcf = conf;
-    ngx_http_core_loc_conf_t  *pclcf;
-    ngx_http_conf_ctx_t       *ctx;
-    char                      *rv;
-    ngx_str_t                 *value;
-    ngx_conf_t                 save;
-    ngx_http_script_compile_t  sc;
-    ngx_uint_t                 n, i;
-    char                      *rc;
-    ngx_str_t                  name;
-
-    if (pmgcf->fetch_location.len != 0) {
-        return "is duplicate";
-    }
+    ngx_http_mogilefs_main_conf_t *mmcf;
+    ngx_http_core_loc_conf_t      *clcf;
 
-    if (pmgcf->upstream.upstream == 0 && pmgcf->tracker_lengths == NULL) {
-        return "no tracker defined";
-    }
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
+    mmcf->cache_used = 1;
 
-    if (pmgcf->domain_complex == NULL) {
-        return "no domain defined";
-    }
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mogilefs_purge_handler;
 
-    for(i=0;i < NGX_MOGILEFS_MAX_PATHS;i++) {
-        name.data = ngx_http_mogilefs_path.data;
-        name.len = ngx_http_mogilefs_path.len - 1;
+    return NGX_CONF_OK;
+}
 
-        if(i > 0) {
-            name.data[name.len] = '0' + i;
-            name.len++;
-        }
+static ngx_int_t
+ngx_http_mogilefs_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                      i;
+    ngx_http_core_loc_conf_t       *clcf, *mclcf;
+    ngx_http_mogilefs_upstream_t   *ka;
+    ngx_http_mogilefs_dispatch_t   *d;
+    ngx_http_mogilefs_loc_conf_t   *mgcf;
+    ngx_http_mogilefs_main_conf_t  *mmcf;
 
-        pmgcf->index[i] = ngx_http_get_variable_index(cf, &name);
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mogilefs_module);
 
-        if (pmgcf->index[i] == NGX_ERROR) {
-            return NGX_CONF_ERROR;
-        }
+    if (mmcf->status_used && mmcf->status_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "mogilefs_status requires mogilefs_status_zone");
+        return NGX_ERROR;
     }
 
-    rc = ngx_http_mogilefs_create_spare_location(cf, NULL, &pmgcf->create_open_spare_location,
-        NGX_MOGILEFS_CREATE_OPEN);
-
-    if(rc != NGX_CONF_OK) {
-        return rc;
+    if (mmcf->adaptive_used && mmcf->status_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "mogilefs_adaptive_timeout requires mogilefs_status_zone");
+        return NGX_ERROR;
     }
 
-    rc = ngx_http_mogilefs_create_spare_location(cf, &ctx, &pmgcf->fetch_location,
-        NGX_MOGILEFS_FETCH);
-
-    if(rc != NGX_CONF_OK) {
-        return rc;
+    if (mmcf->cache_used && mmcf->cache_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "mogilefs_cache, mogilefs_cache_snapshot and mogilefs_purge "
+                           "require mogilefs_cache_zone");
+        return NGX_ERROR;
     }
 
-    rc = ngx_http_mogilefs_create_spare_location(cf, NULL, &pmgcf->create_close_spare_location,
-        NGX_MOGILEFS_CREATE_CLOSE);
+    /*
+     * Balancers are initialized by now, requests to the trackers
+     * go through idle connections first and get adaptive timeout
+     */
+    ka = mmcf->upstreams.elts;
 
-    if(rc != NGX_CONF_OK) {
-        return rc;
+    for (i = 0; (mmcf->keepalive_max || mmcf->adaptive_used)
+                && i < mmcf->upstreams.nelts; i++)
+    {
+        ka[i].original_init_peer = ka[i].upstream->peer.init;
+        ka[i].upstream->peer.init = ngx_http_mogilefs_init_peer;
     }
 
-    pmgcf->location_type = NGX_MOGILEFS_MAIN;
-
-    pclcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    pclcf->handler = ngx_http_mogilefs_handler;
-
-    if(cf->args->nelts > 1) { 
-        value = cf->args->elts;
-
-        pmgcf->key = value[1];
+    for (i = 0; i < NGX_MOGILEFS_VARS; i++) {
+        mmcf->var_index[i] = ngx_http_get_variable_index(cf,
+                                 &ngx_http_mogilefs_variable_names[i]);
 
-        n = ngx_http_script_variables_count(&pmgcf->key);
+        if (mmcf->var_index[i] == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
 
-        ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+    /*
+     * Locations are merged by now, those with mogilefs_put_memory_threshold
+     * above client_body_buffer_size get a copy of their configuration
+     * with a larger buffer to read small bodies to
+     */
+    d = mmcf->dispatch.elts;
 
-        sc.cf = cf;
-        sc.source = &pmgcf->key;
-        sc.lengths = &pmgcf->key_lengths;
-        sc.values = &pmgcf->key_values;
-        sc.variables = n;
-        sc.complete_lengths = 1;
-        sc.complete_values = 1;
+    for (i = 0; i < mmcf->dispatch.nelts; i++) {
+        mgcf = d[i].loc_conf[ngx_http_mogilefs_module.ctx_index];
+        clcf = d[i].loc_conf[ngx_http_core_module.ctx_index];
 
-        if (ngx_http_script_compile(&sc) != NGX_OK) {
-            return NGX_CONF_ERROR;
+        if (mgcf->put_memory_threshold <= clcf->client_body_buffer_size) {
+            continue;
         }
-    }
-
-    save = *cf;
-    cf->ctx = ctx;
-    cf->cmd_type = NGX_HTTP_LOC_CONF;
 
-    rv = ngx_conf_parse(cf, NULL);
+        mgcf->put_memory_loc_conf = ngx_palloc(cf->pool,
+                                        sizeof(void *) * ngx_http_max_module);
+        if (mgcf->put_memory_loc_conf == NULL) {
+            return NGX_ERROR;
+        }
 
-    *cf = save;
+        ngx_memcpy(mgcf->put_memory_loc_conf, d[i].loc_conf,
+                   sizeof(void *) * ngx_http_max_module);
 
-    return rv;
-}
+        mclcf = ngx_palloc(cf->pool, sizeof(ngx_http_core_loc_conf_t));
+        if (mclcf == NULL) {
+            return NGX_ERROR;
+        }
 
-static ngx_int_t
-ngx_http_mogilefs_init(ngx_conf_t *cf)
-{
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+        ngx_memcpy(mclcf, clcf, sizeof(ngx_http_core_loc_conf_t));
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+        mclcf->client_body_buffer_size = mgcf->put_memory_threshold;
 
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+        mgcf->put_memory_loc_conf[ngx_http_core_module.ctx_index] = mclcf;
     }
 
-    *h = ngx_http_mogilefs_put_handler;
-
     return NGX_OK;
 }